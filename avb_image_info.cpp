@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "avb_image_info.h"
+
+#include <array>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <libavb/libavb.h>
+#include <openssl/sha.h>
+
+#include "gsi_trace.h"
+#include "image_backend.h"
+
+namespace android {
+namespace gsi {
+
+using android::base::ReadFullyAtOffset;
+
+bool ReadAvbImageInfo(uint64_t total_size, const ReadAtOffsetFn& read_at, AvbImageInfo* info) {
+    GSI_TRACE_CALL();
+    // Read the AVB footer from EOF.
+    if (total_size < AVB_FOOTER_SIZE) {
+        LOG(ERROR) << "image is too small for an AVB footer";
+        return false;
+    }
+    uint64_t footer_offset = total_size - AVB_FOOTER_SIZE;
+    std::array<uint8_t, AVB_FOOTER_SIZE> footer_bytes;
+    if (!read_at(footer_bytes.data(), AVB_FOOTER_SIZE, footer_offset)) {
+        PLOG(ERROR) << "cannot read AVB footer";
+        return false;
+    }
+    // Validate the AVB footer data and byte swap to native byte order.
+    AvbFooter footer;
+    if (!avb_footer_validate_and_byteswap((const AvbFooter*)footer_bytes.data(), &footer)) {
+        LOG(ERROR) << "invalid AVB footer";
+        return false;
+    }
+    // Read the VBMeta image.
+    if (footer.vbmeta_offset > total_size ||
+        footer.vbmeta_size > total_size - footer.vbmeta_offset) {
+        LOG(ERROR) << "VBMeta image is out of bounds";
+        return false;
+    }
+    std::vector<uint8_t> vbmeta_bytes(footer.vbmeta_size);
+    if (!read_at(vbmeta_bytes.data(), vbmeta_bytes.size(), footer.vbmeta_offset)) {
+        PLOG(ERROR) << "cannot read VBMeta image";
+        return false;
+    }
+    // Validate the VBMeta image and retrieve AVB public key.
+    // After a successful call to avb_vbmeta_image_verify(), public_key_data
+    // will point to the serialized AVB public key, in the same format generated
+    // by the `avbtool extract_public_key` command.
+    const uint8_t* public_key_data;
+    size_t public_key_size;
+    AvbVBMetaVerifyResult result = avb_vbmeta_image_verify(vbmeta_bytes.data(), vbmeta_bytes.size(),
+                                                           &public_key_data, &public_key_size);
+    if (result != AVB_VBMETA_VERIFY_RESULT_OK) {
+        LOG(ERROR) << "invalid VBMeta image: " << avb_vbmeta_verify_result_to_string(result);
+        return false;
+    }
+    if (public_key_data != nullptr) {
+        info->public_key.assign(public_key_data, public_key_data + public_key_size);
+        info->public_key_sha1.resize(SHA_DIGEST_LENGTH);
+        SHA1(public_key_data, public_key_size, info->public_key_sha1.data());
+        info->public_key_sha256.resize(SHA256_DIGEST_LENGTH);
+        SHA256(public_key_data, public_key_size, info->public_key_sha256.data());
+    }
+
+    // avb_vbmeta_image_verify() checked that the header and both blocks fit
+    // within vbmeta_bytes, which may include trailing padding.
+    AvbVBMetaImageHeader header;
+    avb_vbmeta_image_header_to_host_byte_order(
+            reinterpret_cast<const AvbVBMetaImageHeader*>(vbmeta_bytes.data()), &header);
+    size_t vbmeta_size = sizeof(AvbVBMetaImageHeader) + header.authentication_data_block_size +
+                         header.auxiliary_data_block_size;
+    info->vbmeta_sha256.resize(SHA256_DIGEST_LENGTH);
+    SHA256(vbmeta_bytes.data(), vbmeta_size, info->vbmeta_sha256.data());
+    info->rollback_index = header.rollback_index;
+    info->algorithm_type = header.algorithm_type;
+    info->flags = header.flags;
+    return true;
+}
+
+bool ReadAvbImageInfoFromFd(int fd, AvbImageInfo* info) {
+    auto read_at = [fd](void* data, size_t size, uint64_t offset) -> bool {
+        return ReadFullyAtOffset(fd, data, size, offset);
+    };
+    return ReadAvbImageInfo(GetImageSize(fd), read_at, info);
+}
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <benchmark/benchmark.h>
+#include <libavb/libavb.h>
+#include <openssl/bn.h>
+#include <openssl/nid.h>
+#include <openssl/rsa.h>
+#include <openssl/sha.h>
+
+#include "avb_image_info.h"
+
+using namespace android::gsi;
+
+static constexpr uint64_t kImageSize = 1024 * 1024;
+// The VBMeta image is placed just before the footer, like avbtool does for
+// a hashtree footer.
+static constexpr uint64_t kVBMetaOffset = kImageSize - 16 * 1024;
+
+static uint64_t RoundUp(uint64_t value, uint64_t align) {
+    return (value + align - 1) / align * align;
+}
+
+// Serialize |rsa| as an AvbRSAPublicKeyHeader followed by the modulus and
+// R^2 mod N, which is what `avbtool extract_public_key` produces.
+static std::vector<uint8_t> EncodeAvbPublicKey(const RSA* rsa) {
+    const BIGNUM* n = RSA_get0_n(rsa);
+    size_t key_bytes = BN_num_bytes(n);
+    uint32_t key_bits = key_bytes * 8;
+
+    std::vector<uint8_t> key(sizeof(AvbRSAPublicKeyHeader) + key_bytes * 2);
+    uint8_t* modulus = key.data() + sizeof(AvbRSAPublicKeyHeader);
+    uint8_t* rr_bytes = modulus + key_bytes;
+    CHECK(BN_bn2bin_padded(modulus, key_bytes, n));
+
+    bssl::UniquePtr<BN_CTX> ctx(BN_CTX_new());
+    bssl::UniquePtr<BIGNUM> rr(BN_new());
+    CHECK(BN_set_bit(rr.get(), key_bits * 2));
+    CHECK(BN_mod(rr.get(), rr.get(), n, ctx.get()));
+    CHECK(BN_bn2bin_padded(rr_bytes, key_bytes, rr.get()));
+
+    // n0inv = -1 / n mod 2^32, by Newton's iteration on the low word.
+    uint32_t n0 = (modulus[key_bytes - 4] << 24) | (modulus[key_bytes - 3] << 16) |
+                  (modulus[key_bytes - 2] << 8) | modulus[key_bytes - 1];
+    uint32_t inverse = n0;
+    for (int i = 0; i < 5; i++) {
+        inverse *= 2 - n0 * inverse;
+    }
+
+    AvbRSAPublicKeyHeader header = {
+            .key_num_bits = avb_htobe32(key_bits),
+            .n0inv = avb_htobe32(0 - inverse),
+    };
+    memcpy(key.data(), &header, sizeof(header));
+    return key;
+}
+
+// Build a VBMeta image signed with a fresh SHA256_RSA<key_bits> key.
+static std::vector<uint8_t> BuildSignedVBMeta(int key_bits) {
+    bssl::UniquePtr<RSA> rsa(RSA_new());
+    bssl::UniquePtr<BIGNUM> e(BN_new());
+    CHECK(BN_set_word(e.get(), RSA_F4));
+    CHECK(RSA_generate_key_ex(rsa.get(), key_bits, e.get(), nullptr));
+
+    auto public_key = EncodeAvbPublicKey(rsa.get());
+    size_t signature_size = key_bits / 8;
+    uint64_t auth_size = RoundUp(SHA256_DIGEST_LENGTH + signature_size, 64);
+    uint64_t aux_size = RoundUp(public_key.size(), 64);
+
+    AvbVBMetaImageHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, AVB_MAGIC, AVB_MAGIC_LEN);
+    header.required_libavb_version_major = avb_htobe32(AVB_VERSION_MAJOR);
+    header.authentication_data_block_size = avb_htobe64(auth_size);
+    header.auxiliary_data_block_size = avb_htobe64(aux_size);
+    header.algorithm_type = avb_htobe32(key_bits == 4096 ? AVB_ALGORITHM_TYPE_SHA256_RSA4096
+                                                         : AVB_ALGORITHM_TYPE_SHA256_RSA2048);
+    header.hash_offset = avb_htobe64(0);
+    header.hash_size = avb_htobe64(SHA256_DIGEST_LENGTH);
+    header.signature_offset = avb_htobe64(SHA256_DIGEST_LENGTH);
+    header.signature_size = avb_htobe64(signature_size);
+    header.public_key_offset = avb_htobe64(0);
+    header.public_key_size = avb_htobe64(public_key.size());
+    header.rollback_index = avb_htobe64(1);
+
+    std::vector<uint8_t> aux(aux_size);
+    memcpy(aux.data(), public_key.data(), public_key.size());
+
+    // The hash covers the header and the auxiliary block.
+    std::vector<uint8_t> auth(auth_size);
+    SHA256_CTX sha;
+    SHA256_Init(&sha);
+    SHA256_Update(&sha, &header, sizeof(header));
+    SHA256_Update(&sha, aux.data(), aux.size());
+    SHA256_Final(auth.data(), &sha);
+
+    unsigned int signature_len = 0;
+    CHECK(RSA_sign(NID_sha256, auth.data(), SHA256_DIGEST_LENGTH,
+                   auth.data() + SHA256_DIGEST_LENGTH, &signature_len, rsa.get()));
+    CHECK(signature_len == signature_size);
+
+    std::vector<uint8_t> vbmeta(reinterpret_cast<uint8_t*>(&header),
+                                reinterpret_cast<uint8_t*>(&header) + sizeof(header));
+    vbmeta.insert(vbmeta.end(), auth.begin(), auth.end());
+    vbmeta.insert(vbmeta.end(), aux.begin(), aux.end());
+    return vbmeta;
+}
+
+// Write a kImageSize image with a signed VBMeta image and an AVB footer.
+static void WriteAvbImage(int fd, int key_bits) {
+    auto vbmeta = BuildSignedVBMeta(key_bits);
+    CHECK(ftruncate(fd, kImageSize) == 0);
+    CHECK(android::base::WriteFullyAtOffset(fd, vbmeta.data(), vbmeta.size(), kVBMetaOffset));
+
+    AvbFooter footer;
+    memset(&footer, 0, sizeof(footer));
+    memcpy(footer.magic, AVB_FOOTER_MAGIC, AVB_FOOTER_MAGIC_LEN);
+    footer.version_major = avb_htobe32(AVB_FOOTER_VERSION_MAJOR);
+    footer.version_minor = avb_htobe32(AVB_FOOTER_VERSION_MINOR);
+    footer.original_image_size = avb_htobe64(kVBMetaOffset);
+    footer.vbmeta_offset = avb_htobe64(kVBMetaOffset);
+    footer.vbmeta_size = avb_htobe64(vbmeta.size());
+    CHECK(android::base::WriteFullyAtOffset(fd, &footer, sizeof(footer),
+                                            kImageSize - AVB_FOOTER_SIZE));
+}
+
+// Parse the AVB footer and verify the VBMeta image of a file-backed image,
+// as GsiService::getAvbPublicKey() does through GetAvbPublicKeyFromFd().
+// The key size is state.range(0) bits.
+static void BM_AvbReadImageInfo(benchmark::State& state) {
+    TemporaryFile image;
+    WriteAvbImage(image.fd, state.range(0));
+
+    for (auto _ : state) {
+        AvbImageInfo info;
+        CHECK(ReadAvbImageInfoFromFd(image.fd, &info));
+        benchmark::DoNotOptimize(info.public_key_sha256.data());
+    }
+}
+BENCHMARK(BM_AvbReadImageInfo)->Arg(2048)->Arg(4096);
@@ -0,0 +1,510 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Microbenchmarks for gsid's data paths, run against file-backed images so
+// that they work on any Linux host as well as on a device:
+//
+//   gsid_benchmark --benchmark_out=before.json --benchmark_out_format=json
+//
+// Inputs are fixed in size and content, so results from two builds can be
+// compared with Google Benchmark's tools/compare.py.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+#include <benchmark/benchmark.h>
+
+#include "block_hashes.h"
+#include "delta_patch.h"
+#include "file_image_backend.h"
+#include "io_throttle.h"
+#include "partition_writer.h"
+
+using namespace android::gsi;
+using android::base::unique_fd;
+
+static constexpr uint64_t kImageSize = 64 * 1024 * 1024;
+static const std::string kImageName = "bench_gsi";
+
+// Fills |fd| with |size| bytes of a repeating pattern.
+static bool WriteSource(int fd, uint64_t size) {
+    std::string block(1024 * 1024, 'g');
+    for (uint64_t written = 0; written < size; written += block.size()) {
+        if (!android::base::WriteFully(fd, block.data(), block.size())) {
+            return false;
+        }
+    }
+    return lseek(fd, 0, SEEK_SET) == 0;
+}
+
+// Creates a fresh image and opens it for writing.
+static std::unique_ptr<PartitionWriter> CreateWriter(
+        FileImageBackend* images, ServiceStats* stats,
+        PartitionWriter::Callbacks callbacks = PartitionWriter::Callbacks{},
+        const PartitionWriter::Options& options = {}) {
+    CHECK(images->CreateBackingImage(kImageName, kImageSize, true, nullptr));
+    auto device = images->OpenImageDevice(kImageName);
+    CHECK(device);
+    return std::make_unique<PartitionWriter>(std::move(device), kImageSize, stats,
+                                             std::move(callbacks), options);
+}
+
+// Writer options for the benchmark argument |direct|. O_DIRECT falls back to
+// buffered writes on file systems without support for it, such as tmpfs.
+static PartitionWriter::Options WriterOptions(int64_t direct) {
+    return PartitionWriter::Options{.direct_io = direct != 0};
+}
+
+// Commits a 64MiB image read from a file, in chunks of state.range(0) bytes,
+// as a client of IGsiService::commitGsiChunkFromStream would. state.range(1)
+// selects O_DIRECT writes.
+static void BM_StreamCommit(benchmark::State& state) {
+    TemporaryDir dir;
+    FileImageBackend images(dir.path);
+    TemporaryFile source;
+    CHECK(WriteSource(source.fd, kImageSize));
+
+    const uint64_t chunk_size = state.range(0);
+    ServiceStats stats;
+    for (auto _ : state) {
+        state.PauseTiming();
+        CHECK(lseek(source.fd, 0, SEEK_SET) == 0);
+        auto writer = CreateWriter(&images, &stats, {}, WriterOptions(state.range(1)));
+        state.ResumeTiming();
+
+        for (uint64_t offset = 0; offset < kImageSize; offset += chunk_size) {
+            CHECK(writer->CommitChunk(source.fd, chunk_size));
+        }
+        CHECK(writer->Flush());
+
+        state.PauseTiming();
+        CHECK(writer->IsFinishedWriting());
+        writer = nullptr;
+        CHECK(images.DeleteBackingImage(kImageName));
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed(state.iterations() * kImageSize);
+}
+BENCHMARK(BM_StreamCommit)
+        ->ArgsProduct({{64 * 1024, 1024 * 1024, 8 * 1024 * 1024}, {0, 1}})
+        ->ArgNames({"chunk", "direct"});
+
+// Stream-commits a 64MiB image with buffered writes and a write-behind window
+// of state.range(0) MiB (0 disables it). The time spent in the final
+// Flush() is reported separately.
+static void BM_WriteBehind(benchmark::State& state) {
+    TemporaryDir dir;
+    FileImageBackend images(dir.path);
+    TemporaryFile source;
+    CHECK(WriteSource(source.fd, kImageSize));
+
+    PartitionWriter::Options options = {
+            .writeback_window = static_cast<uint64_t>(state.range(0)) * 1024 * 1024,
+    };
+    ServiceStats stats;
+    std::chrono::steady_clock::duration flush_time{};
+    for (auto _ : state) {
+        state.PauseTiming();
+        CHECK(lseek(source.fd, 0, SEEK_SET) == 0);
+        auto writer = CreateWriter(&images, &stats, {}, options);
+        state.ResumeTiming();
+
+        CHECK(writer->CommitChunk(source.fd, kImageSize));
+        ScopedTimer timer(nullptr);
+        CHECK(writer->Flush());
+        flush_time += timer.Stop();
+
+        state.PauseTiming();
+        writer = nullptr;
+        CHECK(images.DeleteBackingImage(kImageName));
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed(state.iterations() * kImageSize);
+    state.counters["flush_ms"] = benchmark::Counter(
+            std::chrono::duration<double, std::milli>(flush_time).count() / state.iterations());
+}
+BENCHMARK(BM_WriteBehind)->Arg(0)->Arg(4)->Arg(16)->UseRealTime();
+
+// Commits a 64MiB image from a buffer, as IGsiService::commitGsiChunkFromAshmem
+// would.
+static void BM_BufferCommit(benchmark::State& state) {
+    TemporaryDir dir;
+    FileImageBackend images(dir.path);
+    std::string buffer(state.range(0), 'g');
+    ServiceStats stats;
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto writer = CreateWriter(&images, &stats);
+        state.ResumeTiming();
+
+        for (uint64_t offset = 0; offset < kImageSize; offset += buffer.size()) {
+            CHECK(writer->CommitChunk(buffer.data(), buffer.size()));
+        }
+        CHECK(writer->Flush());
+
+        state.PauseTiming();
+        writer = nullptr;
+        CHECK(images.DeleteBackingImage(kImageName));
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed(state.iterations() * kImageSize);
+}
+BENCHMARK(BM_BufferCommit)->Arg(64 * 1024)->Arg(1024 * 1024)->Arg(8 * 1024 * 1024);
+
+// Commits a 64MiB image from a buffer through an IoThrottle fixed at
+// state.range(0) MiB/s, with no device to monitor. The reported rate should
+// track the limit closely; the throttle_wait_us counter shows how the time
+// was spent.
+static void BM_ThrottledCommit(benchmark::State& state) {
+    TemporaryDir dir;
+    FileImageBackend images(dir.path);
+    std::string buffer(1024 * 1024, 'g');
+    ServiceStats stats;
+    const uint64_t rate = state.range(0) * 1024 * 1024;
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        IoThrottle throttle("", {.min_rate = rate, .max_rate = rate, .target_latency = {}},
+                            &stats);
+        auto writer = CreateWriter(&images, &stats, {}, {.throttle = &throttle});
+        state.ResumeTiming();
+
+        for (uint64_t offset = 0; offset < kImageSize; offset += buffer.size()) {
+            CHECK(writer->CommitChunk(buffer.data(), buffer.size()));
+        }
+        CHECK(writer->Flush());
+
+        state.PauseTiming();
+        writer = nullptr;
+        CHECK(images.DeleteBackingImage(kImageName));
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed(state.iterations() * kImageSize);
+    state.counters["throttle_wait_us"] =
+            benchmark::Counter(stats.throttle_wait_us.sum(), benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_ThrottledCommit)
+        ->Arg(128)
+        ->Arg(512)
+        ->UseRealTime()
+        ->Unit(benchmark::kMillisecond);
+
+// Commits a 64MiB image through a shared memory region of state.range(0)
+// bytes, as IGsiService::commitGsiChunkFromAshmem does. memfd stands in for
+// ashmem, which is not available on a host. state.range(1) selects O_DIRECT
+// writes, which go straight from the shared region to the device.
+static void BM_AshmemCommit(benchmark::State& state) {
+    TemporaryDir dir;
+    FileImageBackend images(dir.path);
+    const size_t ashmem_size = state.range(0);
+    unique_fd ashmem(memfd_create("gsid_benchmark", MFD_CLOEXEC));
+    CHECK(ashmem >= 0 && ftruncate(ashmem, ashmem_size) == 0);
+    ServiceStats stats;
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto writer = CreateWriter(&images, &stats, {}, WriterOptions(state.range(1)));
+        CHECK(writer->MapAshmem(ashmem, ashmem_size));
+        state.ResumeTiming();
+
+        for (uint64_t offset = 0; offset < kImageSize; offset += ashmem_size) {
+            CHECK(writer->CommitAshmemChunk(ashmem_size));
+        }
+        CHECK(writer->Flush());
+
+        state.PauseTiming();
+        writer = nullptr;
+        CHECK(images.DeleteBackingImage(kImageName));
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed(state.iterations() * kImageSize);
+}
+BENCHMARK(BM_AshmemCommit)
+        ->ArgsProduct({{64 * 1024, 1024 * 1024, 8 * 1024 * 1024}, {0, 1}})
+        ->ArgNames({"chunk", "direct"});
+
+// Writes a delta patch to |fd| that rewrites every 4KiB block of a 64MiB
+// image, sending |percent| of the blocks as data and keeping the rest in
+// place. Returns the size of the patch.
+static uint64_t WriteDeltaPatch(int fd, int percent) {
+    static constexpr uint64_t kBlockSize = 4096;
+    std::string patch;
+    auto add_op = [&](uint32_t type, uint64_t offset, uint64_t length) -> void {
+        DeltaPatchApplier::DeltaOpHeader header = {
+                .type = type,
+                .length = length,
+                .source_offset = type == DeltaPatchApplier::kCopy ? offset : 0,
+        };
+        patch.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        if (type == DeltaPatchApplier::kData) {
+            patch.append(length, 'd');
+        }
+    };
+    // Changed blocks are spread evenly, one at the start of each stride.
+    uint64_t blocks = kImageSize / kBlockSize;
+    uint64_t changed = blocks * percent / 100;
+    uint64_t stride = changed ? blocks / changed : blocks;
+    for (uint64_t block = 0; block < blocks; block += stride) {
+        uint64_t run = std::min(stride, blocks - block);
+        uint64_t offset = block * kBlockSize;
+        if (changed) {
+            add_op(DeltaPatchApplier::kData, offset, kBlockSize);
+            offset += kBlockSize;
+            run--;
+        }
+        if (run) {
+            add_op(DeltaPatchApplier::kCopy, offset, run * kBlockSize);
+        }
+    }
+    CHECK(android::base::WriteFully(fd, patch.data(), patch.size()));
+    return patch.size();
+}
+
+// Applies a delta patch to an existing 64MiB image, as a client of
+// IGsiService::commitGsiPatchFromStream would, with state.range(0) percent
+// of the blocks changed. Throughput is in bytes of image produced.
+static void BM_ApplyPatch(benchmark::State& state) {
+    TemporaryDir dir;
+    FileImageBackend images(dir.path);
+    TemporaryFile patch;
+    uint64_t patch_size = WriteDeltaPatch(patch.fd, state.range(0));
+
+    ServiceStats stats;
+    auto writer = CreateWriter(&images, &stats);
+    TemporaryFile source;
+    CHECK(WriteSource(source.fd, kImageSize));
+    CHECK(writer->CommitChunk(source.fd, kImageSize));
+    CHECK(writer->Flush());
+    writer = nullptr;
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        CHECK(lseek(patch.fd, 0, SEEK_SET) == 0);
+        auto device = images.OpenImageDevice(kImageName);
+        CHECK(device);
+        writer = std::make_unique<PartitionWriter>(std::move(device), kImageSize, &stats,
+                                                   PartitionWriter::Callbacks{});
+        DeltaPatchApplier applier(writer.get(), &stats);
+        state.ResumeTiming();
+
+        CHECK(applier.Apply(patch.fd, patch_size) == static_cast<int64_t>(patch_size));
+        CHECK(writer->Flush());
+
+        state.PauseTiming();
+        CHECK(writer->IsFinishedWriting());
+        writer = nullptr;
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed(state.iterations() * kImageSize);
+    state.counters["patch_bytes"] = patch_size;
+}
+BENCHMARK(BM_ApplyPatch)->Arg(1)->Arg(10)->Arg(100);
+
+// Computes the block hash manifest of a 64MiB image with blocks of
+// state.range(0) bytes, as IGsiService::getPartitionBlockHashes does.
+static void BM_BlockHashes(benchmark::State& state) {
+    TemporaryFile image;
+    CHECK(WriteSource(image.fd, kImageSize));
+    std::vector<uint8_t> hashes;
+    for (auto _ : state) {
+        CHECK(ComputeBlockHashes(image.fd, kImageSize, state.range(0), &hashes));
+    }
+    state.SetBytesProcessed(state.iterations() * kImageSize);
+}
+BENCHMARK(BM_BlockHashes)->Arg(4096)->Arg(64 * 1024)->UseRealTime();
+
+// Erases the head of a writable image, as PartitionInstaller::WipeWritable
+// does when wiping a DSU userdata image.
+static void BM_WipeWritable(benchmark::State& state) {
+    TemporaryDir dir;
+    FileImageBackend images(dir.path, false);
+    CHECK(images.CreateBackingImage(kImageName, kImageSize, false, nullptr));
+
+    for (auto _ : state) {
+        auto device = images.OpenImageDevice(kImageName);
+        CHECK(device && WipeImageDevice(device.get()));
+        CHECK(fsync(device->fd()) == 0);
+    }
+}
+BENCHMARK(BM_WipeWritable);
+
+// Allocates a 256MiB writable and a 64MiB read-only image, like userdata
+// and system, one after the other (arg 0) or with a single
+// CreateBackingImages() call (arg 1), as createPartition() and
+// createPartitions() do.
+static void BM_CreateImages(benchmark::State& state) {
+    TemporaryDir dir;
+    FileImageBackend images(dir.path, false);
+    const std::vector<ImageBackend::ImageSpec> specs = {
+            {.name = "userdata_gsi", .size = 4 * kImageSize, .readonly = false},
+            {.name = "system_gsi", .size = kImageSize, .readonly = true},
+    };
+
+    for (auto _ : state) {
+        if (state.range(0)) {
+            CHECK(images.CreateBackingImages(specs, nullptr));
+        } else {
+            for (const auto& spec : specs) {
+                CHECK(images.CreateBackingImage(spec.name, spec.size, spec.readonly, nullptr));
+            }
+        }
+
+        state.PauseTiming();
+        for (const auto& spec : specs) {
+            CHECK(images.DeleteBackingImage(spec.name));
+        }
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed(state.iterations() * 5 * kImageSize);
+}
+BENCHMARK(BM_CreateImages)->Arg(0)->Arg(1)->UseRealTime();
+
+// Stream-commits a 64MiB image while state.range(0) threads poll the
+// published progress, mirroring GsiService::UpdateProgress() racing with
+// clients calling getInstallProgress().
+static void BM_ProgressContention(benchmark::State& state) {
+    TemporaryDir dir;
+    FileImageBackend images(dir.path);
+    TemporaryFile source;
+    CHECK(WriteSource(source.fd, kImageSize));
+
+    // Only the installer's waits are recorded in |stats|.
+    ServiceStats stats;
+    LockStats poller_stats{"gsid_benchmark.poller_waiters"};
+    std::mutex progress_lock;
+    uint64_t progress = 0;
+
+    std::atomic<bool> done = false;
+    std::vector<std::thread> pollers;
+    for (int i = 0; i < state.range(0); i++) {
+        pollers.emplace_back([&]() -> void {
+            while (!done) {
+                TimedLockGuard guard(progress_lock, &poller_stats);
+                benchmark::DoNotOptimize(progress);
+            }
+        });
+    }
+
+    PartitionWriter::Callbacks callbacks = {
+            .on_progress =
+                    [&](uint64_t bytes) -> void {
+                        TimedLockGuard guard(progress_lock, &stats.progress_lock);
+                        progress = bytes;
+                    },
+    };
+    for (auto _ : state) {
+        state.PauseTiming();
+        CHECK(lseek(source.fd, 0, SEEK_SET) == 0);
+        auto writer = CreateWriter(&images, &stats, callbacks);
+        state.ResumeTiming();
+
+        CHECK(writer->CommitChunk(source.fd, kImageSize));
+
+        state.PauseTiming();
+        writer = nullptr;
+        CHECK(images.DeleteBackingImage(kImageName));
+        state.ResumeTiming();
+    }
+
+    done = true;
+    for (auto& thread : pollers) {
+        thread.join();
+    }
+    state.SetBytesProcessed(state.iterations() * kImageSize);
+    state.counters["lock_wait_p99_us"] = stats.progress_lock.wait_us.Percentile(99);
+}
+BENCHMARK(BM_ProgressContention)->Arg(0)->Arg(1)->Arg(4)->Arg(16)->UseRealTime();
+
+// Stream-commits a 64MiB image, with buffered writes (arg 0) or O_DIRECT
+// (arg 1), while a foreground thread reads random 4KiB blocks of another
+// file on the same file system, as an app would during an install. The
+// fg_read_* counters are that thread's read latencies; compare the two
+// arguments to see how each write mode affects foreground jank.
+static void BM_ForegroundReadLatency(benchmark::State& state) {
+    TemporaryDir dir;
+    FileImageBackend images(dir.path);
+    TemporaryFile source;
+    CHECK(WriteSource(source.fd, kImageSize));
+
+    // The reader's file must not come from the page cache, or its reads never
+    // wait on the device.
+    std::string app_path = std::string(dir.path) + "/foreground";
+    unique_fd app(open(app_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644));
+    CHECK(app >= 0 && WriteSource(app, kImageSize) && fsync(app) == 0);
+
+    Histogram read_latency;
+    std::atomic<bool> reading = false;
+    std::atomic<bool> done = false;
+    std::thread reader([&]() -> void {
+        static constexpr uint64_t kBlockSize = 4096;
+        char block[kBlockSize];
+        uint64_t seed = 1;
+        while (!done) {
+            if (!reading) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            off_t offset = ((seed >> 33) % (kImageSize / kBlockSize)) * kBlockSize;
+            posix_fadvise(app, offset, kBlockSize, POSIX_FADV_DONTNEED);
+            ScopedTimer timer(&read_latency);
+            CHECK(pread(app, block, kBlockSize, offset) == kBlockSize);
+        }
+    });
+
+    ServiceStats stats;
+    for (auto _ : state) {
+        state.PauseTiming();
+        CHECK(lseek(source.fd, 0, SEEK_SET) == 0);
+        auto writer = CreateWriter(&images, &stats, {}, WriterOptions(state.range(0)));
+        reading = true;
+        state.ResumeTiming();
+
+        CHECK(writer->CommitChunk(source.fd, kImageSize));
+        CHECK(writer->Flush());
+
+        state.PauseTiming();
+        reading = false;
+        writer = nullptr;
+        CHECK(images.DeleteBackingImage(kImageName));
+        state.ResumeTiming();
+    }
+
+    done = true;
+    reader.join();
+    unlink(app_path.c_str());
+    state.SetBytesProcessed(state.iterations() * kImageSize);
+    state.counters["fg_reads"] = read_latency.count();
+    state.counters["fg_read_p50_us"] = read_latency.Percentile(50);
+    state.counters["fg_read_p99_us"] = read_latency.Percentile(99);
+    state.counters["fg_read_max_us"] = read_latency.max();
+}
+BENCHMARK(BM_ForegroundReadLatency)->Arg(0)->Arg(1)->ArgName("direct")->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "block_hashes.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <openssl/sha.h>
+
+#include "gsi_trace.h"
+
+namespace android {
+namespace gsi {
+
+static_assert(kBlockHashSize == SHA256_DIGEST_LENGTH);
+
+// Each thread reads at least this much per call, and hashes at least this
+// much in total, so that small images do not pay for extra threads.
+static constexpr uint64_t kReadSize = 1024 * 1024;
+static constexpr uint64_t kMinBytesPerThread = 64 * 1024 * 1024;
+
+bool ComputeBlockHashes(int fd, uint64_t size, uint32_t block_size, std::vector<uint8_t>* hashes,
+                        const HashProgressCallback& on_progress) {
+    GSI_TRACE_CALL();
+    if (block_size < kMinHashBlockSize || block_size > kMaxHashBlockSize ||
+        block_size % kMinHashBlockSize) {
+        LOG(ERROR) << "invalid hash block size " << block_size;
+        return false;
+    }
+    uint64_t num_blocks = (size + block_size - 1) / block_size;
+    hashes->resize(num_blocks * kBlockHashSize);
+
+    // Threads take contiguous ranges of blocks, so that each one reads
+    // sequentially.
+    uint64_t max_threads = std::max(uint64_t(1), size / kMinBytesPerThread);
+    uint64_t num_threads = std::min<uint64_t>(
+            {max_threads, num_blocks, std::max(1u, std::thread::hardware_concurrency())});
+    uint64_t blocks_per_thread = num_threads ? (num_blocks + num_threads - 1) / num_threads : 0;
+
+    std::atomic<uint64_t> hashed = 0;
+    std::atomic<bool> failed = false;
+    auto hash_range = [&](uint64_t first_block, uint64_t last_block) -> void {
+        uint64_t blocks_per_read = std::max(uint64_t(1), kReadSize / block_size);
+        auto buffer = std::make_unique<uint8_t[]>(blocks_per_read * block_size);
+        for (uint64_t block = first_block; block < last_block && !failed;
+             block += blocks_per_read) {
+            uint64_t offset = block * block_size;
+            uint64_t bytes = std::min(std::min(last_block - block, blocks_per_read) * block_size,
+                                      size - offset);
+            if (!android::base::ReadFullyAtOffset(fd, buffer.get(), bytes, offset)) {
+                PLOG(ERROR) << "read at " << offset;
+                failed = true;
+                return;
+            }
+            posix_fadvise(fd, offset, bytes, POSIX_FADV_DONTNEED);
+            for (uint64_t done = 0; done < bytes; done += block_size) {
+                uint64_t index = block + done / block_size;
+                SHA256(buffer.get() + done, std::min(uint64_t(block_size), bytes - done),
+                       hashes->data() + index * kBlockHashSize);
+            }
+            uint64_t total = hashed += bytes;
+            if (on_progress && !on_progress(total)) {
+                failed = true;
+                return;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (uint64_t first = 0; first < num_blocks; first += blocks_per_thread) {
+        threads.emplace_back(hash_range, first, std::min(first + blocks_per_thread, num_blocks));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return !failed;
+}
+
+bool ComputeImageDigest(int fd, uint64_t size, std::string* digest,
+                        const HashProgressCallback& on_progress) {
+    GSI_TRACE_CALL();
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    auto buffer = std::make_unique<uint8_t[]>(kReadSize);
+    for (uint64_t offset = 0; offset < size; offset += kReadSize) {
+        uint64_t bytes = std::min(kReadSize, size - offset);
+        if (!android::base::ReadFullyAtOffset(fd, buffer.get(), bytes, offset)) {
+            PLOG(ERROR) << "read at " << offset;
+            return false;
+        }
+        posix_fadvise(fd, offset, bytes, POSIX_FADV_DONTNEED);
+        SHA256_Update(&ctx, buffer.get(), bytes);
+        if (on_progress && !on_progress(offset + bytes)) {
+            return false;
+        }
+    }
+    uint8_t hash[SHA256_DIGEST_LENGTH];
+    SHA256_Final(hash, &ctx);
+    digest->clear();
+    for (uint8_t byte : hash) {
+        *digest += android::base::StringPrintf("%02x", byte);
+    }
+    return true;
+}
+
+bool IsValidImageDigest(const std::string& digest) {
+    if (digest.size() != SHA256_DIGEST_LENGTH * 2) {
+        return false;
+    }
+    return std::all_of(digest.begin(), digest.end(), [](char c) -> bool {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+    });
+}
+
+}  // namespace gsi
+}  // namespace android
@@ -15,11 +15,14 @@
 //
 
 #include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
 
 #include <iostream>
 #include <string>
 
 #include <android-base/logging.h>
+#include <android-base/unique_fd.h>
 #include <binder/BinderService.h>
 #include <binder/IPCThreadState.h>
 #include <binder/ProcessState.h>
@@ -49,6 +52,27 @@ static int DumpDeviceMapper() {
     return 0;
 }
 
+static int DumpDeviceMapperRecords(const std::string& prefix) {
+    auto service = android::gsi::GetGsiService();
+    if (!service) {
+        std::cerr << "Could not start IGsiService.\n";
+        return 1;
+    }
+    android::base::unique_fd output(dup(STDOUT_FILENO));
+    if (output < 0) {
+        std::cerr << "Could not duplicate stdout: " << strerror(errno) << "\n";
+        return 1;
+    }
+    android::os::ParcelFileDescriptor stream(std::move(output));
+    auto status = service->dumpDeviceMapperDevicesToFd(prefix, stream);
+    if (!status.isOk()) {
+        std::cerr << "Could not dump device-mapper devices: " << status.exceptionMessage().c_str()
+                  << "\n";
+        return 1;
+    }
+    return 0;
+}
+
 int main(int argc, char** argv) {
     android::base::InitLogging(argv, android::base::LogdLogger(android::base::SYSTEM));
 
@@ -57,11 +81,20 @@ int main(int argc, char** argv) {
             android::gsi::GsiService::RunStartupTasks();
             exit(0);
         } else if (argv[1] == "dump-device-mapper"s) {
-            int rc = DumpDeviceMapper();
+            int rc;
+            if (argc > 2 && argv[2] == "--records"s) {
+                rc = DumpDeviceMapperRecords(argc > 3 ? argv[3] : "");
+            } else {
+                rc = DumpDeviceMapper();
+            }
             exit(rc);
         }
     }
 
+    // Diagnostic output is streamed to caller-provided descriptors; a reader
+    // going away must not take the service down with it.
+    signal(SIGPIPE, SIG_IGN);
+
     android::gsi::GsiService::Register();
     {
         sp<ProcessState> ps(ProcessState::self());
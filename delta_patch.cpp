@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "delta_patch.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <android-base/logging.h>
+
+#include "gsi_trace.h"
+
+namespace android {
+namespace gsi {
+
+int64_t DeltaPatchApplier::Apply(int stream_fd, int64_t bytes) {
+    GSI_TRACE_CALL();
+    if (failed_) {
+        LOG(ERROR) << "delta patch is malformed, no more of it can be applied";
+        return -1;
+    }
+    if (bytes < 0) {
+        LOG(ERROR) << "patch size " << bytes << " is negative";
+        return -1;
+    }
+
+    uint64_t consumed = 0;
+    // A copy or zero operation needs no more of the stream, so it is
+    // carried out even if its header was the last thing in this chunk.
+    while (consumed < static_cast<uint64_t>(bytes) || (op_remaining_ && op_.type != kData)) {
+        if (!op_remaining_) {
+            if (!ReadHeader(stream_fd, bytes - consumed, &consumed)) {
+                break;
+            }
+            continue;
+        }
+        if (!ContinueOp(stream_fd, bytes - consumed, &consumed)) {
+            break;
+        }
+    }
+    return failed_ ? -1 : consumed;
+}
+
+bool DeltaPatchApplier::ReadHeader(int stream_fd, uint64_t bytes, uint64_t* consumed) {
+    if (writer_->ShouldAbort()) {
+        return false;
+    }
+    auto dest = reinterpret_cast<uint8_t*>(&op_) + header_filled_;
+    size_t to_read = std::min(sizeof(op_) - header_filled_, bytes);
+    ssize_t rv = TEMP_FAILURE_RETRY(read(stream_fd, dest, to_read));
+    if (rv < 0) {
+        PLOG(ERROR) << "read delta patch";
+        return false;
+    }
+    if (rv == 0) {
+        LOG(ERROR) << "no bytes left in stream";
+        return false;
+    }
+    *consumed += rv;
+    header_filled_ += rv;
+    if (header_filled_ < sizeof(op_)) {
+        return true;
+    }
+    header_filled_ = 0;
+    if (!StartOp()) {
+        failed_ = true;
+        return false;
+    }
+    return true;
+}
+
+bool DeltaPatchApplier::StartOp() {
+    uint64_t position = writer_->bytes_written();
+    uint64_t remaining = writer_->size() - position;
+    if (op_.reserved || op_.type > kZero) {
+        LOG(ERROR) << "unknown delta operation " << op_.type << " at " << position;
+        return false;
+    }
+    if (!op_.length || op_.length > remaining) {
+        LOG(ERROR) << "delta operation length " << op_.length << " at " << position
+                   << " does not fit in the remaining " << remaining << " bytes";
+        return false;
+    }
+    if (op_.length % kBlockSize && op_.length != remaining) {
+        LOG(ERROR) << "delta operation length " << op_.length << " at " << position
+                   << " is not block aligned";
+        return false;
+    }
+    if (op_.type == kCopy) {
+        if (op_.source_offset % kBlockSize) {
+            LOG(ERROR) << "copy source " << op_.source_offset << " is not block aligned";
+            return false;
+        }
+        if (op_.source_offset < position) {
+            LOG(ERROR) << "copy source " << op_.source_offset << " was already overwritten (at "
+                       << position << ")";
+            return false;
+        }
+        if (op_.source_offset > writer_->size() - op_.length) {
+            LOG(ERROR) << "copy source " << op_.source_offset << " + " << op_.length
+                       << " is past the end of the image";
+            return false;
+        }
+    } else if (op_.source_offset) {
+        LOG(ERROR) << "delta operation " << op_.type << " has a source offset";
+        return false;
+    }
+    op_remaining_ = op_.length;
+    return true;
+}
+
+bool DeltaPatchApplier::ContinueOp(int stream_fd, uint64_t bytes, uint64_t* consumed) {
+    uint64_t before = writer_->bytes_written();
+    bool ok = false;
+    switch (op_.type) {
+        case kCopy:
+            if (op_.source_offset == before) {
+                ok = writer_->SkipChunk(op_remaining_);
+                if (ok) {
+                    stats_->delta_kept_bytes += op_remaining_;
+                }
+            } else {
+                ok = writer_->CopyChunk(op_.source_offset, op_remaining_);
+                stats_->delta_copied_bytes += writer_->bytes_written() - before;
+            }
+            break;
+        case kData: {
+            uint64_t to_write = std::min(op_remaining_, bytes);
+            ok = writer_->CommitChunk(stream_fd, to_write);
+            *consumed += writer_->bytes_written() - before;
+            stats_->delta_data_bytes += writer_->bytes_written() - before;
+            break;
+        }
+        case kZero:
+            ok = writer_->ZeroChunk(op_remaining_);
+            break;
+    }
+    uint64_t done = writer_->bytes_written() - before;
+    op_remaining_ -= done;
+    if (op_.type == kCopy) {
+        op_.source_offset += done;
+    }
+    return ok;
+}
+
+}  // namespace gsi
+}  // namespace android
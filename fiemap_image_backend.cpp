@@ -0,0 +1,989 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fiemap_image_backend.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+#include <libfiemap/fiemap_writer.h>
+#include <liblp/builder.h>
+#include <liblp/liblp.h>
+
+#include "block_hashes.h"
+
+namespace android {
+namespace gsi {
+
+using namespace std::literals;
+using namespace android::fs_mgr;
+using android::fiemap::FiemapWriter;
+using android::fiemap::ImageManager;
+using android::fiemap::MappedDevice;
+
+// The metadata file ImageManager keeps in its metadata directory.
+static constexpr char kMetadataFile[] = "/lp_metadata";
+
+// Where shared images are published, relative to the parent of a slot's
+// data directory, and how their files are named in it.
+static constexpr char kSharedImageDir[] = "/dsu_shared";
+static constexpr char kSharedMetadataSuffix[] = ".lp_metadata";
+static constexpr char kSharedImageName[] = "shared";
+
+// The image pool is a directory next to the slots', holding pinned images
+// of kImagePoolChunkSize bytes along with their metadata.
+static constexpr char kImagePoolDir[] = "/dsu_pool";
+static constexpr char kImagePoolChunkName[] = "chunk";
+
+static const LpMetadataPartition* FindImage(const LpMetadata& metadata, const std::string& name) {
+    for (const auto& partition : metadata.partitions) {
+        if (GetPartitionName(partition) == name) {
+            return &partition;
+        }
+    }
+    return nullptr;
+}
+
+// Metadata with the geometry and block devices of |source|, but no images.
+static std::unique_ptr<MetadataBuilder> NewEmptyMetadata(const LpMetadata& source) {
+    auto builder = MetadataBuilder::New(source);
+    if (!builder) {
+        return nullptr;
+    }
+    for (const auto& partition : source.partitions) {
+        builder->RemovePartition(GetPartitionName(partition));
+    }
+    return builder;
+}
+
+static uint64_t GetExtentsSize(const LpMetadata& metadata, const LpMetadataPartition& partition) {
+    uint64_t size = 0;
+    for (uint32_t i = 0; i < partition.num_extents; i++) {
+        size += metadata.extents[partition.first_extent_index + i].num_sectors * LP_SECTOR_SIZE;
+    }
+    return size;
+}
+
+// Append the extents of image |source_name| of |source| to |target|.
+static bool AppendExtents(const LpMetadata& source, const std::string& source_name,
+                          MetadataBuilder* builder, Partition* target) {
+    auto partition = FindImage(source, source_name);
+    if (!partition) {
+        LOG(ERROR) << "image " << source_name << " not found";
+        return false;
+    }
+    for (uint32_t i = 0; i < partition->num_extents; i++) {
+        const auto& extent = source.extents[partition->first_extent_index + i];
+        if (extent.target_type != LP_TARGET_TYPE_LINEAR ||
+            extent.target_source >= source.block_devices.size()) {
+            LOG(ERROR) << "image " << source_name << " has an unexpected extent";
+            return false;
+        }
+        const auto& block_device = source.block_devices[extent.target_source];
+        if (!builder->AddLinearExtent(target, GetBlockDevicePartitionName(block_device),
+                                      extent.num_sectors, extent.target_data)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Add image |source_name| of |source| to |builder| as |name|, with the
+// same extents.
+static bool CopyImage(const LpMetadata& source, const std::string& source_name,
+                      MetadataBuilder* builder, const std::string& name) {
+    auto partition = FindImage(source, source_name);
+    if (!partition) {
+        LOG(ERROR) << "image " << source_name << " not found";
+        return false;
+    }
+    auto target = builder->AddPartition(name, partition->attributes);
+    return target && AppendExtents(source, source_name, builder, target);
+}
+
+namespace {
+
+class FiemapImageDevice final : public ImageDevice {
+  public:
+    explicit FiemapImageDevice(std::unique_ptr<MappedDevice>&& device)
+        : device_(std::move(device)) {}
+
+    int fd() override { return device_->fd(); }
+    const std::string& path() override { return device_->path(); }
+
+  private:
+    std::unique_ptr<MappedDevice> device_;
+};
+
+}  // namespace
+
+std::unique_ptr<FiemapImageBackend> FiemapImageBackend::Open(const std::string& metadata_dir,
+                                                             const std::string& data_dir) {
+    auto images = ImageManager::Open(metadata_dir, data_dir);
+    if (!images) {
+        return nullptr;
+    }
+    return std::unique_ptr<FiemapImageBackend>(
+            new FiemapImageBackend(std::move(images), metadata_dir, data_dir));
+}
+
+FiemapImageBackend::FiemapImageBackend(std::unique_ptr<ImageManager>&& images,
+                                       const std::string& metadata_dir,
+                                       const std::string& data_dir)
+    : images_(std::move(images)), metadata_dir_(metadata_dir), data_dir_(data_dir) {}
+
+bool FiemapImageBackend::BackingImageExists(const std::string& name) {
+    return images_->BackingImageExists(name);
+}
+
+bool FiemapImageBackend::CreateBackingImage(const std::string& name, uint64_t size, bool readonly,
+                                            ProgressCallback&& on_progress) {
+    int flags = ImageManager::CREATE_IMAGE_DEFAULT;
+    if (readonly) {
+        flags |= ImageManager::CREATE_IMAGE_READONLY;
+    }
+    auto status = images_->CreateBackingImage(name, size, flags, std::move(on_progress));
+    return status.is_ok();
+}
+
+bool FiemapImageBackend::CreateBackingImages(const std::vector<ImageSpec>& images,
+                                             ProgressCallback&& on_progress) {
+    // ImageManager adds an image by rewriting its whole metadata file, so
+    // two images cannot be created under the same metadata directory at
+    // once. Instead, each image is allocated by an ImageManager with a
+    // staging directory of its own, and the results are merged into our
+    // metadata one by one once every allocation has finished.
+    std::vector<std::unique_ptr<FiemapImageBackend>> staging;
+    bool ok = true;
+    for (const auto& image : images) {
+        // Clear out anything left by an interrupted batch.
+        RemoveStagingDir(image.name);
+
+        auto dir = GetStagingDir(image.name);
+        if (mkdir(dir.c_str(), 0755)) {
+            PLOG(ERROR) << "mkdir " << dir;
+            ok = false;
+            break;
+        }
+        auto backend = Open(dir, data_dir_);
+        if (!backend) {
+            LOG(ERROR) << "could not open image manager for " << dir;
+            ok = false;
+            break;
+        }
+        staging.emplace_back(std::move(backend));
+    }
+
+    if (ok) {
+        auto create = [&](size_t index, ProgressCallback&& progress) -> bool {
+            const auto& image = images[index];
+            return staging[index]->CreateBackingImage(image.name, image.size, image.readonly,
+                                                      std::move(progress));
+        };
+        std::vector<bool> created;
+        ok = CreateImagesConcurrently(images, create, std::move(on_progress), &created);
+    }
+
+    std::vector<std::string> adopted;
+    for (size_t i = 0; ok && i < images.size(); i++) {
+        ok = AdoptStagedImage(images[i].name);
+        if (ok) {
+            adopted.emplace_back(images[i].name);
+        }
+    }
+    if (!ok) {
+        for (const auto& name : adopted) {
+            DeleteBackingImage(name);
+        }
+    }
+
+    // Images still in a staging directory at this point are deleted.
+    staging.clear();
+    for (const auto& image : images) {
+        RemoveStagingDir(image.name);
+    }
+    return ok;
+}
+
+std::string FiemapImageBackend::GetStagingDir(const std::string& name) const {
+    return metadata_dir_ + "/staging_" + name;
+}
+
+bool FiemapImageBackend::AdoptStagedImage(const std::string& name) {
+    auto staged_file = GetStagingDir(name) + kMetadataFile;
+    auto metadata_file = metadata_dir_ + kMetadataFile;
+
+    if (access(metadata_file.c_str(), F_OK) && errno == ENOENT) {
+        // This is the first image, so the staged metadata is exactly what
+        // ImageManager would have written.
+        if (rename(staged_file.c_str(), metadata_file.c_str())) {
+            PLOG(ERROR) << "rename " << staged_file << " to " << metadata_file;
+            return false;
+        }
+        return true;
+    }
+
+    auto staged = ReadFromImageFile(staged_file);
+    if (!staged) {
+        LOG(ERROR) << "could not read image metadata to add " << name;
+        return false;
+    }
+    if (!AddImageFromMetadata(*staged, name, name)) {
+        return false;
+    }
+    // The image now belongs to our metadata; make sure cleaning up the
+    // staging directory does not delete it.
+    if (unlink(staged_file.c_str())) {
+        PLOG(WARNING) << "unlink " << staged_file;
+    }
+    return true;
+}
+
+bool FiemapImageBackend::AddImageFromMetadata(const LpMetadata& source,
+                                              const std::string& source_name,
+                                              const std::string& name) {
+    auto metadata_file = metadata_dir_ + kMetadataFile;
+    std::unique_ptr<MetadataBuilder> builder;
+    if (access(metadata_file.c_str(), F_OK) && errno == ENOENT) {
+        builder = NewEmptyMetadata(source);
+    } else {
+        auto metadata = ReadFromImageFile(metadata_file);
+        if (!metadata) {
+            LOG(ERROR) << "could not read image metadata to add " << name;
+            return false;
+        }
+        builder = MetadataBuilder::New(*metadata.get());
+    }
+    if (!builder) {
+        return false;
+    }
+    if (builder->FindPartition(name)) {
+        LOG(ERROR) << "image " << name << " already exists";
+        return false;
+    }
+    if (!CopyImage(source, source_name, builder.get(), name)) {
+        return false;
+    }
+
+    auto exported = builder->Export();
+    if (!exported || !WriteToImageFile(metadata_file, *exported.get())) {
+        LOG(ERROR) << "could not write " << metadata_file;
+        return false;
+    }
+    return true;
+}
+
+void FiemapImageBackend::RemoveStagingDir(const std::string& name) {
+    auto dir = GetStagingDir(name);
+    if (access(dir.c_str(), F_OK)) {
+        return;
+    }
+    auto staged_file = dir + kMetadataFile;
+    if (access(staged_file.c_str(), F_OK) == 0) {
+        // The staged image is not in our metadata (or a crash interrupted
+        // adopting it), so its files would otherwise be leaked.
+        auto staged = ImageManager::Open(dir, data_dir_);
+        if (staged && staged->BackingImageExists(name) && !images_->BackingImageExists(name)) {
+            staged->DeleteBackingImage(name);
+        }
+        std::string message;
+        if (!android::base::RemoveFileIfExists(staged_file, &message)) {
+            LOG(WARNING) << message;
+        }
+    }
+    if (rmdir(dir.c_str())) {
+        PLOG(WARNING) << "rmdir " << dir;
+    }
+}
+
+bool FiemapImageBackend::ExtendBackingImage(const std::string& name, uint64_t size,
+                                            ProgressCallback&& on_progress) {
+    auto metadata_file = metadata_dir_ + kMetadataFile;
+    auto metadata = ReadFromImageFile(metadata_file);
+    auto partition = metadata ? FindImage(*metadata, name) : nullptr;
+    if (!partition) {
+        LOG(ERROR) << "image " << name << " not found";
+        return false;
+    }
+    if (partition->attributes & LP_PARTITION_ATTR_READONLY) {
+        LOG(ERROR) << "cannot extend read-only image " << name;
+        return false;
+    }
+    uint64_t old_size = GetExtentsSize(*metadata, *partition);
+    if (size <= old_size) {
+        LOG(ERROR) << name << " is already " << old_size << " bytes";
+        return false;
+    }
+    if (images_->IsImageMapped(name)) {
+        LOG(ERROR) << "cannot extend " << name << " while it is mapped";
+        return false;
+    }
+    if (!CanMapExtents(data_dir_)) {
+        LOG(ERROR) << "cannot extend " << name << ": it is mapped through a loop device";
+        return false;
+    }
+
+    // ImageManager cannot grow a file it has pinned, so the new space is
+    // allocated as an image of its own. That image is read-only, since it
+    // is only ever written through |name|.
+    uint32_t index = 1;
+    while (images_->BackingImageExists(GetExtensionName(name, index))) {
+        index++;
+    }
+    auto extension = GetExtensionName(name, index);
+    if (!CreateBackingImage(extension, size - old_size, true, std::move(on_progress))) {
+        LOG(ERROR) << "could not allocate " << (size - old_size) << " bytes to extend " << name;
+        return false;
+    }
+
+    if (!AppendExtension(name, extension)) {
+        images_->DeleteBackingImage(extension);
+        return false;
+    }
+    LOG(INFO) << "extended " << name << " from " << old_size << " to " << size << " bytes";
+    return true;
+}
+
+bool FiemapImageBackend::AppendExtension(const std::string& name, const std::string& extension) {
+    auto metadata_file = metadata_dir_ + kMetadataFile;
+    auto metadata = ReadFromImageFile(metadata_file);
+    auto builder = metadata ? MetadataBuilder::New(*metadata.get()) : nullptr;
+    auto target = builder ? builder->FindPartition(name) : nullptr;
+    auto exported = target && AppendExtents(*metadata, extension, builder.get(), target)
+                            ? builder->Export()
+                            : nullptr;
+    if (!exported || !WriteToImageFile(metadata_file, *exported.get())) {
+        LOG(ERROR) << "could not add the extents of " << extension << " to " << name;
+        return false;
+    }
+    return true;
+}
+
+bool FiemapImageBackend::DeleteBackingImage(const std::string& name) {
+    if (!DeleteImageAndExtensions(name)) {
+        return false;
+    }
+    for (const auto& image : {GetCowName(name), GetReplacementName(name)}) {
+        if (images_->BackingImageExists(image) &&
+            (!images_->UnmapImageIfExists(image) || !DeleteImageAndExtensions(image))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool FiemapImageBackend::DeleteImageAndExtensions(const std::string& name) {
+    // ImageManager would truncate a shared image's file, freeing blocks
+    // that other slots still map, so only this slot's link goes. That may
+    // leave the published copy as its last user.
+    struct stat s;
+    if (stat(GetImagePath(name).c_str(), &s) == 0 && s.st_nlink > 1) {
+        if (!DeleteImageLink(name)) {
+            return false;
+        }
+        RemoveUnusedSharedImages(data_dir_);
+    } else if (!images_->DeleteBackingImage(name)) {
+        return false;
+    }
+    // Extensions go once nothing maps their extents through |name|.
+    for (uint32_t index = 1;; index++) {
+        auto extension = GetExtensionName(name, index);
+        if (!images_->BackingImageExists(extension)) {
+            break;
+        }
+        if (!images_->UnmapImageIfExists(extension) || !images_->DeleteBackingImage(extension)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool FiemapImageBackend::ReplaceBackingImage(const std::string& name) {
+    auto replacement = GetReplacementName(name);
+    if (!images_->BackingImageExists(replacement)) {
+        LOG(ERROR) << "image " << replacement << " not found";
+        return false;
+    }
+    if (images_->IsImageMapped(name) || images_->IsImageMapped(replacement)) {
+        LOG(ERROR) << "cannot replace " << name << " while it is mapped";
+        return false;
+    }
+    // Only the image's own file is renamed.
+    if (images_->BackingImageExists(GetExtensionName(replacement, 1))) {
+        LOG(ERROR) << "cannot replace " << name << " with an extended image";
+        return false;
+    }
+    if (images_->BackingImageExists(name) && !DeleteImageAndExtensions(name)) {
+        return false;
+    }
+
+    auto metadata_file = metadata_dir_ + kMetadataFile;
+    auto metadata = ReadFromImageFile(metadata_file);
+    auto builder = metadata ? MetadataBuilder::New(*metadata.get()) : nullptr;
+    if (!builder || !CopyImage(*metadata, replacement, builder.get(), name)) {
+        LOG(ERROR) << "could not read image metadata to replace " << name;
+        return false;
+    }
+    builder->RemovePartition(replacement);
+    auto exported = builder->Export();
+    auto replacement_file = GetImagePath(replacement);
+    auto image_file = GetImagePath(name);
+    if (rename(replacement_file.c_str(), image_file.c_str())) {
+        PLOG(ERROR) << "rename " << replacement_file << " to " << image_file;
+        return false;
+    }
+    if (!exported || !WriteToImageFile(metadata_file, *exported.get())) {
+        LOG(ERROR) << "could not write " << metadata_file;
+        rename(image_file.c_str(), replacement_file.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool FiemapImageBackend::DeleteImageLink(const std::string& name) {
+    if (images_->IsImageMapped(name)) {
+        LOG(ERROR) << "cannot delete " << name << " while it is mapped";
+        return false;
+    }
+    // The link goes first, as ImageManager removes files before metadata;
+    // a leftover entry without its file is removed by the next attempt.
+    auto image_file = GetImagePath(name);
+    if (unlink(image_file.c_str()) && errno != ENOENT) {
+        PLOG(ERROR) << "unlink " << image_file;
+        return false;
+    }
+    auto metadata_file = metadata_dir_ + kMetadataFile;
+    auto metadata = ReadFromImageFile(metadata_file);
+    auto builder = metadata ? MetadataBuilder::New(*metadata.get()) : nullptr;
+    if (!builder) {
+        LOG(ERROR) << "could not read image metadata to delete " << name;
+        return false;
+    }
+    builder->RemovePartition(name);
+    auto exported = builder->Export();
+    if (!exported) {
+        LOG(ERROR) << "could not remove " << name << " from " << metadata_file;
+        return false;
+    }
+    // Like ImageManager, drop the metadata once it lists no images.
+    if (exported->partitions.empty()) {
+        std::string message;
+        if (!android::base::RemoveFileIfExists(metadata_file, &message)) {
+            LOG(ERROR) << message;
+            return false;
+        }
+        return true;
+    }
+    if (!WriteToImageFile(metadata_file, *exported.get())) {
+        LOG(ERROR) << "could not write " << metadata_file;
+        return false;
+    }
+    return true;
+}
+
+uint64_t FiemapImageBackend::GetImageAllocation(const std::string& name) {
+    if (!images_->BackingImageExists(name)) {
+        return 0;
+    }
+    uint64_t bytes = 0;
+    for (uint32_t index = 0;; index++) {
+        auto image = index ? GetExtensionName(name, index) : name;
+        if (index && !images_->BackingImageExists(image)) {
+            break;
+        }
+        struct stat s;
+        if (stat(GetImagePath(image).c_str(), &s) == 0 && s.st_nlink == 1) {
+            bytes += 512ULL * s.st_blocks;
+        }
+    }
+    return bytes;
+}
+
+bool FiemapImageBackend::GetImageLayout(const std::string& name, ImageLayout* layout) {
+    auto metadata = ReadFromImageFile(metadata_dir_ + kMetadataFile);
+    auto partition = metadata ? FindImage(*metadata, name) : nullptr;
+    if (!partition) {
+        LOG(ERROR) << "image " << name << " not found";
+        return false;
+    }
+    // This includes the extents of any extensions.
+    layout->extents = partition->num_extents;
+    layout->bytes = GetExtentsSize(*metadata, *partition);
+    return true;
+}
+
+std::vector<std::string> FiemapImageBackend::GetDisabledImages() {
+    std::vector<std::string> disabled;
+    auto metadata = ReadFromImageFile(metadata_dir_ + kMetadataFile);
+    if (!metadata) {
+        return disabled;
+    }
+    for (const auto& partition : metadata->partitions) {
+        if (partition.attributes & LP_PARTITION_ATTR_DISABLED) {
+            disabled.emplace_back(GetPartitionName(partition));
+        }
+    }
+    return disabled;
+}
+
+bool FiemapImageBackend::GetImageRanges(const std::string& name,
+                                        std::vector<DiskRange>* ranges) {
+    auto metadata = ReadFromImageFile(metadata_dir_ + kMetadataFile);
+    auto partition = metadata ? FindImage(*metadata, name) : nullptr;
+    if (!partition) {
+        LOG(ERROR) << "image " << name << " not found";
+        return false;
+    }
+    for (uint32_t i = 0; i < partition->num_extents; i++) {
+        const auto& extent = metadata->extents[partition->first_extent_index + i];
+        if (extent.target_type != LP_TARGET_TYPE_LINEAR) {
+            continue;
+        }
+        ranges->emplace_back(DiskRange{extent.target_data * LP_SECTOR_SIZE,
+                                       extent.num_sectors * LP_SECTOR_SIZE});
+    }
+    return true;
+}
+
+std::string FiemapImageBackend::GetExtensionName(const std::string& name, uint32_t index) {
+    return name + ".ext" + std::to_string(index);
+}
+
+std::string FiemapImageBackend::GetCowName(const std::string& name) {
+    return name + ".cow";
+}
+
+bool FiemapImageBackend::CanMapExtents(const std::string& data_dir) {
+    // The same check ImageManager::MapImageDevice() makes. The parent is on
+    // the same filesystem, and exists before the slot's own directory.
+    auto dir = android::base::Dirname(data_dir);
+    std::string block_device;
+    bool uses_dm = false;
+    if (!FiemapWriter::GetBlockDeviceForFile(dir, &block_device, &uses_dm)) {
+        LOG(ERROR) << "could not find the block device of " << dir;
+        return false;
+    }
+    return uses_dm;
+}
+
+std::string FiemapImageBackend::GetImagePath(const std::string& name) const {
+    // ImageManager keeps each image in a single file of this name, unless
+    // the filesystem limits file sizes, which /data's do not.
+    return data_dir_ + "/" + name + ".img";
+}
+
+std::string FiemapImageBackend::GetSharedImageDir(const std::string& data_dir) {
+    // Next to the slots' own directories, so that it is on the filesystem
+    // of every slot that could link to it.
+    return android::base::Dirname(data_dir) + kSharedImageDir;
+}
+
+bool FiemapImageBackend::ShareBackingImage(const std::string& name, const std::string& digest) {
+    if (!IsValidImageDigest(digest)) {
+        LOG(ERROR) << "invalid image digest " << digest;
+        return false;
+    }
+    auto metadata = ReadFromImageFile(metadata_dir_ + kMetadataFile);
+    auto partition = metadata ? FindImage(*metadata, name) : nullptr;
+    if (!partition || !(partition->attributes & LP_PARTITION_ATTR_READONLY)) {
+        LOG(ERROR) << "cannot share " << name << ", it is not a read-only image";
+        return false;
+    }
+    // Only the image's own file can be linked.
+    if (images_->BackingImageExists(GetExtensionName(name, 1))) {
+        LOG(ERROR) << "cannot share " << name << ", it has been extended";
+        return false;
+    }
+
+    auto dir = GetSharedImageDir(data_dir_);
+    if (mkdir(dir.c_str(), 0755) && errno != EEXIST) {
+        PLOG(ERROR) << "mkdir " << dir;
+        return false;
+    }
+    auto shared_file = dir + "/" + digest + ".img";
+    auto shared_metadata = dir + "/" + digest + kSharedMetadataSuffix;
+    if (access(shared_metadata.c_str(), F_OK) == 0) {
+        LOG(INFO) << "an image with digest " << digest << " is already shared";
+        return true;
+    }
+
+    // The published metadata holds just this image, since the extents of
+    // the file are the same through either link.
+    auto builder = NewEmptyMetadata(*metadata);
+    if (!builder || !CopyImage(*metadata, name, builder.get(), kSharedImageName)) {
+        return false;
+    }
+    auto exported = builder->Export();
+    auto tmp_metadata = shared_metadata + ".tmp";
+    if (!exported || !WriteToImageFile(tmp_metadata, *exported.get())) {
+        LOG(ERROR) << "could not write " << tmp_metadata;
+        return false;
+    }
+    auto image_file = GetImagePath(name);
+    if (link(image_file.c_str(), shared_file.c_str())) {
+        PLOG(WARNING) << "link " << image_file << " to " << shared_file;
+        unlink(tmp_metadata.c_str());
+        return false;
+    }
+    // An image is only looked up once its metadata is in place.
+    if (rename(tmp_metadata.c_str(), shared_metadata.c_str())) {
+        PLOG(ERROR) << "rename " << tmp_metadata << " to " << shared_metadata;
+        unlink(shared_file.c_str());
+        unlink(tmp_metadata.c_str());
+        return false;
+    }
+    LOG(INFO) << "shared image " << name << " as " << digest;
+    return true;
+}
+
+bool FiemapImageBackend::LinkSharedImage(const std::string& digest, const std::string& name,
+                                         uint64_t size) {
+    if (!IsValidImageDigest(digest)) {
+        LOG(ERROR) << "invalid image digest " << digest;
+        return false;
+    }
+    auto dir = GetSharedImageDir(data_dir_);
+    auto shared_file = dir + "/" + digest + ".img";
+    auto shared_metadata = dir + "/" + digest + kSharedMetadataSuffix;
+    if (access(shared_metadata.c_str(), F_OK)) {
+        return false;
+    }
+    auto metadata = ReadFromImageFile(shared_metadata);
+    auto partition = metadata ? FindImage(*metadata, kSharedImageName) : nullptr;
+    if (!partition) {
+        LOG(ERROR) << "could not read " << shared_metadata;
+        return false;
+    }
+    uint64_t shared_size = GetExtentsSize(*metadata, *partition);
+    if (shared_size != size) {
+        LOG(INFO) << "shared image " << digest << " is " << shared_size << " bytes, not " << size;
+        return false;
+    }
+
+    auto image_file = GetImagePath(name);
+    struct stat ours, theirs;
+    if (stat(shared_file.c_str(), &theirs)) {
+        PLOG(ERROR) << "stat " << shared_file;
+        return false;
+    }
+    if (images_->BackingImageExists(name)) {
+        if (stat(image_file.c_str(), &ours) == 0 && ours.st_dev == theirs.st_dev &&
+            ours.st_ino == theirs.st_ino) {
+            // This slot published it, or linked to it before.
+            return images_->UnmapImageIfExists(name);
+        }
+        if (!images_->UnmapImageIfExists(name) || !DeleteBackingImage(name)) {
+            LOG(ERROR) << "could not delete " << name << " to replace it with a shared image";
+            return false;
+        }
+    }
+    if (link(shared_file.c_str(), image_file.c_str())) {
+        // EXDEV or EPERM: the caller installs a copy of its own instead.
+        PLOG(WARNING) << "link " << shared_file << " to " << image_file;
+        return false;
+    }
+    if (!AddImageFromMetadata(*metadata, kSharedImageName, name)) {
+        unlink(image_file.c_str());
+        return false;
+    }
+    LOG(INFO) << "linked " << name << " to shared image " << digest;
+    return true;
+}
+
+std::string FiemapImageBackend::GetImagePoolDir(const std::string& data_dir) {
+    return android::base::Dirname(data_dir) + kImagePoolDir;
+}
+
+std::unique_ptr<FiemapImageBackend> FiemapImageBackend::OpenImagePool(const std::string& data_dir,
+                                                                      bool create) {
+    auto dir = GetImagePoolDir(data_dir);
+    if (create && mkdir(dir.c_str(), 0755) && errno != EEXIST) {
+        PLOG(ERROR) << "mkdir " << dir;
+        return nullptr;
+    }
+    if (access(dir.c_str(), F_OK)) {
+        return nullptr;
+    }
+    return Open(dir, dir);
+}
+
+uint64_t FiemapImageBackend::GetImagePoolSize(const std::string& data_dir) {
+    auto pool = OpenImagePool(data_dir, false);
+    return pool ? pool->images_->GetAllBackingImages().size() * kImagePoolChunkSize : 0;
+}
+
+bool FiemapImageBackend::AddImagePoolChunk(const std::string& data_dir,
+                                           ProgressCallback&& on_progress) {
+    if (!CanMapExtents(data_dir)) {
+        LOG(ERROR) << "the image pool is of no use where images map through loop devices";
+        return false;
+    }
+    auto pool = OpenImagePool(data_dir, true);
+    if (!pool) {
+        return false;
+    }
+    uint32_t index = 0;
+    while (pool->images_->BackingImageExists(kImagePoolChunkName + std::to_string(index))) {
+        index++;
+    }
+    auto chunk = kImagePoolChunkName + std::to_string(index);
+    if (!pool->CreateBackingImage(chunk, kImagePoolChunkSize, false, std::move(on_progress))) {
+        LOG(ERROR) << "could not add " << chunk << " to the image pool";
+        return false;
+    }
+    return true;
+}
+
+bool FiemapImageBackend::ShrinkImagePool(const std::string& data_dir, uint64_t size) {
+    auto pool = OpenImagePool(data_dir, false);
+    if (!pool) {
+        return true;
+    }
+    auto chunks = pool->images_->GetAllBackingImages();
+    while (chunks.size() * kImagePoolChunkSize > size) {
+        if (!pool->DeleteBackingImage(chunks.back())) {
+            LOG(ERROR) << "could not remove " << chunks.back() << " from the image pool";
+            return false;
+        }
+        chunks.pop_back();
+    }
+    return true;
+}
+
+bool FiemapImageBackend::CreateBackingImageFromPool(const std::string& name, uint64_t size,
+                                                    bool readonly) {
+    auto pool = OpenImagePool(data_dir_, false);
+    if (!pool || size < kImagePoolChunkSize || images_->BackingImageExists(name) ||
+        !CanMapExtents(data_dir_)) {
+        return false;
+    }
+    auto pool_metadata_file = pool->metadata_dir_ + kMetadataFile;
+    auto pool_metadata = ReadFromImageFile(pool_metadata_file);
+    if (!pool_metadata) {
+        return false;
+    }
+    auto chunks = pool->images_->GetAllBackingImages();
+    size_t count = std::min<size_t>(chunks.size(), size / kImagePoolChunkSize);
+    if (!count) {
+        return false;
+    }
+
+    // Each chunk's file moves into this slot, keeping its extents. The
+    // first becomes |name|, and the rest extensions of it; see
+    // ExtendBackingImage().
+    bool ok = true;
+    for (size_t i = 0; ok && i < count; i++) {
+        auto image = i ? GetExtensionName(name, i) : name;
+        auto chunk_file = pool->GetImagePath(chunks[i]);
+        auto image_file = GetImagePath(image);
+        // The pool lets go of the chunk before its file moves, so that it
+        // never lists a file it no longer holds. Only the metadata goes.
+        auto builder = MetadataBuilder::New(*pool_metadata.get());
+        if (builder) {
+            builder->RemovePartition(chunks[i]);
+        }
+        auto exported = builder ? builder->Export() : nullptr;
+        if (!exported || !WriteToImageFile(pool_metadata_file, *exported.get())) {
+            LOG(ERROR) << "could not remove " << chunks[i] << " from the image pool";
+            ok = false;
+            break;
+        }
+        if (rename(chunk_file.c_str(), image_file.c_str())) {
+            PLOG(ERROR) << "rename " << chunk_file << " to " << image_file;
+            WriteToImageFile(pool_metadata_file, *pool_metadata.get());
+            ok = false;
+            break;
+        }
+        if (!AddImageFromMetadata(*pool_metadata, chunks[i], image)) {
+            if (rename(image_file.c_str(), chunk_file.c_str()) == 0) {
+                WriteToImageFile(pool_metadata_file, *pool_metadata.get());
+            }
+            ok = false;
+            break;
+        }
+        pool_metadata = std::move(exported);
+        if (i) {
+            ok = AppendExtension(name, image) && SetImageReadOnly(image, true);
+        }
+    }
+    // Whatever is not a whole chunk is allocated as usual.
+    ok = ok && (count * kImagePoolChunkSize == size || ExtendBackingImage(name, size, nullptr)) &&
+         (!readonly || SetImageReadOnly(name, true));
+    if (!ok) {
+        LOG(ERROR) << "could not create " << name << " from the image pool";
+        if (images_->BackingImageExists(name)) {
+            DeleteBackingImage(name);
+        }
+        return false;
+    }
+    LOG(INFO) << "created " << name << " from " << count << " chunks of the image pool";
+    return true;
+}
+
+void FiemapImageBackend::RemoveUnusedSharedImages(const std::string& data_dir) {
+    auto dir = GetSharedImageDir(data_dir);
+    std::unique_ptr<DIR, decltype(&closedir)> d(opendir(dir.c_str()), closedir);
+    if (!d) {
+        if (errno != ENOENT) {
+            PLOG(WARNING) << "opendir " << dir;
+        }
+        return;
+    }
+    std::vector<std::string> unused;
+    while (auto entry = readdir(d.get())) {
+        std::string file = entry->d_name;
+        std::string digest;
+        if (android::base::EndsWith(file, ".img")) {
+            // Only the published link is left.
+            struct stat s;
+            digest = file.substr(0, file.size() - strlen(".img"));
+            if (stat((dir + "/" + file).c_str(), &s) || s.st_nlink > 1) {
+                continue;
+            }
+        } else if (android::base::EndsWith(file, kSharedMetadataSuffix)) {
+            // The image went away without its metadata.
+            digest = file.substr(0, file.size() - strlen(kSharedMetadataSuffix));
+            if (access((dir + "/" + digest + ".img").c_str(), F_OK) == 0 || errno != ENOENT) {
+                continue;
+            }
+        } else if (android::base::EndsWith(file, ".tmp")) {
+            // Left by an interrupted ShareBackingImage().
+            if (unlink((dir + "/" + file).c_str())) {
+                PLOG(WARNING) << "unlink " << dir << "/" << file;
+            }
+            continue;
+        } else {
+            continue;
+        }
+        unused.emplace_back(digest);
+    }
+    d.reset();
+
+    for (const auto& digest : unused) {
+        // Drop the metadata first, so that nothing links to an image that
+        // is about to go away.
+        for (const auto& suffix : {kSharedMetadataSuffix, ".img"}) {
+            std::string message;
+            if (!android::base::RemoveFileIfExists(dir + "/" + digest + suffix, &message)) {
+                LOG(WARNING) << message;
+            }
+        }
+        LOG(INFO) << "removed unused shared image " << digest;
+    }
+    if (rmdir(dir.c_str()) && errno != ENOTEMPTY && errno != EEXIST) {
+        PLOG(WARNING) << "rmdir " << dir;
+    }
+}
+
+bool FiemapImageBackend::CanReuseBackingImage(const ImageSpec& image) {
+    if (!images_->BackingImageExists(image.name)) {
+        return false;
+    }
+    // Other slots read a shared image, so it must not be written in place.
+    struct stat s;
+    if (stat(GetImagePath(image.name).c_str(), &s) == 0 && s.st_nlink > 1) {
+        LOG(INFO) << "existing image " << image.name << " is shared";
+        return false;
+    }
+    auto metadata = ReadFromImageFile(metadata_dir_ + kMetadataFile);
+    if (!metadata) {
+        return false;
+    }
+    auto partition = FindImage(*metadata, image.name);
+    if (!partition) {
+        return false;
+    }
+    uint64_t size = GetExtentsSize(*metadata, *partition);
+    bool readonly = partition->attributes & LP_PARTITION_ATTR_READONLY;
+    if (size != image.size || readonly != image.readonly) {
+        LOG(INFO) << "existing image " << image.name << " (" << size << " bytes"
+                  << (readonly ? ", read-only" : "") << ") does not match";
+        return false;
+    }
+    if (partition->attributes & LP_PARTITION_ATTR_DISABLED) {
+        LOG(INFO) << "existing image " << image.name << " is disabled";
+        return false;
+    }
+    // This checks that the files of every image are still pinned, and have
+    // not moved since their extents were recorded.
+    if (!images_->Validate()) {
+        LOG(INFO) << "existing images failed validation";
+        return false;
+    }
+    return true;
+}
+
+bool FiemapImageBackend::IsImageMapped(const std::string& name) {
+    return images_->IsImageMapped(name);
+}
+
+bool FiemapImageBackend::UnmapImageDevice(const std::string& name) {
+    return images_->UnmapImageDevice(name);
+}
+
+bool FiemapImageBackend::UnmapImageIfExists(const std::string& name) {
+    return images_->UnmapImageIfExists(name);
+}
+
+std::unique_ptr<ImageDevice> FiemapImageBackend::OpenImageDevice(const std::string& name) {
+    auto device = MappedDevice::Open(images_.get(), 10s, name);
+    if (!device) {
+        return nullptr;
+    }
+    return std::make_unique<FiemapImageDevice>(std::move(device));
+}
+
+bool FiemapImageBackend::Validate() {
+    return images_->Validate();
+}
+
+bool FiemapImageBackend::SetImageReadOnly(const std::string& name, bool readonly) {
+    auto metadata_file = metadata_dir_ + kMetadataFile;
+    auto metadata = ReadFromImageFile(metadata_file);
+    if (!metadata) {
+        LOG(ERROR) << "could not read " << metadata_file;
+        return false;
+    }
+    auto builder = MetadataBuilder::New(*metadata.get());
+    auto partition = builder ? builder->FindPartition(name) : nullptr;
+    if (!partition) {
+        LOG(ERROR) << "image " << name << " not found";
+        return false;
+    }
+    uint32_t attributes = partition->attributes() & ~LP_PARTITION_ATTR_READONLY;
+    if (readonly) {
+        attributes |= LP_PARTITION_ATTR_READONLY;
+    }
+    partition->set_attributes(attributes);
+
+    auto exported = builder->Export();
+    if (!exported || !WriteToImageFile(metadata_file, *exported.get())) {
+        LOG(ERROR) << "could not write " << metadata_file;
+        return false;
+    }
+    return true;
+}
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <libfiemap/image_manager.h>
+#include <liblp/liblp.h>
+
+#include "image_backend.h"
+
+namespace android {
+namespace gsi {
+
+// ImageBackend for on-device installs: images are pinned files managed by
+// libfiemap, and are mapped through device-mapper to be written.
+class FiemapImageBackend final : public ImageBackend {
+  public:
+    static std::unique_ptr<FiemapImageBackend> Open(const std::string& metadata_dir,
+                                                    const std::string& data_dir);
+
+    bool BackingImageExists(const std::string& name) override;
+    bool CreateBackingImage(const std::string& name, uint64_t size, bool readonly,
+                            ProgressCallback&& on_progress) override;
+    bool CreateBackingImages(const std::vector<ImageSpec>& images,
+                             ProgressCallback&& on_progress) override;
+    bool ExtendBackingImage(const std::string& name, uint64_t size,
+                            ProgressCallback&& on_progress) override;
+    bool DeleteBackingImage(const std::string& name) override;
+    bool CanReuseBackingImage(const ImageSpec& image) override;
+    uint64_t GetImageAllocation(const std::string& name) override;
+    bool IsImageMapped(const std::string& name) override;
+    bool UnmapImageDevice(const std::string& name) override;
+    bool UnmapImageIfExists(const std::string& name) override;
+    std::unique_ptr<ImageDevice> OpenImageDevice(const std::string& name) override;
+    bool Validate() override;
+    bool SetImageReadOnly(const std::string& name, bool readonly) override;
+    bool GetImageLayout(const std::string& name, ImageLayout* layout) override;
+    bool ReplaceBackingImage(const std::string& name) override;
+    bool ShareBackingImage(const std::string& name, const std::string& digest) override;
+    bool LinkSharedImage(const std::string& digest, const std::string& name,
+                         uint64_t size) override;
+    bool CreateBackingImageFromPool(const std::string& name, uint64_t size,
+                                    bool readonly) override;
+
+    android::fiemap::ImageManager* manager() { return images_.get(); }
+
+    // The copy-on-write image of a snapshot of |name|. Like an extension,
+    // its name keeps it from being taken for a DSU partition, and it is
+    // deleted along with |name|.
+    static std::string GetCowName(const std::string& name);
+
+    // Whether ImageManager maps the images of |data_dir| with dm-linear over
+    // the extents in their metadata. Without device-mapper under /data, it
+    // maps an image's own file through a loop device instead, which leaves
+    // out the extents added from other files: images cannot then be
+    // extended, or built from the image pool.
+    static bool CanMapExtents(const std::string& data_dir);
+
+    // Images marked disabled, which ImageManager::RemoveDisabledImages()
+    // would delete. Extensions and copy-on-write images are not listed;
+    // they go with their image.
+    std::vector<std::string> GetDisabledImages();
+
+    // The byte ranges of its block device that |name| occupies, including
+    // those of its extensions, so that they can be discarded once the image
+    // is deleted.
+    struct DiskRange {
+        uint64_t offset;
+        uint64_t length;
+    };
+    bool GetImageRanges(const std::string& name, std::vector<DiskRange>* ranges);
+
+    // Shared images are hard links to the file of the slot that published
+    // them, kept in a directory next to the slots' own. Remove the ones no
+    // slot links to anymore.
+    static void RemoveUnusedSharedImages(const std::string& data_dir);
+
+    // The image pool of the filesystem holding |data_dir|; see
+    // ImageBackend::CreateBackingImageFromPool(). It grows and shrinks a
+    // chunk at a time.
+    static constexpr uint64_t kImagePoolChunkSize = 256 * 1024 * 1024;
+    static uint64_t GetImagePoolSize(const std::string& data_dir);
+    static bool AddImagePoolChunk(const std::string& data_dir, ProgressCallback&& on_progress);
+    static bool ShrinkImagePool(const std::string& data_dir, uint64_t size);
+
+  private:
+    FiemapImageBackend(std::unique_ptr<android::fiemap::ImageManager>&& images,
+                       const std::string& metadata_dir, const std::string& data_dir);
+
+    // Batch creation allocates each image with an ImageManager of its own,
+    // whose metadata lives in this directory until it is merged into ours.
+    std::string GetStagingDir(const std::string& name) const;
+    bool AdoptStagedImage(const std::string& name);
+    void RemoveStagingDir(const std::string& name);
+
+    // Delete |name| and its extensions, but not the images that go with it
+    // otherwise; see DeleteBackingImage().
+    bool DeleteImageAndExtensions(const std::string& name);
+
+    // Delete this slot's link to a shared image, and its metadata, leaving
+    // the file's blocks to the other links.
+    bool DeleteImageLink(const std::string& name);
+
+    // Add image |source_name| of |source| to our metadata as |name|.
+    bool AddImageFromMetadata(const android::fs_mgr::LpMetadata& source,
+                              const std::string& source_name, const std::string& name);
+
+    // An extended image is mapped over its own file followed by those of
+    // these images, which hold the added space.
+    static std::string GetExtensionName(const std::string& name, uint32_t index);
+
+    // Add the extents of |extension| to the end of |name|.
+    bool AppendExtension(const std::string& name, const std::string& extension);
+
+    static std::string GetSharedImageDir(const std::string& data_dir);
+    static std::string GetImagePoolDir(const std::string& data_dir);
+    static std::unique_ptr<FiemapImageBackend> OpenImagePool(const std::string& data_dir,
+                                                             bool create);
+    std::string GetImagePath(const std::string& name) const;
+
+    std::unique_ptr<android::fiemap::ImageManager> images_;
+    std::string metadata_dir_;
+    std::string data_dir_;
+};
+
+}  // namespace gsi
+}  // namespace android
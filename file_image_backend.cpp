@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "file_image_backend.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+
+namespace android {
+namespace gsi {
+
+using android::base::unique_fd;
+
+namespace {
+
+class FileImageDevice final : public ImageDevice {
+  public:
+    FileImageDevice(unique_fd&& fd, const std::string& path, std::set<std::string>* mapped,
+                    const std::string& name)
+        : fd_(std::move(fd)), path_(path), mapped_(mapped), name_(name) {
+        mapped_->emplace(name_);
+    }
+    ~FileImageDevice() override { mapped_->erase(name_); }
+
+    int fd() override { return fd_.get(); }
+    const std::string& path() override { return path_; }
+
+  private:
+    unique_fd fd_;
+    std::string path_;
+    std::set<std::string>* mapped_;
+    std::string name_;
+};
+
+}  // namespace
+
+FileImageBackend::FileImageBackend(const std::string& dir, bool sparse)
+    : dir_(dir), sparse_(sparse) {}
+
+std::string FileImageBackend::GetImagePath(const std::string& name) const {
+    return dir_ + "/" + name + ".img";
+}
+
+bool FileImageBackend::BackingImageExists(const std::string& name) {
+    return access(GetImagePath(name).c_str(), F_OK) == 0;
+}
+
+bool FileImageBackend::CreateBackingImage(const std::string& name, uint64_t size,
+                                          bool /* readonly */, ProgressCallback&& on_progress) {
+    auto path = GetImagePath(name);
+    unique_fd fd(open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644));
+    if (fd < 0) {
+        PLOG(ERROR) << "create " << path;
+        return false;
+    }
+    int rv = sparse_ ? ftruncate(fd, size) : fallocate(fd, 0, 0, size);
+    if (rv) {
+        PLOG(ERROR) << "allocate " << path;
+        unlink(path.c_str());
+        return false;
+    }
+    if (on_progress && !on_progress(size, size)) {
+        unlink(path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool FileImageBackend::ExtendBackingImage(const std::string& name, uint64_t size,
+                                          ProgressCallback&& on_progress) {
+    auto path = GetImagePath(name);
+    unique_fd fd(open(path.c_str(), O_RDWR | O_CLOEXEC));
+    struct stat s;
+    if (fd < 0 || fstat(fd, &s)) {
+        PLOG(ERROR) << "open " << path;
+        return false;
+    }
+    uint64_t old_size = s.st_size;
+    if (size <= old_size) {
+        LOG(ERROR) << name << " is already " << old_size << " bytes";
+        return false;
+    }
+    int rv = sparse_ ? ftruncate(fd, size) : fallocate(fd, 0, old_size, size - old_size);
+    if (rv) {
+        PLOG(ERROR) << "extend " << path;
+        return false;
+    }
+    if (on_progress) {
+        on_progress(size - old_size, size - old_size);
+    }
+    return true;
+}
+
+bool FileImageBackend::DeleteBackingImage(const std::string& name) {
+    if (mapped_.count(name)) {
+        LOG(ERROR) << "cannot delete " << name << " while it is open";
+        return false;
+    }
+    std::string message;
+    if (!android::base::RemoveFileIfExists(GetImagePath(name), &message)) {
+        LOG(ERROR) << message;
+        return false;
+    }
+    return true;
+}
+
+bool FileImageBackend::CanReuseBackingImage(const ImageSpec& image) {
+    // Files do not record whether they are read-only, and a sparse file is
+    // as good as a new one, so only the size matters.
+    struct stat s;
+    if (stat(GetImagePath(image.name).c_str(), &s)) {
+        return false;
+    }
+    return S_ISREG(s.st_mode) && static_cast<uint64_t>(s.st_size) == image.size;
+}
+
+uint64_t FileImageBackend::GetImageAllocation(const std::string& name) {
+    struct stat s;
+    if (stat(GetImagePath(name).c_str(), &s) || s.st_nlink > 1) {
+        return 0;
+    }
+    return 512ULL * s.st_blocks;
+}
+
+bool FileImageBackend::IsImageMapped(const std::string& name) {
+    return mapped_.count(name) > 0;
+}
+
+bool FileImageBackend::UnmapImageDevice(const std::string& name) {
+    // Devices are released by destroying their ImageDevice.
+    return !IsImageMapped(name);
+}
+
+bool FileImageBackend::UnmapImageIfExists(const std::string& name) {
+    return UnmapImageDevice(name);
+}
+
+std::unique_ptr<ImageDevice> FileImageBackend::OpenImageDevice(const std::string& name) {
+    auto path = GetImagePath(name);
+    unique_fd fd(open(path.c_str(), O_RDWR | O_CLOEXEC));
+    if (fd < 0) {
+        PLOG(ERROR) << "open " << path;
+        return nullptr;
+    }
+    return std::make_unique<FileImageDevice>(std::move(fd), path, &mapped_, name);
+}
+
+bool FileImageBackend::Validate() {
+    return true;
+}
+
+}  // namespace gsi
+}  // namespace android
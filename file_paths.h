@@ -28,6 +28,24 @@ static inline std::string MetadataDir(const std::string& dsu_slot) {
     return std::filesystem::path(DSU_METADATA_PREFIX) / dsu_slot;
 }
 
+// Present if the slot's userdata is thin: the size, in bytes, up to which
+// gsid grows it as it fills.
+static inline std::string DsuUserdataMaxSizeFile(const std::string& dsu_slot) {
+    return std::filesystem::path(MetadataDir(dsu_slot)) / "userdata_max_size";
+}
+
+// Per-phase timings of the most recent install into a slot. Each line holds
+// "<partition> <phase> <start_ns> <duration_ns> <bytes>".
+static inline std::string DsuInstallReportFile(const std::string& dsu_slot) {
+    return std::filesystem::path(MetadataDir(dsu_slot)) / "install_report";
+}
+
+// Present while the images of a removed slot wait to be deleted in the
+// background. It holds the install dir of the slot.
+static inline std::string DsuDeletePendingFile(const std::string& dsu_slot) {
+    return std::filesystem::path(MetadataDir(dsu_slot)) / "delete_pending";
+}
+
 static constexpr char kDsuOneShotBootFile[] = DSU_METADATA_PREFIX "one_shot_boot";
 
 // This file can contain the following values:
@@ -16,6 +16,7 @@
 
 #include "gsi_service.h"
 
+#include <dirent.h>
 #include <errno.h>
 #include <linux/fs.h>
 #include <stdio.h>
@@ -25,14 +26,19 @@
 #include <sys/vfs.h>
 #include <unistd.h>
 
-#include <array>
+#include <algorithm>
 #include <chrono>
+#include <functional>
+#include <memory>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/errors.h>
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/parseint.h>
 #include <android-base/properties.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
@@ -41,14 +47,20 @@
 #include <binder/LazyServiceRegistrar.h>
 #include <ext4_utils/ext4_utils.h>
 #include <fs_mgr.h>
-#include <libavb/libavb.h>
 #include <libdm/dm.h>
 #include <libfiemap/image_manager.h>
-#include <openssl/sha.h>
 #include <private/android_filesystem_config.h>
 
+#include "avb_image_info.h"
+#include "block_hashes.h"
+#include "fiemap_image_backend.h"
 #include "file_paths.h"
+#include "gsi_trace.h"
+#include "image_extent_reader.h"
+#include "install_planner.h"
+#include "io_throttle.h"
 #include "libgsi_private.h"
+#include "slot_reaper.h"
 
 namespace android {
 namespace gsi {
@@ -71,7 +83,28 @@ static std::mutex sInstanceLock;
 
 // Default userdata image size.
 static constexpr int64_t kDefaultUserdataSize = int64_t(2) * 1024 * 1024 * 1024;
+// Default initial size of thin userdata.
+static constexpr int64_t kDefaultThinUserdataSize = int64_t(512) * 1024 * 1024;
+// Each reserveImagePool() call adds at most this many chunks (1GiB), so
+// that it does not hold a binder thread for long.
+static constexpr uint32_t kMaxImagePoolChunksPerCall = 4;
+
+static bool CheckPartitionSize(const std::string& name, int64_t* size) {
+    if (*size % LP_SECTOR_SIZE) {
+        LOG(ERROR) << " size " << *size << " is not a multiple of " << LP_SECTOR_SIZE;
+        return false;
+    }
+    if (*size == 0 && name == "userdata") {
+        *size = kDefaultUserdataSize;
+    }
+    return true;
+}
+
+// getAvbInfo() reads and hashes at most this many images at once.
+static constexpr size_t kMaxAvbInfoThreads = 4;
 
+static bool GetAvbInfo(uint64_t total_size, const ReadAtOffsetFn& read_at, AvbInfo* dst);
+static bool GetAvbPublicKey(uint64_t total_size, const ReadAtOffsetFn& read_at, AvbPublicKey* dst);
 static bool GetAvbPublicKeyFromFd(int fd, AvbPublicKey* dst);
 
 GsiService::GsiService() {
@@ -86,6 +119,10 @@ void GsiService::Register() {
     if (ret != android::OK) {
         LOG(FATAL) << "Could not register gsi service: " << ret;
     }
+    // Pick up deletions left over from before gsid last exited.
+    if (!GetDeletedSlots().empty()) {
+        service->StartReaper();
+    }
 }
 
 #define ENFORCE_SYSTEM                      \
@@ -120,30 +157,60 @@ int GsiService::SaveInstallation(const std::string& installation) {
 }
 
 binder::Status GsiService::openInstall(const std::string& install_dir, int* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
+    GSI_TRACE_CALL();
     ENFORCE_SYSTEM;
-    std::lock_guard<std::mutex> guard(lock_);
+    TimedLockGuard guard(lock_, &stats_.lock);
     if (IsGsiRunning()) {
         *_aidl_return = IGsiService::INSTALL_ERROR_GENERIC;
         return binder::Status::ok();
     }
     install_dir_ = install_dir;
+    install_qos_ = InstallQos::kForeground;
     if (int status = ValidateInstallParams(install_dir_)) {
         *_aidl_return = status;
         return binder::Status::ok();
     }
-    std::string message;
+    // The slot may still hold images of a removed install, which must go
+    // before new ones of the same names are created. The install waits for
+    // that, so the freed blocks are not discarded. Other removed slots are
+    // left to the background reaper.
     auto dsu_slot = GetDsuSlot(install_dir_);
+    auto deleted_slots = GetDeletedSlots();
+    if (std::find(deleted_slots.begin(), deleted_slots.end(), dsu_slot) != deleted_slots.end() &&
+        !ReapDeletedSlot(dsu_slot, false, nullptr, &stats_)) {
+        *_aidl_return = IGsiService::INSTALL_ERROR_GENERIC;
+        return binder::Status::ok();
+    }
+    if (!deleted_slots.empty()) {
+        StartReaper();
+    }
+    std::string message;
+    previous_install_complete_ = IsInstallationComplete(dsu_slot);
     if (!RemoveFileIfExists(GetCompleteIndication(dsu_slot), &message)) {
         LOG(ERROR) << message;
     }
+    if (!RemoveFileIfExists(DsuInstallReportFile(dsu_slot), &message)) {
+        LOG(ERROR) << message;
+    }
+    if (!RemoveFileIfExists(DsuUserdataMaxSizeFile(dsu_slot), &message)) {
+        LOG(ERROR) << message;
+    }
+    // The new install replaces the userdata a snapshot was taken of.
+    if (int status = PartitionInstaller::RemoveUserdataSnapshot(dsu_slot, install_dir_)) {
+        *_aidl_return = status;
+        return binder::Status::ok();
+    }
     // Remember the installation directory before allocate any resource
     *_aidl_return = SaveInstallation(install_dir_);
     return binder::Status::ok();
 }
 
 binder::Status GsiService::closeInstall(int* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
+    GSI_TRACE_CALL();
     ENFORCE_SYSTEM;
-    std::lock_guard<std::mutex> guard(lock_);
+    TimedLockGuard guard(lock_, &stats_.lock);
     auto dsu_slot = GetDsuSlot(install_dir_);
     std::string file = GetCompleteIndication(dsu_slot);
     if (!WriteStringToFile("OK", file)) {
@@ -156,44 +223,334 @@ binder::Status GsiService::closeInstall(int* _aidl_return) {
 
 binder::Status GsiService::createPartition(const ::std::string& name, int64_t size, bool readOnly,
                                            int32_t* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
+    GSI_TRACE_CALL();
     ENFORCE_SYSTEM;
-    std::lock_guard<std::mutex> guard(lock_);
+    TimedLockGuard guard(lock_, &stats_.lock);
 
-    if (install_dir_.empty()) {
-        PLOG(ERROR) << "open is required for createPartition";
+    *_aidl_return = CreatePartition(name, size, readOnly, {});
+    return binder::Status::ok();
+}
+
+binder::Status GsiService::createPartitionWithDigest(const ::std::string& name, int64_t size,
+                                                     const ::std::string& digest,
+                                                     int32_t* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
+    GSI_TRACE_CALL();
+    ENFORCE_SYSTEM;
+    TimedLockGuard guard(lock_, &stats_.lock);
+
+    if (!IsValidImageDigest(digest)) {
+        LOG(ERROR) << "invalid image digest " << digest;
         *_aidl_return = INSTALL_ERROR_GENERIC;
         return binder::Status::ok();
     }
+    *_aidl_return = CreatePartition(name, size, true, digest);
+    return binder::Status::ok();
+}
+
+int GsiService::CreatePartition(const std::string& name, int64_t size, bool readOnly,
+                                const std::string& digest) {
+    if (install_dir_.empty()) {
+        PLOG(ERROR) << "open is required for createPartition";
+        return INSTALL_ERROR_GENERIC;
+    }
+
+    if (installer_ && installer_->paused()) {
+        LOG(ERROR) << "cannot create a partition while the install is paused";
+        return INSTALL_ERROR_GENERIC;
+    }
 
     // Make sure a pending interrupted installations are cleaned up.
     installer_ = nullptr;
+    pause_requested_ = false;
 
     // Do some precursor validation on the arguments before diving into the
     // install process.
-    if (size % LP_SECTOR_SIZE) {
-        LOG(ERROR) << " size " << size << " is not a multiple of " << LP_SECTOR_SIZE;
+    if (!CheckPartitionSize(name, &size)) {
+        return INSTALL_ERROR_GENERIC;
+    }
+
+    // Pick up an image allocated by createPartitions(). One that does not
+    // match is deleted here, before the new image is created.
+    for (auto iter = pending_installers_.begin(); iter != pending_installers_.end(); iter++) {
+        if ((*iter)->name() != name) {
+            continue;
+        }
+        if ((*iter)->size() == static_cast<uint64_t>(size) && (*iter)->read_only() == readOnly) {
+            installer_ = std::move(*iter);
+        }
+        pending_installers_.erase(iter);
+        break;
+    }
+    if (!installer_) {
+        installer_ = std::make_unique<PartitionInstaller>(
+                this, install_dir_, name, GetDsuSlot(install_dir_), size, readOnly, install_qos_);
+    }
+    installer_->set_digest(digest);
+    progress_ = {};
+    int status = installer_->StartInstall();
+    if (status != INSTALL_OK && status != INSTALL_SHARED) {
+        installer_ = nullptr;
+    }
+    return status;
+}
+
+// Check |partitions|, and work out the size each one's image is created
+// with. Thin userdata is created at its maximum size if images in
+// |install_dir| cannot be extended.
+static bool CheckPartitionSpecs(const std::string& install_dir,
+                                const std::vector<PartitionSpec>& partitions,
+                                std::vector<int64_t>* sizes, int64_t* userdata_max_size) {
+    std::set<std::string> names;
+    *userdata_max_size = 0;
+    for (const auto& partition : partitions) {
+        int64_t size = partition.size;
+        if (partition.maxSize) {
+            if (partition.name != "userdata" || partition.maxSize < size ||
+                partition.maxSize % LP_SECTOR_SIZE) {
+                LOG(ERROR) << "invalid maximum size " << partition.maxSize << " for "
+                           << partition.name;
+                return false;
+            }
+            if (!FiemapImageBackend::CanMapExtents(install_dir)) {
+                LOG(WARNING) << "userdata cannot grow in " << install_dir
+                             << "; creating it at its maximum size";
+                size = partition.maxSize;
+            } else {
+                if (!size) {
+                    size = std::min(kDefaultThinUserdataSize, partition.maxSize);
+                }
+                *userdata_max_size = partition.maxSize;
+            }
+        }
+        if (!CheckPartitionSize(partition.name, &size)) {
+            return false;
+        }
+        if (!names.emplace(partition.name).second) {
+            LOG(ERROR) << "partition " << partition.name << " is listed twice";
+            return false;
+        }
+        sizes->emplace_back(size);
+    }
+    return true;
+}
+
+binder::Status GsiService::createPartitions(const std::vector<PartitionSpec>& partitions,
+                                            int32_t* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
+    GSI_TRACE_CALL();
+    ENFORCE_SYSTEM;
+    TimedLockGuard guard(lock_, &stats_.lock);
+
+    if (install_dir_.empty()) {
+        LOG(ERROR) << "open is required for createPartitions";
         *_aidl_return = INSTALL_ERROR_GENERIC;
         return binder::Status::ok();
     }
+    if (installer_ && installer_->paused()) {
+        LOG(ERROR) << "cannot create partitions while the install is paused";
+        *_aidl_return = INSTALL_ERROR_GENERIC;
+        return binder::Status::ok();
+    }
+    if (partitions.empty()) {
+        LOG(ERROR) << "no partitions to create";
+        *_aidl_return = INSTALL_ERROR_GENERIC;
+        return binder::Status::ok();
+    }
+
+    installer_ = nullptr;
+    pending_installers_.clear();
+    pause_requested_ = false;
 
-    if (size == 0 && name == "userdata") {
-        size = kDefaultUserdataSize;
+    std::vector<int64_t> sizes;
+    int64_t userdata_max_size;
+    if (!CheckPartitionSpecs(install_dir_, partitions, &sizes, &userdata_max_size)) {
+        *_aidl_return = INSTALL_ERROR_GENERIC;
+        return binder::Status::ok();
+    }
+    std::vector<std::unique_ptr<PartitionInstaller>> installers;
+    std::vector<PartitionInstaller*> batch;
+    for (size_t i = 0; i < partitions.size(); i++) {
+        installers.emplace_back(std::make_unique<PartitionInstaller>(
+                this, install_dir_, partitions[i].name, GetDsuSlot(install_dir_), sizes[i],
+                partitions[i].readOnly, install_qos_));
+        batch.emplace_back(installers.back().get());
     }
-    installer_ = std::make_unique<PartitionInstaller>(this, install_dir_, name,
-                                                      GetDsuSlot(install_dir_), size, readOnly);
+
     progress_ = {};
-    int status = installer_->StartInstall();
+    int status = PartitionInstaller::PreallocateAll(batch);
+    // Installers left in |installers| on failure delete their images.
+    for (size_t i = 0; status == INSTALL_OK && i < installers.size(); i++) {
+        bool last = i + 1 == installers.size();
+        if (installers[i]->read_only() && !last) {
+            pending_installers_.emplace_back(std::move(installers[i]));
+            continue;
+        }
+        status = installers[i]->StartInstall();
+        if (status == INSTALL_OK && last) {
+            installer_ = std::move(installers[i]);
+        } else {
+            installers[i] = nullptr;
+        }
+    }
     if (status != INSTALL_OK) {
-        installer_ = nullptr;
+        pending_installers_.clear();
+    }
+    auto max_size_file = DsuUserdataMaxSizeFile(GetDsuSlot(install_dir_));
+    if (status == INSTALL_OK && userdata_max_size &&
+        !WriteStringToFile(std::to_string(userdata_max_size), max_size_file)) {
+        PLOG(ERROR) << "write " << max_size_file;
+        status = INSTALL_ERROR_GENERIC;
     }
     *_aidl_return = status;
     return binder::Status::ok();
 }
 
+binder::Status GsiService::planInstall(const std::string& installDir,
+                                       const std::vector<PartitionSpec>& partitions,
+                                       InstallPlan* plan, int32_t* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
+    GSI_TRACE_CALL();
+    ENFORCE_SYSTEM;
+    TimedLockGuard guard(lock_, &stats_.lock);
+
+    *plan = {};
+    std::string install_dir = installDir;
+    if (IsGsiRunning() || partitions.empty()) {
+        *_aidl_return = INSTALL_ERROR_GENERIC;
+        return binder::Status::ok();
+    }
+    if (int status = ValidateInstallParams(install_dir)) {
+        *_aidl_return = status;
+        return binder::Status::ok();
+    }
+    std::vector<int64_t> sizes;
+    int64_t userdata_max_size;
+    if (!CheckPartitionSpecs(install_dir, partitions, &sizes, &userdata_max_size)) {
+        *_aidl_return = INSTALL_ERROR_GENERIC;
+        return binder::Status::ok();
+    }
+    std::vector<ImageBackend::ImageSpec> images;
+    for (size_t i = 0; i < partitions.size(); i++) {
+        images.emplace_back(ImageBackend::ImageSpec{
+                .name = PartitionInstaller::GetBackingFile(partitions[i].name),
+                .size = static_cast<uint64_t>(sizes[i]),
+                .readonly = partitions[i].readOnly,
+        });
+    }
+    *_aidl_return = PlanInstall(GetDsuSlot(install_dir), install_dir, images, plan);
+    return binder::Status::ok();
+}
+
+// Whether the device is on external power, or has no battery to drain.
+// Batteries are not always named "battery", so every power supply of type
+// Battery is checked; anything that cannot be read counts as on battery.
+static bool IsCharging() {
+    static constexpr char kPowerSupplyDir[] = "/sys/class/power_supply";
+    std::unique_ptr<DIR, decltype(&closedir)> dir(opendir(kPowerSupplyDir), closedir);
+    if (!dir) {
+        PLOG(ERROR) << "opendir " << kPowerSupplyDir;
+        return false;
+    }
+    while (auto entry = readdir(dir.get())) {
+        std::string supply = kPowerSupplyDir + "/"s + entry->d_name;
+        std::string type;
+        if (entry->d_name[0] == '.' || !ReadFileToString(supply + "/type", &type) ||
+            android::base::Trim(type) != "Battery") {
+            continue;
+        }
+        std::string status;
+        if (!ReadFileToString(supply + "/status", &status)) {
+            PLOG(ERROR) << "read " << supply << "/status";
+            return false;
+        }
+        status = android::base::Trim(status);
+        if (status != "Charging" && status != "Full") {
+            return false;
+        }
+    }
+    return true;
+}
+
+binder::Status GsiService::reserveImagePool(int64_t size, int32_t* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
+    GSI_TRACE_CALL();
+    ENFORCE_SYSTEM;
+
+    if (size < 0) {
+        *_aidl_return = INSTALL_ERROR_GENERIC;
+        return binder::Status::ok();
+    }
+    auto chunk_size = FiemapImageBackend::kImagePoolChunkSize;
+    uint64_t target = size / chunk_size * chunk_size;
+    // lock_ is only held for one chunk at a time, so that an install can
+    // start in between, and stop the reservation.
+    for (uint32_t added = 0;; added++) {
+        TimedLockGuard guard(lock_, &stats_.lock);
+        uint64_t pool_size = FiemapImageBackend::GetImagePoolSize(kDefaultDsuImageFolder);
+        if (pool_size >= target) {
+            bool ok = FiemapImageBackend::ShrinkImagePool(kDefaultDsuImageFolder, target);
+            *_aidl_return = ok ? INSTALL_OK : INSTALL_ERROR_GENERIC;
+            return binder::Status::ok();
+        }
+        if (added == kMaxImagePoolChunksPerCall) {
+            *_aidl_return = INSTALL_POOL_INCOMPLETE;
+            return binder::Status::ok();
+        }
+        if (IsGsiRunning() || installer_ || !IsCharging()) {
+            LOG(INFO) << "stopped growing the image pool at " << pool_size << " bytes";
+            *_aidl_return = INSTALL_POOL_STOPPED;
+            return binder::Status::ok();
+        }
+        if (int status = CheckGrowthHeadroom(kDefaultDsuImageFolder, chunk_size)) {
+            *_aidl_return = status;
+            return binder::Status::ok();
+        }
+
+        ScopedIoPriority priority(InstallQos::kIdle);
+        bool aborted = false;
+        auto progress = [this, &aborted](uint64_t /* bytes */, uint64_t /* total */) -> bool {
+            aborted = aborted || should_abort_;
+            return !aborted;
+        };
+        if (!FiemapImageBackend::AddImagePoolChunk(kDefaultDsuImageFolder, std::move(progress))) {
+            if (aborted) {
+                LOG(INFO) << "image pool reservation cancelled at " << pool_size << " bytes";
+            }
+            *_aidl_return = aborted ? INSTALL_POOL_STOPPED : INSTALL_ERROR_GENERIC;
+            return binder::Status::ok();
+        }
+    }
+}
+
+binder::Status GsiService::setInstallQos(int32_t qos, int32_t* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
+    ENFORCE_SYSTEM;
+    TimedLockGuard guard(lock_, &stats_.lock);
+
+    if (install_dir_.empty()) {
+        LOG(ERROR) << "open is required for setInstallQos";
+        *_aidl_return = INSTALL_ERROR_GENERIC;
+        return binder::Status::ok();
+    }
+    if (qos != INSTALL_QOS_FOREGROUND && qos != INSTALL_QOS_BACKGROUND &&
+        qos != INSTALL_QOS_IDLE) {
+        LOG(ERROR) << "invalid install QoS " << qos;
+        *_aidl_return = INSTALL_ERROR_GENERIC;
+        return binder::Status::ok();
+    }
+    install_qos_ = static_cast<InstallQos>(qos);
+    *_aidl_return = INSTALL_OK;
+    return binder::Status::ok();
+}
+
 binder::Status GsiService::commitGsiChunkFromStream(const android::os::ParcelFileDescriptor& stream,
                                                     int64_t bytes, bool* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
+    GSI_TRACE_CALL();
     ENFORCE_SYSTEM;
-    std::lock_guard<std::mutex> guard(lock_);
+    TimedLockGuard guard(lock_, &stats_.lock);
 
     if (!installer_) {
         *_aidl_return = false;
@@ -204,8 +561,45 @@ binder::Status GsiService::commitGsiChunkFromStream(const android::os::ParcelFil
     return binder::Status::ok();
 }
 
+binder::Status GsiService::getPartitionBlockHashes(int32_t blockSize,
+                                                   const android::os::ParcelFileDescriptor& output,
+                                                   int32_t* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
+    GSI_TRACE_CALL();
+    ENFORCE_SYSTEM;
+    TimedLockGuard guard(lock_, &stats_.lock);
+
+    if (!installer_) {
+        *_aidl_return = INSTALL_ERROR_GENERIC;
+        return binder::Status::ok();
+    }
+    if (blockSize <= 0) {
+        LOG(ERROR) << "invalid hash block size " << blockSize;
+        *_aidl_return = INSTALL_ERROR_GENERIC;
+        return binder::Status::ok();
+    }
+    *_aidl_return = installer_->WriteBlockHashes(blockSize, output.get());
+    return binder::Status::ok();
+}
+
+binder::Status GsiService::commitGsiPatchFromStream(const android::os::ParcelFileDescriptor& stream,
+                                                    int64_t bytes, int64_t* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
+    GSI_TRACE_CALL();
+    ENFORCE_SYSTEM;
+    TimedLockGuard guard(lock_, &stats_.lock);
+
+    if (!installer_) {
+        *_aidl_return = -1;
+        return binder::Status::ok();
+    }
+
+    *_aidl_return = installer_->CommitGsiPatch(stream.get(), bytes);
+    return binder::Status::ok();
+}
+
 void GsiService::StartAsyncOperation(const std::string& step, int64_t total_bytes) {
-    std::lock_guard<std::mutex> guard(progress_lock_);
+    TimedLockGuard guard(progress_lock_, &stats_.progress_lock);
 
     progress_.step = step;
     progress_.status = STATUS_WORKING;
@@ -214,7 +608,7 @@ void GsiService::StartAsyncOperation(const std::string& step, int64_t total_byte
 }
 
 void GsiService::UpdateProgress(int status, int64_t bytes_processed) {
-    std::lock_guard<std::mutex> guard(progress_lock_);
+    TimedLockGuard guard(progress_lock_, &stats_.progress_lock);
 
     progress_.status = status;
     if (status == STATUS_COMPLETE) {
@@ -222,11 +616,16 @@ void GsiService::UpdateProgress(int status, int64_t bytes_processed) {
     } else {
         progress_.bytes_processed = bytes_processed;
     }
+    if (progress_.total_bytes > 0) {
+        GSI_TRACE_INT64("gsid.progress_permille",
+                        progress_.bytes_processed * 1000 / progress_.total_bytes);
+    }
 }
 
 binder::Status GsiService::getInstallProgress(::android::gsi::GsiProgress* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
     ENFORCE_SYSTEM;
-    std::lock_guard<std::mutex> guard(progress_lock_);
+    TimedLockGuard guard(progress_lock_, &stats_.progress_lock);
 
     if (installer_ == nullptr) {
         progress_ = {};
@@ -236,8 +635,10 @@ binder::Status GsiService::getInstallProgress(::android::gsi::GsiProgress* _aidl
 }
 
 binder::Status GsiService::commitGsiChunkFromAshmem(int64_t bytes, bool* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
+    GSI_TRACE_CALL();
     ENFORCE_SYSTEM;
-    std::lock_guard<std::mutex> guard(lock_);
+    TimedLockGuard guard(lock_, &stats_.lock);
 
     if (!installer_) {
         *_aidl_return = false;
@@ -249,6 +650,7 @@ binder::Status GsiService::commitGsiChunkFromAshmem(int64_t bytes, bool* _aidl_r
 
 binder::Status GsiService::setGsiAshmem(const ::android::os::ParcelFileDescriptor& ashmem,
                                         int64_t size, bool* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
     ENFORCE_SYSTEM;
     if (!installer_) {
         *_aidl_return = false;
@@ -260,6 +662,7 @@ binder::Status GsiService::setGsiAshmem(const ::android::os::ParcelFileDescripto
 
 binder::Status GsiService::enableGsiAsync(bool one_shot, const std::string& dsuSlot,
                                           const sp<IGsiServiceCallback>& resultCallback) {
+    stats_.RecordBinderCall(__func__);
     int result;
     auto status = enableGsi(one_shot, dsuSlot, &result);
     if (!status.isOk()) {
@@ -271,7 +674,9 @@ binder::Status GsiService::enableGsiAsync(bool one_shot, const std::string& dsuS
 }
 
 binder::Status GsiService::enableGsi(bool one_shot, const std::string& dsuSlot, int* _aidl_return) {
-    std::lock_guard<std::mutex> guard(lock_);
+    stats_.RecordBinderCall(__func__);
+    GSI_TRACE_CALL();
+    TimedLockGuard guard(lock_, &stats_.lock);
 
     if (!WriteStringToFile(dsuSlot, kDsuActiveFile)) {
         PLOG(ERROR) << "write failed: " << GetDsuSlot(install_dir_);
@@ -281,6 +686,7 @@ binder::Status GsiService::enableGsi(bool one_shot, const std::string& dsuSlot,
     if (installer_) {
         ENFORCE_SYSTEM;
         installer_ = {};
+        pending_installers_.clear();
         // Note: create the install status file last, since this is the actual boot
         // indicator.
         if (!SetBootMode(one_shot) || !CreateInstallStatusFile()) {
@@ -294,12 +700,14 @@ binder::Status GsiService::enableGsi(bool one_shot, const std::string& dsuSlot,
     }
 
     installer_ = nullptr;
+    pending_installers_.clear();
     return binder::Status::ok();
 }
 
 binder::Status GsiService::isGsiEnabled(bool* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
     ENFORCE_SYSTEM_OR_SHELL;
-    std::lock_guard<std::mutex> guard(lock_);
+    TimedLockGuard guard(lock_, &stats_.lock);
     std::string boot_key;
     if (!GetInstallStatus(&boot_key)) {
         *_aidl_return = false;
@@ -310,6 +718,7 @@ binder::Status GsiService::isGsiEnabled(bool* _aidl_return) {
 }
 
 binder::Status GsiService::removeGsiAsync(const sp<IGsiServiceCallback>& resultCallback) {
+    stats_.RecordBinderCall(__func__);
     bool result;
     auto status = removeGsi(&result);
     if (!status.isOk()) {
@@ -321,8 +730,10 @@ binder::Status GsiService::removeGsiAsync(const sp<IGsiServiceCallback>& resultC
 }
 
 binder::Status GsiService::removeGsi(bool* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
+    GSI_TRACE_CALL();
     ENFORCE_SYSTEM_OR_SHELL;
-    std::lock_guard<std::mutex> guard(lock_);
+    TimedLockGuard guard(lock_, &stats_.lock);
 
     std::string install_dir = GetActiveInstalledImageDir();
     if (IsGsiRunning()) {
@@ -330,81 +741,136 @@ binder::Status GsiService::removeGsi(bool* _aidl_return) {
         *_aidl_return = UninstallGsi();
     } else {
         installer_ = {};
+        pending_installers_.clear();
         *_aidl_return = RemoveGsiFiles(install_dir);
+        if (*_aidl_return) {
+            install_dir_.clear();
+        }
+        StartReaper();
     }
     return binder::Status::ok();
 }
 
 binder::Status GsiService::disableGsi(bool* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
     ENFORCE_SYSTEM_OR_SHELL;
-    std::lock_guard<std::mutex> guard(lock_);
+    TimedLockGuard guard(lock_, &stats_.lock);
 
     *_aidl_return = DisableGsiInstall();
     return binder::Status::ok();
 }
 
 binder::Status GsiService::isGsiRunning(bool* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
     ENFORCE_SYSTEM_OR_SHELL;
-    std::lock_guard<std::mutex> guard(lock_);
+    TimedLockGuard guard(lock_, &stats_.lock);
 
     *_aidl_return = IsGsiRunning();
     return binder::Status::ok();
 }
 
 binder::Status GsiService::isGsiInstalled(bool* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
     ENFORCE_SYSTEM_OR_SHELL;
-    std::lock_guard<std::mutex> guard(lock_);
+    TimedLockGuard guard(lock_, &stats_.lock);
 
     *_aidl_return = IsGsiInstalled();
     return binder::Status::ok();
 }
 
 binder::Status GsiService::isGsiInstallInProgress(bool* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
     ENFORCE_SYSTEM_OR_SHELL;
-    std::lock_guard<std::mutex> guard(lock_);
+    TimedLockGuard guard(lock_, &stats_.lock);
 
     *_aidl_return = !!installer_;
     return binder::Status::ok();
 }
 
 binder::Status GsiService::cancelGsiInstall(bool* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
+    GSI_TRACE_CALL();
     ENFORCE_SYSTEM;
     should_abort_ = true;
-    std::lock_guard<std::mutex> guard(lock_);
+    TimedLockGuard guard(lock_, &stats_.lock);
 
     should_abort_ = false;
+    pause_requested_ = false;
     installer_ = nullptr;
+    pending_installers_.clear();
 
     *_aidl_return = true;
     return binder::Status::ok();
 }
 
+binder::Status GsiService::pauseInstall(int* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
+    GSI_TRACE_CALL();
+    ENFORCE_SYSTEM;
+    // Like cancelGsiInstall(), make any commit in progress give up lock_.
+    pause_requested_ = true;
+    TimedLockGuard guard(lock_, &stats_.lock);
+
+    if (!installer_) {
+        LOG(ERROR) << "no install in progress to pause";
+        pause_requested_ = false;
+        *_aidl_return = INSTALL_ERROR_GENERIC;
+        return binder::Status::ok();
+    }
+    pause_requested_ = true;
+    installer_->Pause();
+    *_aidl_return = INSTALL_OK;
+    return binder::Status::ok();
+}
+
+binder::Status GsiService::resumeInstall(int* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
+    GSI_TRACE_CALL();
+    ENFORCE_SYSTEM;
+    TimedLockGuard guard(lock_, &stats_.lock);
+
+    if (!installer_ || !installer_->paused()) {
+        LOG(ERROR) << "no paused install to resume";
+        *_aidl_return = INSTALL_ERROR_GENERIC;
+        return binder::Status::ok();
+    }
+    pause_requested_ = false;
+    installer_->Resume();
+    *_aidl_return = INSTALL_OK;
+    return binder::Status::ok();
+}
+
 binder::Status GsiService::getInstalledGsiImageDir(std::string* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
     ENFORCE_SYSTEM;
-    std::lock_guard<std::mutex> guard(lock_);
+    TimedLockGuard guard(lock_, &stats_.lock);
 
     *_aidl_return = GetActiveInstalledImageDir();
     return binder::Status::ok();
 }
 
 binder::Status GsiService::getActiveDsuSlot(std::string* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
     ENFORCE_SYSTEM_OR_SHELL;
-    std::lock_guard<std::mutex> guard(lock_);
+    TimedLockGuard guard(lock_, &stats_.lock);
 
     *_aidl_return = GetActiveDsuSlot();
     return binder::Status::ok();
 }
 
 binder::Status GsiService::getInstalledDsuSlots(std::vector<std::string>* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
     ENFORCE_SYSTEM;
-    std::lock_guard<std::mutex> guard(lock_);
+    TimedLockGuard guard(lock_, &stats_.lock);
     *_aidl_return = GetInstalledDsuSlots();
     return binder::Status::ok();
 }
 
 binder::Status GsiService::zeroPartition(const std::string& name, int* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
+    GSI_TRACE_CALL();
     ENFORCE_SYSTEM_OR_SHELL;
-    std::lock_guard<std::mutex> guard(lock_);
+    TimedLockGuard guard(lock_, &stats_.lock);
 
     if (IsGsiRunning() || !IsGsiInstalled()) {
         *_aidl_return = IGsiService::INSTALL_ERROR_GENERIC;
@@ -417,12 +883,82 @@ binder::Status GsiService::zeroPartition(const std::string& name, int* _aidl_ret
     return binder::Status::ok();
 }
 
+binder::Status GsiService::resizePartition(const std::string& name, int64_t newSize,
+                                           int* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
+    GSI_TRACE_CALL();
+    ENFORCE_SYSTEM_OR_SHELL;
+    TimedLockGuard guard(lock_, &stats_.lock);
+
+    if (IsGsiRunning() || !IsGsiInstalled() || installer_ || newSize <= 0 ||
+        newSize % LP_SECTOR_SIZE) {
+        *_aidl_return = IGsiService::INSTALL_ERROR_GENERIC;
+        return binder::Status::ok();
+    }
+
+    std::string install_dir = GetActiveInstalledImageDir();
+    auto dsu_slot = GetDsuSlot(install_dir);
+    *_aidl_return = PartitionInstaller::ResizeWritable(dsu_slot, install_dir, name, newSize);
+    return binder::Status::ok();
+}
+
+binder::Status GsiService::createUserdataSnapshot(int64_t cowSize, int* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
+    GSI_TRACE_CALL();
+    ENFORCE_SYSTEM_OR_SHELL;
+    TimedLockGuard guard(lock_, &stats_.lock);
+
+    if (IsGsiRunning() || !IsGsiInstalled() || installer_ || cowSize <= 0) {
+        *_aidl_return = IGsiService::INSTALL_ERROR_GENERIC;
+        return binder::Status::ok();
+    }
+
+    std::string install_dir = GetActiveInstalledImageDir();
+    auto dsu_slot = GetDsuSlot(install_dir);
+    *_aidl_return = PartitionInstaller::CreateUserdataSnapshot(dsu_slot, install_dir, cowSize);
+    return binder::Status::ok();
+}
+
+binder::Status GsiService::resetUserdataSnapshot(int* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
+    GSI_TRACE_CALL();
+    ENFORCE_SYSTEM_OR_SHELL;
+    TimedLockGuard guard(lock_, &stats_.lock);
+
+    if (IsGsiRunning() || !IsGsiInstalled()) {
+        *_aidl_return = IGsiService::INSTALL_ERROR_GENERIC;
+        return binder::Status::ok();
+    }
+
+    std::string install_dir = GetActiveInstalledImageDir();
+    *_aidl_return = PartitionInstaller::ResetUserdataSnapshot(GetDsuSlot(install_dir), install_dir);
+    return binder::Status::ok();
+}
+
+binder::Status GsiService::removeUserdataSnapshot(int* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
+    GSI_TRACE_CALL();
+    ENFORCE_SYSTEM_OR_SHELL;
+    TimedLockGuard guard(lock_, &stats_.lock);
+
+    if (IsGsiRunning() || !IsGsiInstalled()) {
+        *_aidl_return = IGsiService::INSTALL_ERROR_GENERIC;
+        return binder::Status::ok();
+    }
+
+    std::string install_dir = GetActiveInstalledImageDir();
+    auto dsu_slot = GetDsuSlot(install_dir);
+    *_aidl_return = PartitionInstaller::RemoveUserdataSnapshot(dsu_slot, install_dir);
+    return binder::Status::ok();
+}
+
 static binder::Status BinderError(const std::string& message,
                                   FiemapStatus::ErrorCode status = FiemapStatus::ErrorCode::ERROR) {
     return binder::Status::fromServiceSpecificError(static_cast<int32_t>(status), message.c_str());
 }
 
 binder::Status GsiService::dumpDeviceMapperDevices(std::string* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
     ENFORCE_SYSTEM_OR_SHELL;
 
     auto& dm = DeviceMapper::Instance();
@@ -454,9 +990,104 @@ binder::Status GsiService::dumpDeviceMapperDevices(std::string* _aidl_return) {
     return binder::Status::ok();
 }
 
+binder::Status GsiService::getInstallReport(const std::string& dsuSlot,
+                                            std::vector<InstallPhase>* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
+    ENFORCE_SYSTEM_OR_SHELL;
+
+    if (dsuSlot.empty() || dsuSlot.find('/') != std::string::npos || dsuSlot[0] == '.') {
+        return BinderError("Invalid DSU slot");
+    }
+
+    _aidl_return->clear();
+    std::string content;
+    if (!ReadFileToString(DsuInstallReportFile(dsuSlot), &content)) {
+        // No install has been attempted into this slot.
+        return binder::Status::ok();
+    }
+    for (const auto& line : android::base::Split(content, "\n")) {
+        auto fields = android::base::Split(line, " ");
+        if (fields.size() != 5) {
+            continue;
+        }
+        InstallPhase phase;
+        phase.partition = fields[0];
+        phase.phase = fields[1];
+        if (!android::base::ParseInt(fields[2], &phase.startNs) ||
+            !android::base::ParseInt(fields[3], &phase.durationNs) ||
+            !android::base::ParseInt(fields[4], &phase.bytes)) {
+            LOG(ERROR) << "Malformed install report line: " << line;
+            continue;
+        }
+        _aidl_return->emplace_back(std::move(phase));
+    }
+    return binder::Status::ok();
+}
+
+static std::string JsonString(const std::string& value) {
+    std::string out = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            out += StringPrintf("\\u%04x", c);
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+binder::Status GsiService::dumpDeviceMapperDevicesToFd(
+        const std::string& prefix, const ::android::os::ParcelFileDescriptor& output) {
+    stats_.RecordBinderCall(__func__);
+    ENFORCE_SYSTEM_OR_SHELL;
+
+    auto& dm = DeviceMapper::Instance();
+
+    std::vector<DeviceMapper::DmBlockDevice> devices;
+    if (!dm.GetAvailableDevices(&devices)) {
+        return BinderError("Could not list devices");
+    }
+
+    for (const auto& device : devices) {
+        if (!android::base::StartsWith(device.name(), prefix)) {
+            continue;
+        }
+
+        std::string record = StringPrintf(R"({"name":%s,"major":%u,"minor":%u,"targets":)",
+                                          JsonString(device.name()).c_str(), device.Major(),
+                                          device.Minor());
+        std::vector<DeviceMapper::TargetInfo> table;
+        if (dm.GetTableInfo(device.name(), &table)) {
+            record += "[";
+            for (size_t i = 0; i < table.size(); i++) {
+                const auto& spec = table[i].spec;
+                record += StringPrintf(
+                        R"(%s{"type":%s,"sector_start":%llu,"length":%llu,"data":%s})",
+                        i ? "," : "", JsonString(DeviceMapper::GetTargetType(spec)).c_str(),
+                        static_cast<unsigned long long>(spec.sector_start),
+                        static_cast<unsigned long long>(spec.length),
+                        JsonString(table[i].data).c_str());
+            }
+            record += "]";
+        } else {
+            record += "null";
+        }
+        record += "}\n";
+
+        if (!WriteStringToFd(record, output.get())) {
+            return BinderError("Could not write device-mapper record: "s + strerror(errno));
+        }
+    }
+    return binder::Status::ok();
+}
+
 binder::Status GsiService::getAvbPublicKey(AvbPublicKey* dst, int32_t* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
     ENFORCE_SYSTEM;
-    std::lock_guard<std::mutex> guard(lock_);
+    TimedLockGuard guard(lock_, &stats_.lock);
 
     if (!installer_) {
         *_aidl_return = INSTALL_ERROR_GENERIC;
@@ -472,6 +1103,33 @@ binder::Status GsiService::getAvbPublicKey(AvbPublicKey* dst, int32_t* _aidl_ret
     return binder::Status::ok();
 }
 
+status_t GsiService::dump(int fd, const Vector<String16>& /* args */) {
+    if (!CheckUid(AccessLevel::SystemOrShell).isOk()) {
+        WriteStringToFd("Permission denied\n", fd);
+        return PERMISSION_DENIED;
+    }
+
+    // lock_ is deliberately not taken, so that dumping works while a slow
+    // install operation is holding it.
+    GsiProgress progress;
+    {
+        TimedLockGuard guard(progress_lock_, &stats_.progress_lock);
+        progress = progress_;
+    }
+
+    std::stringstream text;
+    text << "progress: step=\"" << progress.step << "\" status=" << progress.status
+         << " bytes=" << progress.bytes_processed << "/" << progress.total_bytes << "\n";
+    text << stats_.ToString();
+    text << "image pool: " << FiemapImageBackend::GetImagePoolSize(kDefaultDsuImageFolder)
+         << " bytes\n";
+    text << "slots pending deletion: " << android::base::Join(GetDeletedSlots(), ", ") << "\n";
+    if (!WriteStringToFd(text.str(), fd)) {
+        return UNKNOWN_ERROR;
+    }
+    return OK;
+}
+
 bool GsiService::CreateInstallStatusFile() {
     if (!android::base::WriteStringToFile("0", kDsuInstallStatusFile)) {
         PLOG(ERROR) << "write " << kDsuInstallStatusFile;
@@ -505,7 +1163,8 @@ static binder::Status UidSecurityError() {
 
 class ImageService : public BinderService<ImageService>, public BnImageService {
   public:
-    ImageService(GsiService* service, std::unique_ptr<ImageManager>&& impl, uid_t uid);
+    ImageService(GsiService* service, std::unique_ptr<ImageManager>&& impl,
+                 const std::string& metadata_dir, uid_t uid);
     binder::Status getAllBackingImages(std::vector<std::string>* _aidl_return);
     binder::Status createBackingImage(const std::string& name, int64_t size, int flags,
                                       const sp<IProgressCallback>& on_progress) override;
@@ -517,32 +1176,76 @@ class ImageService : public BinderService<ImageService>, public BnImageService {
     binder::Status isImageMapped(const std::string& name, bool* _aidl_return) override;
     binder::Status getAvbPublicKey(const std::string& name, AvbPublicKey* dst,
                                    int32_t* _aidl_return) override;
+    binder::Status getAvbInfo(const std::vector<std::string>& names,
+                              std::vector<AvbInfo>* _aidl_return) override;
     binder::Status zeroFillNewImage(const std::string& name, int64_t bytes) override;
     binder::Status removeAllImages() override;
     binder::Status removeDisabledImages() override;
     binder::Status getMappedImageDevice(const std::string& name, std::string* device) override;
 
   private:
+    // Keeps an image readable for AVB parsing, either through its extents or
+    // through a mapped block device.
+    struct ImageSource {
+        std::unique_ptr<ImageExtentReader> reader;
+        std::unique_ptr<MappedDevice> mapped_device;
+        // Declared last so it is closed before the device is unmapped.
+        unique_fd fd;
+
+        bool OpenDevice(const std::string& path);
+        uint64_t size() const;
+        ReadAtOffsetFn read_at();
+    };
+
     bool CheckUid();
+    bool OpenImageSource(const std::string& name, ImageSource* source);
 
     android::sp<GsiService> service_;
     std::unique_ptr<ImageManager> impl_;
+    std::string metadata_dir_;
     uid_t uid_;
 };
 
-ImageService::ImageService(GsiService* service, std::unique_ptr<ImageManager>&& impl, uid_t uid)
-    : service_(service), impl_(std::move(impl)), uid_(uid) {}
+ImageService::ImageService(GsiService* service, std::unique_ptr<ImageManager>&& impl,
+                           const std::string& metadata_dir, uid_t uid)
+    : service_(service), impl_(std::move(impl)), metadata_dir_(metadata_dir), uid_(uid) {}
+
+bool ImageService::ImageSource::OpenDevice(const std::string& path) {
+    fd.reset(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (!fd.ok()) {
+        PLOG(ERROR) << "Fail to open mapped device: " << path;
+        return false;
+    }
+    return true;
+}
+
+uint64_t ImageService::ImageSource::size() const {
+    return reader ? reader->size() : get_block_device_size(fd.get());
+}
+
+ReadAtOffsetFn ImageService::ImageSource::read_at() {
+    if (reader) {
+        return [this](void* data, size_t size, uint64_t offset) -> bool {
+            return reader->ReadAt(data, size, offset);
+        };
+    }
+    return [this](void* data, size_t size, uint64_t offset) -> bool {
+        return ReadFullyAtOffset(fd.get(), data, size, offset);
+    };
+}
 
 binder::Status ImageService::getAllBackingImages(std::vector<std::string>* _aidl_return) {
+    service_->stats().RecordBinderCall(__func__, "IImageService::");
     *_aidl_return = impl_->GetAllBackingImages();
     return binder::Status::ok();
 }
 
 binder::Status ImageService::createBackingImage(const std::string& name, int64_t size, int flags,
                                                 const sp<IProgressCallback>& on_progress) {
+    service_->stats().RecordBinderCall(__func__, "IImageService::");
     if (!CheckUid()) return UidSecurityError();
 
-    std::lock_guard<std::mutex> guard(service_->lock());
+    TimedLockGuard guard(service_->lock(), &service_->stats().lock);
 
     std::function<bool(uint64_t, uint64_t)> callback;
     if (on_progress) {
@@ -565,9 +1268,10 @@ binder::Status ImageService::createBackingImage(const std::string& name, int64_t
 }
 
 binder::Status ImageService::deleteBackingImage(const std::string& name) {
+    service_->stats().RecordBinderCall(__func__, "IImageService::");
     if (!CheckUid()) return UidSecurityError();
 
-    std::lock_guard<std::mutex> guard(service_->lock());
+    TimedLockGuard guard(service_->lock(), &service_->stats().lock);
 
     if (!impl_->DeleteBackingImage(name)) {
         return BinderError("Failed to delete");
@@ -577,9 +1281,10 @@ binder::Status ImageService::deleteBackingImage(const std::string& name) {
 
 binder::Status ImageService::mapImageDevice(const std::string& name, int32_t timeout_ms,
                                             MappedImage* mapping) {
+    service_->stats().RecordBinderCall(__func__, "IImageService::");
     if (!CheckUid()) return UidSecurityError();
 
-    std::lock_guard<std::mutex> guard(service_->lock());
+    TimedLockGuard guard(service_->lock(), &service_->stats().lock);
 
     if (!impl_->MapImageDevice(name, std::chrono::milliseconds(timeout_ms), &mapping->path)) {
         return BinderError("Failed to map");
@@ -588,9 +1293,10 @@ binder::Status ImageService::mapImageDevice(const std::string& name, int32_t tim
 }
 
 binder::Status ImageService::unmapImageDevice(const std::string& name) {
+    service_->stats().RecordBinderCall(__func__, "IImageService::");
     if (!CheckUid()) return UidSecurityError();
 
-    std::lock_guard<std::mutex> guard(service_->lock());
+    TimedLockGuard guard(service_->lock(), &service_->stats().lock);
 
     if (!impl_->UnmapImageDevice(name)) {
         return BinderError("Failed to unmap");
@@ -599,18 +1305,20 @@ binder::Status ImageService::unmapImageDevice(const std::string& name) {
 }
 
 binder::Status ImageService::backingImageExists(const std::string& name, bool* _aidl_return) {
+    service_->stats().RecordBinderCall(__func__, "IImageService::");
     if (!CheckUid()) return UidSecurityError();
 
-    std::lock_guard<std::mutex> guard(service_->lock());
+    TimedLockGuard guard(service_->lock(), &service_->stats().lock);
 
     *_aidl_return = impl_->BackingImageExists(name);
     return binder::Status::ok();
 }
 
 binder::Status ImageService::isImageMapped(const std::string& name, bool* _aidl_return) {
+    service_->stats().RecordBinderCall(__func__, "IImageService::");
     if (!CheckUid()) return UidSecurityError();
 
-    std::lock_guard<std::mutex> guard(service_->lock());
+    TimedLockGuard guard(service_->lock(), &service_->stats().lock);
 
     *_aidl_return = impl_->IsImageMapped(name);
     return binder::Status::ok();
@@ -618,36 +1326,17 @@ binder::Status ImageService::isImageMapped(const std::string& name, bool* _aidl_
 
 binder::Status ImageService::getAvbPublicKey(const std::string& name, AvbPublicKey* dst,
                                              int32_t* _aidl_return) {
+    service_->stats().RecordBinderCall(__func__, "IImageService::");
     if (!CheckUid()) return UidSecurityError();
 
-    std::lock_guard<std::mutex> guard(service_->lock());
+    TimedLockGuard guard(service_->lock(), &service_->stats().lock);
 
-    std::string device_path;
-    std::unique_ptr<MappedDevice> mapped_device;
-    if (!impl_->IsImageMapped(name)) {
-        mapped_device = MappedDevice::Open(impl_.get(), 10s, name);
-        if (!mapped_device) {
-            PLOG(ERROR) << "Fail to map image: " << name;
-            *_aidl_return = IMAGE_ERROR;
-            return binder::Status::ok();
-        }
-        device_path = mapped_device->path();
-    } else {
-        if (!impl_->GetMappedImageDevice(name, &device_path)) {
-            PLOG(ERROR) << "GetMappedImageDevice() failed";
-            *_aidl_return = IMAGE_ERROR;
-            return binder::Status::ok();
-        }
-    }
-    android::base::unique_fd fd(open(device_path.c_str(), O_RDONLY | O_CLOEXEC));
-    if (!fd.ok()) {
-        PLOG(ERROR) << "Fail to open mapped device: " << device_path;
+    ImageSource source;
+    if (!OpenImageSource(name, &source)) {
         *_aidl_return = IMAGE_ERROR;
         return binder::Status::ok();
     }
-    bool ok = GetAvbPublicKeyFromFd(fd.get(), dst);
-    fd = {};
-    if (!ok) {
+    if (!GetAvbPublicKey(source.size(), source.read_at(), dst)) {
         LOG(ERROR) << "Failed to extract AVB public key";
         *_aidl_return = IMAGE_ERROR;
         return binder::Status::ok();
@@ -656,10 +1345,78 @@ binder::Status ImageService::getAvbPublicKey(const std::string& name, AvbPublicK
     return binder::Status::ok();
 }
 
+binder::Status ImageService::getAvbInfo(const std::vector<std::string>& names,
+                                        std::vector<AvbInfo>* _aidl_return) {
+    service_->stats().RecordBinderCall(__func__, "IImageService::");
+    if (!CheckUid()) return UidSecurityError();
+
+    TimedLockGuard guard(service_->lock(), &service_->stats().lock);
+
+    // Opening (and possibly mapping) images goes through ImageManager, so it
+    // is done serially. Reading and hashing each image is independent, and
+    // is done in parallel a few images at a time, so that only that many
+    // are ever mapped at once.
+    size_t batch = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, kMaxAvbInfoThreads);
+    std::vector<AvbInfo> results(names.size());
+    for (size_t begin = 0; begin < names.size(); begin += batch) {
+        size_t end = std::min(names.size(), begin + batch);
+        std::vector<ImageSource> sources(end - begin);
+        for (size_t i = begin; i < end; i++) {
+            results[i].name = names[i];
+            bool ok = OpenImageSource(names[i], &sources[i - begin]);
+            results[i].status = ok ? IMAGE_OK : IMAGE_ERROR;
+        }
+        auto read = [&](size_t i) -> void {
+            auto& source = sources[i - begin];
+            if (results[i].status == IMAGE_OK &&
+                !GetAvbInfo(source.size(), source.read_at(), &results[i])) {
+                LOG(ERROR) << "Failed to extract AVB info from " << names[i];
+                results[i].status = IMAGE_ERROR;
+            }
+        };
+        std::vector<std::thread> threads;
+        for (size_t i = begin + 1; i < end; i++) {
+            threads.emplace_back(read, i);
+        }
+        read(begin);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+    *_aidl_return = std::move(results);
+    return binder::Status::ok();
+}
+
+bool ImageService::OpenImageSource(const std::string& name, ImageSource* source) {
+    if (impl_->IsImageMapped(name)) {
+        std::string device_path;
+        if (!impl_->GetMappedImageDevice(name, &device_path)) {
+            PLOG(ERROR) << "GetMappedImageDevice() failed";
+            return false;
+        }
+        return source->OpenDevice(device_path);
+    }
+    // Read straight from the image's extents if possible, which avoids
+    // creating a device-mapper device.
+    if (impl_->BackingImageExists(name)) {
+        source->reader = ImageExtentReader::Open(metadata_dir_, name);
+        if (source->reader) {
+            return true;
+        }
+    }
+    source->mapped_device = MappedDevice::Open(impl_.get(), 10s, name);
+    if (!source->mapped_device) {
+        PLOG(ERROR) << "Fail to map image: " << name;
+        return false;
+    }
+    return source->OpenDevice(source->mapped_device->path());
+}
+
 binder::Status ImageService::zeroFillNewImage(const std::string& name, int64_t bytes) {
+    service_->stats().RecordBinderCall(__func__, "IImageService::");
     if (!CheckUid()) return UidSecurityError();
 
-    std::lock_guard<std::mutex> guard(service_->lock());
+    TimedLockGuard guard(service_->lock(), &service_->stats().lock);
 
     if (bytes < 0) {
         return BinderError("Cannot use negative values");
@@ -672,9 +1429,10 @@ binder::Status ImageService::zeroFillNewImage(const std::string& name, int64_t b
 }
 
 binder::Status ImageService::removeAllImages() {
+    service_->stats().RecordBinderCall(__func__, "IImageService::");
     if (!CheckUid()) return UidSecurityError();
 
-    std::lock_guard<std::mutex> guard(service_->lock());
+    TimedLockGuard guard(service_->lock(), &service_->stats().lock);
     if (!impl_->RemoveAllImages()) {
         return BinderError("Failed to remove all images");
     }
@@ -682,9 +1440,10 @@ binder::Status ImageService::removeAllImages() {
 }
 
 binder::Status ImageService::removeDisabledImages() {
+    service_->stats().RecordBinderCall(__func__, "IImageService::");
     if (!CheckUid()) return UidSecurityError();
 
-    std::lock_guard<std::mutex> guard(service_->lock());
+    TimedLockGuard guard(service_->lock(), &service_->stats().lock);
     if (!impl_->RemoveDisabledImages()) {
         return BinderError("Failed to remove disabled images");
     }
@@ -692,9 +1451,10 @@ binder::Status ImageService::removeDisabledImages() {
 }
 
 binder::Status ImageService::getMappedImageDevice(const std::string& name, std::string* device) {
+    service_->stats().RecordBinderCall(__func__, "IImageService::");
     if (!CheckUid()) return UidSecurityError();
 
-    std::lock_guard<std::mutex> guard(service_->lock());
+    TimedLockGuard guard(service_->lock(), &service_->stats().lock);
     if (!impl_->GetMappedImageDevice(name, device)) {
         *device = "";
     }
@@ -707,6 +1467,7 @@ bool ImageService::CheckUid() {
 
 binder::Status GsiService::openImageService(const std::string& prefix,
                                             android::sp<IImageService>* _aidl_return) {
+    stats_.RecordBinderCall(__func__);
     static constexpr char kImageMetadataPrefix[] = "/metadata/gsi/";
     static constexpr char kImageDataPrefix[] = "/data/gsi/";
 
@@ -743,7 +1504,7 @@ binder::Status GsiService::openImageService(const std::string& prefix,
         return BinderError("Unknown error");
     }
 
-    *_aidl_return = new ImageService(this, std::move(impl), uid);
+    *_aidl_return = new ImageService(this, std::move(impl), metadata_dir, uid);
     return binder::Status::ok();
 }
 
@@ -832,9 +1593,12 @@ std::string GsiService::GetActiveDsuSlot() {
 }
 
 std::string GsiService::GetActiveInstalledImageDir() {
-    // Just in case an install was left hanging.
+    // Just in case an install was left hanging, possibly before any of its
+    // partitions were created.
     if (installer_) {
         return installer_->install_dir();
+    } else if (!install_dir_.empty()) {
+        return install_dir_;
     } else {
         return GetInstalledImageDir();
     }
@@ -879,26 +1643,22 @@ int GsiService::ReenableGsi(bool one_shot) {
 }
 
 bool GsiService::RemoveGsiFiles(const std::string& install_dir) {
-    bool ok = true;
-    auto active_dsu = GetDsuSlot(install_dir);
-    if (auto manager = ImageManager::Open(MetadataDir(active_dsu), install_dir)) {
-        std::vector<std::string> images = manager->GetAllBackingImages();
-        for (auto&& image : images) {
-            if (!android::base::EndsWith(image, kDsuPostfix)) {
-                continue;
-            }
-            if (manager->IsImageMapped(image)) {
-                ok &= manager->UnmapImageDevice(image);
-            }
-            ok &= manager->DeleteBackingImage(image);
-        }
-    }
+    GSI_TRACE_CALL();
+    // The images themselves are deleted later, by a reaper; see
+    // slot_reaper.h.
     auto dsu_slot = GetDsuSlot(install_dir);
+    if (!MarkSlotDeleted(dsu_slot, install_dir)) {
+        return false;
+    }
+    bool ok = true;
     std::vector<std::string> files{
             kDsuInstallStatusFile,
             kDsuOneShotBootFile,
             DsuInstallDirFile(dsu_slot),
             GetCompleteIndication(dsu_slot),
+            DsuInstallReportFile(dsu_slot),
+            DsuUserdataSnapshotFile(dsu_slot),
+            DsuUserdataMaxSizeFile(dsu_slot),
     };
     for (const auto& file : files) {
         std::string message;
@@ -980,7 +1740,39 @@ void GsiService::CleanCorruptedInstallation() {
 
 void GsiService::RunStartupTasks() {
     CleanCorruptedInstallation();
+    UpdateInstallStatus();
+
+    // Delete the images of slots removed above, or before the last reboot.
+    // This runs in the background of boot, so it can take its time.
+    ServiceStats stats;
+    ReapDeletedSlots(&stats);
+}
 
+void GsiService::StartReaper() {
+    std::lock_guard<std::mutex> guard(reaper_lock_);
+    reaper_requested_ = true;
+    if (reaper_running_) {
+        return;
+    }
+    reaper_running_ = true;
+    // gsid is a lazy service; keep it running until the work is done.
+    LazyServiceRegistrar::getInstance().forcePersist(true);
+    std::thread([self = sp<GsiService>(this)]() -> void { self->RunReaper(); }).detach();
+}
+
+void GsiService::RunReaper() {
+    std::unique_lock<std::mutex> guard(reaper_lock_);
+    while (reaper_requested_) {
+        reaper_requested_ = false;
+        guard.unlock();
+        ReapDeletedSlots(&stats_);
+        guard.lock();
+    }
+    reaper_running_ = false;
+    LazyServiceRegistrar::getInstance().forcePersist(false);
+}
+
+void GsiService::UpdateInstallStatus() {
     std::string active_dsu;
     if (!GetActiveDsu(&active_dsu)) {
         PLOG(INFO) << "no DSU";
@@ -996,6 +1788,10 @@ void GsiService::RunStartupTasks() {
         // Check if a wipe was requested from fastboot or adb-in-gsi.
         if (boot_key == kInstallStatusWipe) {
             RemoveGsiFiles(GetInstalledImageDir());
+        } else {
+            // The GSI's userdata is not in use, so this is when thin userdata
+            // can grow.
+            PartitionInstaller::GrowThinUserdata(active_dsu, GetInstalledImageDir());
         }
     } else {
         // NB: When single-boot is enabled, init will write "disabled" into the
@@ -1011,45 +1807,43 @@ void GsiService::RunStartupTasks() {
     }
 }
 
+static void MovePublicKey(AvbImageInfo* info, AvbPublicKey* dst) {
+    dst->bytes = std::move(info->public_key);
+    dst->sha1 = std::move(info->public_key_sha1);
+    dst->sha256 = std::move(info->public_key_sha256);
+}
+
 static bool GetAvbPublicKeyFromFd(int fd, AvbPublicKey* dst) {
-    // Read the AVB footer from EOF.
-    int64_t total_size = get_block_device_size(fd);
-    int64_t footer_offset = total_size - AVB_FOOTER_SIZE;
-    std::array<uint8_t, AVB_FOOTER_SIZE> footer_bytes;
-    if (!ReadFullyAtOffset(fd, footer_bytes.data(), AVB_FOOTER_SIZE, footer_offset)) {
-        PLOG(ERROR) << "cannot read AVB footer";
-        return false;
-    }
-    // Validate the AVB footer data and byte swap to native byte order.
-    AvbFooter footer;
-    if (!avb_footer_validate_and_byteswap((const AvbFooter*)footer_bytes.data(), &footer)) {
-        LOG(ERROR) << "invalid AVB footer";
+    GSI_TRACE_CALL();
+    AvbImageInfo info;
+    if (!ReadAvbImageInfoFromFd(fd, &info)) {
         return false;
     }
-    // Read the VBMeta image.
-    std::vector<uint8_t> vbmeta_bytes(footer.vbmeta_size);
-    if (!ReadFullyAtOffset(fd, vbmeta_bytes.data(), vbmeta_bytes.size(), footer.vbmeta_offset)) {
-        PLOG(ERROR) << "cannot read VBMeta image";
+    MovePublicKey(&info, dst);
+    return true;
+}
+
+static bool GetAvbInfo(uint64_t total_size, const ReadAtOffsetFn& read_at, AvbInfo* dst) {
+    AvbImageInfo info;
+    if (!ReadAvbImageInfo(total_size, read_at, &info)) {
         return false;
     }
-    // Validate the VBMeta image and retrieve AVB public key.
-    // After a successful call to avb_vbmeta_image_verify(), public_key_data
-    // will point to the serialized AVB public key, in the same format generated
-    // by the `avbtool extract_public_key` command.
-    const uint8_t* public_key_data;
-    size_t public_key_size;
-    AvbVBMetaVerifyResult result = avb_vbmeta_image_verify(vbmeta_bytes.data(), vbmeta_bytes.size(),
-                                                           &public_key_data, &public_key_size);
-    if (result != AVB_VBMETA_VERIFY_RESULT_OK) {
-        LOG(ERROR) << "invalid VBMeta image: " << avb_vbmeta_verify_result_to_string(result);
+    dst->publicKey = std::move(info.public_key);
+    dst->publicKeySha1 = std::move(info.public_key_sha1);
+    dst->publicKeySha256 = std::move(info.public_key_sha256);
+    dst->vbmetaSha256 = std::move(info.vbmeta_sha256);
+    dst->rollbackIndex = info.rollback_index;
+    dst->algorithmType = info.algorithm_type;
+    dst->flags = info.flags;
+    return true;
+}
+
+static bool GetAvbPublicKey(uint64_t total_size, const ReadAtOffsetFn& read_at, AvbPublicKey* dst) {
+    AvbImageInfo info;
+    if (!ReadAvbImageInfo(total_size, read_at, &info)) {
         return false;
     }
-    if (public_key_data != nullptr) {
-        dst->bytes.resize(public_key_size);
-        memcpy(dst->bytes.data(), public_key_data, public_key_size);
-        dst->sha1.resize(SHA_DIGEST_LENGTH);
-        SHA1(public_key_data, public_key_size, dst->sha1.data());
-    }
+    MovePublicKey(&info, dst);
     return true;
 }
 
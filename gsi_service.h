@@ -15,6 +15,7 @@
  */
 #pragma once
 
+#include <atomic>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -30,6 +31,7 @@
 #include "libgsi/libgsi.h"
 
 #include "partition_installer.h"
+#include "service_stats.h"
 
 namespace android {
 namespace gsi {
@@ -42,13 +44,30 @@ class GsiService : public BinderService<GsiService>, public BnGsiService {
     binder::Status closeInstall(int32_t* _aidl_return) override;
     binder::Status createPartition(const ::std::string& name, int64_t size, bool readOnly,
                                    int32_t* _aidl_return) override;
+    binder::Status createPartitionWithDigest(const ::std::string& name, int64_t size,
+                                             const ::std::string& digest,
+                                             int32_t* _aidl_return) override;
+    binder::Status createPartitions(const std::vector<PartitionSpec>& partitions,
+                                    int32_t* _aidl_return) override;
+    binder::Status planInstall(const std::string& installDir,
+                               const std::vector<PartitionSpec>& partitions, InstallPlan* plan,
+                               int32_t* _aidl_return) override;
+    binder::Status reserveImagePool(int64_t size, int32_t* _aidl_return) override;
+    binder::Status setInstallQos(int32_t qos, int32_t* _aidl_return) override;
     binder::Status commitGsiChunkFromStream(const ::android::os::ParcelFileDescriptor& stream,
                                             int64_t bytes, bool* _aidl_return) override;
+    binder::Status getPartitionBlockHashes(int32_t blockSize,
+                                           const ::android::os::ParcelFileDescriptor& output,
+                                           int32_t* _aidl_return) override;
+    binder::Status commitGsiPatchFromStream(const ::android::os::ParcelFileDescriptor& stream,
+                                            int64_t bytes, int64_t* _aidl_return) override;
     binder::Status getInstallProgress(::android::gsi::GsiProgress* _aidl_return) override;
     binder::Status setGsiAshmem(const ::android::os::ParcelFileDescriptor& ashmem, int64_t size,
                                 bool* _aidl_return) override;
     binder::Status commitGsiChunkFromAshmem(int64_t bytes, bool* _aidl_return) override;
     binder::Status cancelGsiInstall(bool* _aidl_return) override;
+    binder::Status pauseInstall(int32_t* _aidl_return) override;
+    binder::Status resumeInstall(int32_t* _aidl_return) override;
     binder::Status enableGsi(bool oneShot, const std::string& dsuSlot, int* _aidl_return) override;
     binder::Status enableGsiAsync(bool oneShot, const ::std::string& dsuSlot,
                                   const sp<IGsiServiceCallback>& resultCallback) override;
@@ -63,10 +82,21 @@ class GsiService : public BinderService<GsiService>, public BnGsiService {
     binder::Status getActiveDsuSlot(std::string* _aidl_return) override;
     binder::Status getInstalledDsuSlots(std::vector<std::string>* _aidl_return) override;
     binder::Status zeroPartition(const std::string& name, int* _aidl_return) override;
+    binder::Status resizePartition(const std::string& name, int64_t newSize,
+                                   int* _aidl_return) override;
+    binder::Status createUserdataSnapshot(int64_t cowSize, int* _aidl_return) override;
+    binder::Status resetUserdataSnapshot(int* _aidl_return) override;
+    binder::Status removeUserdataSnapshot(int* _aidl_return) override;
     binder::Status openImageService(const std::string& prefix,
                                     android::sp<IImageService>* _aidl_return) override;
     binder::Status dumpDeviceMapperDevices(std::string* _aidl_return) override;
+    binder::Status dumpDeviceMapperDevicesToFd(
+            const std::string& prefix, const ::android::os::ParcelFileDescriptor& output) override;
     binder::Status getAvbPublicKey(AvbPublicKey* dst, int32_t* _aidl_return) override;
+    binder::Status getInstallReport(const std::string& dsuSlot,
+                                    std::vector<InstallPhase>* _aidl_return) override;
+
+    status_t dump(int fd, const Vector<String16>& args) override;
 
     // This is in GsiService, rather than GsiInstaller, since we need to access
     // it outside of the main lock which protects the unique_ptr.
@@ -76,8 +106,13 @@ class GsiService : public BinderService<GsiService>, public BnGsiService {
     // Helper methods for GsiInstaller.
     static bool RemoveGsiFiles(const std::string& install_dir);
     bool should_abort() const { return should_abort_; }
+    bool pause_requested() const { return pause_requested_; }
+    bool previous_install_complete() const { return previous_install_complete_; }
+    ServiceStats& stats() { return stats_; }
 
     static void RunStartupTasks();
+    // Delete the images of removed slots on a background thread.
+    void StartReaper();
     static std::string GetInstalledImageDir();
     std::string GetActiveDsuSlot();
     std::string GetActiveInstalledImageDir();
@@ -89,9 +124,14 @@ class GsiService : public BinderService<GsiService>, public BnGsiService {
 
     GsiService();
     static int ValidateInstallParams(std::string& install_dir);
+    // An empty |digest| installs without sharing; see createPartitionWithDigest().
+    int CreatePartition(const std::string& name, int64_t size, bool readOnly,
+                        const std::string& digest);
     bool DisableGsiInstall();
     int ReenableGsi(bool one_shot);
     static void CleanCorruptedInstallation();
+    static void UpdateInstallStatus();
+    void RunReaper();
     static int SaveInstallation(const std::string&);
     static bool IsInstallationComplete(const std::string&);
     static std::string GetCompleteIndication(const std::string&);
@@ -104,15 +144,33 @@ class GsiService : public BinderService<GsiService>, public BnGsiService {
     static android::wp<GsiService> sInstance;
 
     std::string install_dir_ = {};
+    InstallQos install_qos_ = InstallQos::kForeground;
+    // Whether the slot held a complete install when openInstall() was
+    // called, so that its images can serve as the base of a delta patch.
+    bool previous_install_complete_ = false;
     std::unique_ptr<PartitionInstaller> installer_;
+    // Read-only partitions allocated by createPartitions(), waiting to be
+    // selected by createPartition().
+    std::vector<std::unique_ptr<PartitionInstaller>> pending_installers_;
     std::mutex lock_;
     std::mutex& lock() { return lock_; }
     // These are initialized or set in StartInstall().
     std::atomic<bool> should_abort_ = false;
+    // Set by pauseInstall() to interrupt a commit in progress.
+    std::atomic<bool> pause_requested_ = false;
+
+    // Set by StartReaper() while the reaper thread runs, and when it should
+    // make another pass.
+    std::mutex reaper_lock_;
+    bool reaper_running_ = false;
+    bool reaper_requested_ = false;
 
     // Progress bar state.
     std::mutex progress_lock_;
     GsiProgress progress_;
+
+    // Performance counters, reported by dump().
+    ServiceStats stats_;
 };
 
 }  // namespace gsi
@@ -14,31 +14,45 @@
 // limitations under the License.
 //
 
+#include <ctype.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <signal.h>
 #include <stdio.h>
+#include <sys/mman.h>
 #include <sysexits.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <chrono>
 #include <condition_variable>
 #include <functional>
 #include <iostream>
 #include <map>
 #include <mutex>
+#include <random>
 #include <string>
 #include <thread>
+#include <vector>
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/parseint.h>
 #include <android-base/properties.h>
+#include <android-base/scopeguard.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <android/gsi/IGsiService.h>
 #include <binder/IServiceManager.h>
 #include <cutils/android_reboot.h>
+#include <cutils/ashmem.h>
 #include <libgsi/libgsi.h>
 #include <libgsi/libgsid.h>
+#include <openssl/sha.h>
+
+#include "block_hashes.h"
+#include "delta_patch.h"
 
 using namespace android::gsi;
 using namespace std::chrono_literals;
@@ -51,20 +65,34 @@ using CommandCallback = std::function<int(sp<IGsiService>, int, char**)>;
 static int Disable(sp<IGsiService> gsid, int argc, char** argv);
 static int Enable(sp<IGsiService> gsid, int argc, char** argv);
 static int Install(sp<IGsiService> gsid, int argc, char** argv);
+static int Bench(sp<IGsiService> gsid, int argc, char** argv);
 static int Wipe(sp<IGsiService> gsid, int argc, char** argv);
 static int WipeData(sp<IGsiService> gsid, int argc, char** argv);
+static int SnapshotData(sp<IGsiService> gsid, int argc, char** argv);
+static int ResetData(sp<IGsiService> gsid, int argc, char** argv);
+static int Resize(sp<IGsiService> gsid, int argc, char** argv);
+static int Reserve(sp<IGsiService> gsid, int argc, char** argv);
 static int Status(sp<IGsiService> gsid, int argc, char** argv);
 static int Cancel(sp<IGsiService> gsid, int argc, char** argv);
+static int Pause(sp<IGsiService> gsid, int argc, char** argv);
+static int Resume(sp<IGsiService> gsid, int argc, char** argv);
 
 static const std::map<std::string, CommandCallback> kCommandMap = {
         // clang-format off
         {"disable", Disable},
         {"enable", Enable},
         {"install", Install},
+        {"bench", Bench},
         {"wipe", Wipe},
         {"wipe-data", WipeData},
+        {"snapshot-data", SnapshotData},
+        {"reset-data", ResetData},
+        {"resize", Resize},
+        {"reserve", Reserve},
         {"status", Status},
         {"cancel", Cancel},
+        {"pause", Pause},
+        {"resume", Resume},
         // clang-format on
 };
 
@@ -76,6 +104,20 @@ static std::string ErrorMessage(const android::binder::Status& status,
     return "error code " + std::to_string(error_code);
 }
 
+static bool ParseInstallQos(const std::string& arg, int* qos) {
+    if (arg == "foreground") {
+        *qos = IGsiService::INSTALL_QOS_FOREGROUND;
+    } else if (arg == "background") {
+        *qos = IGsiService::INSTALL_QOS_BACKGROUND;
+    } else if (arg == "idle") {
+        *qos = IGsiService::INSTALL_QOS_IDLE;
+    } else {
+        std::cerr << "QoS must be foreground, background or idle: " << arg << std::endl;
+        return false;
+    }
+    return true;
+}
+
 class ProgressBar {
   public:
     explicit ProgressBar(sp<IGsiService> gsid) : gsid_(gsid) {}
@@ -190,6 +232,188 @@ class ProgressBar {
     bool done_ = false;
 };
 
+// If the install was paused, wait until it is resumed and return true, with
+// the number of bytes already committed in |bytes_committed|.
+static bool WaitWhilePaused(sp<IGsiService> gsid, int64_t* bytes_committed) {
+    GsiProgress progress;
+    if (!gsid->getInstallProgress(&progress).isOk() ||
+        progress.status != IGsiService::STATUS_PAUSED) {
+        return false;
+    }
+    std::cerr << "\nInstall paused; waiting for it to be resumed." << std::endl;
+    while (progress.status == IGsiService::STATUS_PAUSED) {
+        std::this_thread::sleep_for(1s);
+        if (!gsid->getInstallProgress(&progress).isOk()) {
+            return false;
+        }
+    }
+    // A cancelled install has no progress.
+    if (progress.status == IGsiService::STATUS_NO_OPERATION) {
+        return false;
+    }
+    *bytes_committed = progress.bytes_processed;
+    return true;
+}
+
+// Block size of the manifest used by "install --incremental". A 4GiB image
+// has a 2MiB manifest.
+static constexpr uint32_t kIncrementalBlockSize = 64 * 1024;
+// The image is patched in segments of this size, each one a single patch.
+static constexpr uint64_t kIncrementalSegmentSize = 64 * 1024 * 1024;
+
+// Reads the block hash manifest of the partition being installed.
+static bool ReadBlockHashes(sp<IGsiService> gsid, std::string* hashes) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC)) {
+        std::cerr << "pipe: " << strerror(errno) << std::endl;
+        return false;
+    }
+    android::base::unique_fd read_end(fds[0]), write_end(fds[1]);
+    bool read_ok = false;
+    std::thread reader([&]() -> void {
+        read_ok = android::base::ReadFdToString(read_end, hashes);
+    });
+
+    int error = IGsiService::INSTALL_ERROR_GENERIC;
+    android::binder::Status status;
+    {
+        // The reader sees EOF once both this and gsid's copy are closed.
+        android::os::ParcelFileDescriptor output(std::move(write_end));
+        status = gsid->getPartitionBlockHashes(kIncrementalBlockSize, output, &error);
+    }
+    reader.join();
+    if (!status.isOk() || error != IGsiService::INSTALL_OK) {
+        std::cerr << "Could not hash the previous image: " << ErrorMessage(status, error) << "\n";
+        return false;
+    }
+    return read_ok;
+}
+
+// Commits one patch through a pipe, picking up where it left off if the
+// install is paused and resumed.
+static bool CommitPatch(sp<IGsiService> gsid, const std::string& patch) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC)) {
+        std::cerr << "pipe: " << strerror(errno) << std::endl;
+        return false;
+    }
+    android::base::unique_fd read_end(fds[0]), write_end(fds[1]);
+    std::thread producer([&]() -> void {
+        android::base::WriteFully(write_end, patch.data(), patch.size());
+        write_end.reset();
+    });
+
+    bool ok = false;
+    {
+        android::os::ParcelFileDescriptor stream(std::move(read_end));
+        int64_t size = patch.size();
+        int64_t consumed = 0;
+        int64_t ignored;
+        do {
+            int64_t rv = 0;
+            auto status = gsid->commitGsiPatchFromStream(stream, size - consumed, &rv);
+            if (!status.isOk() || rv < 0) {
+                std::cerr << "Could not commit patch: " << ErrorMessage(status) << "\n";
+                break;
+            }
+            consumed += rv;
+            ok = consumed == size;
+        } while (!ok && WaitWhilePaused(gsid, &ignored));
+    }
+    // Closing the read end unblocks the producer if the commit failed part way.
+    producer.join();
+    return ok;
+}
+
+// Reads an image of |size| bytes from |input| and writes it as a delta
+// patch against the previous install, sending only the blocks whose hash
+// differs from the manifest.
+static bool CommitIncremental(sp<IGsiService> gsid, int input, int64_t size) {
+    std::string hashes;
+    if (!ReadBlockHashes(gsid, &hashes)) {
+        return false;
+    }
+
+    uint64_t changed = 0;
+    std::vector<uint8_t> segment(kIncrementalSegmentSize);
+    for (uint64_t offset = 0; offset < static_cast<uint64_t>(size);
+         offset += kIncrementalSegmentSize) {
+        uint64_t segment_size = std::min(kIncrementalSegmentSize, size - offset);
+        if (!android::base::ReadFully(input, segment.data(), segment_size)) {
+            std::cerr << "read image: " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        // Runs of unchanged blocks become a single in-place copy, and runs
+        // of changed blocks a single data operation.
+        std::string patch;
+        DeltaPatchApplier::DeltaOpHeader op = {};
+        auto flush_op = [&](uint64_t end) -> void {
+            if (!op.length) {
+                return;
+            }
+            patch.append(reinterpret_cast<const char*>(&op), sizeof(op));
+            if (op.type == DeltaPatchApplier::kData) {
+                patch.append(reinterpret_cast<const char*>(segment.data()) + end - op.length,
+                             op.length);
+            }
+            op = {};
+        };
+        for (uint64_t pos = 0; pos < segment_size; pos += kIncrementalBlockSize) {
+            uint64_t block_size = std::min<uint64_t>(kIncrementalBlockSize, segment_size - pos);
+            uint64_t index = (offset + pos) / kIncrementalBlockSize;
+            uint8_t digest[SHA256_DIGEST_LENGTH];
+            SHA256(segment.data() + pos, block_size, digest);
+            bool same = (index + 1) * kBlockHashSize <= hashes.size() &&
+                        !memcmp(hashes.data() + index * kBlockHashSize, digest, sizeof(digest));
+            uint32_t type = same ? DeltaPatchApplier::kCopy : DeltaPatchApplier::kData;
+            if (op.length && op.type != type) {
+                flush_op(pos);
+            }
+            if (!op.length) {
+                op.type = type;
+                op.source_offset = same ? offset + pos : 0;
+            }
+            op.length += block_size;
+            if (!same) {
+                changed += block_size;
+            }
+        }
+        flush_op(segment_size);
+
+        if (!CommitPatch(gsid, patch)) {
+            return false;
+        }
+    }
+    std::cout << "\n" << changed << " of " << size << " bytes changed" << std::endl;
+    return true;
+}
+
+// Report whether an install of |partitions| would fit, without starting it.
+static int PlanInstall(sp<IGsiService> gsid, const std::string& installDir,
+                       const std::vector<PartitionSpec>& partitions) {
+    InstallPlan plan;
+    int error;
+    auto status = gsid->planInstall(installDir, partitions, &plan, &error);
+    if (!status.isOk() || error == IGsiService::INSTALL_ERROR_GENERIC) {
+        std::cerr << "Could not plan the install: " << ErrorMessage(status, error) << "\n";
+        return EX_SOFTWARE;
+    }
+    std::cout << "required: " << plan.requiredBytes << " bytes\n"
+              << "free: " << plan.freeBytes << " of " << plan.totalBytes << " bytes\n"
+              << "replaced: " << plan.replacedBytes << " bytes\n"
+              << "image pool: " << plan.poolBytes << " bytes\n"
+              << "reclaimable: " << plan.reclaimableBytes << " bytes\n"
+              << "headroom: " << plan.headroomBytes << " bytes\n";
+    if (error) {
+        std::cout << "The install does not fit: " << ErrorMessage(status, error) << "\n";
+        return EX_SOFTWARE;
+    }
+    std::cout << "The install fits"
+              << (plan.needsReclaim ? " once disabled images are removed" : "") << ".\n";
+    return 0;
+}
+
 static int Install(sp<IGsiService> gsid, int argc, char** argv) {
     constexpr const char* kDefaultPartition = "system";
     struct option options[] = {
@@ -197,15 +421,27 @@ static int Install(sp<IGsiService> gsid, int argc, char** argv) {
             {"gsi-size", required_argument, nullptr, 's'},
             {"no-reboot", no_argument, nullptr, 'n'},
             {"userdata-size", required_argument, nullptr, 'u'},
+            {"userdata-max-size", required_argument, nullptr, 'm'},
             {"partition-name", required_argument, nullptr, 'p'},
             {"wipe", no_argument, nullptr, 'w'},
+            {"qos", required_argument, nullptr, 'q'},
+            {"patch-size", required_argument, nullptr, 'P'},
+            {"incremental", no_argument, nullptr, 'I'},
+            {"digest", required_argument, nullptr, 'D'},
+            {"dry-run", no_argument, nullptr, 'd'},
             {nullptr, 0, nullptr, 0},
     };
 
     int64_t gsiSize = 0;
+    int64_t patchSize = 0;
+    bool incremental = false;
+    std::string digest;
     int64_t userdataSize = 0;
+    int64_t userdataMaxSize = 0;
     bool wipeUserdata = false;
+    bool dryRun = false;
     bool reboot = true;
+    int qos = IGsiService::INSTALL_QOS_FOREGROUND;
     std::string installDir = "";
     std::string partition = kDefaultPartition;
     if (getuid() != 0) {
@@ -231,6 +467,12 @@ static int Install(sp<IGsiService> gsid, int argc, char** argv) {
                     return EX_USAGE;
                 }
                 break;
+            case 'm':
+                if (!android::base::ParseInt(optarg, &userdataMaxSize) || userdataMaxSize <= 0) {
+                    std::cerr << "Could not parse image size: " << optarg << std::endl;
+                    return EX_USAGE;
+                }
+                break;
             case 'i':
                 installDir = optarg;
                 break;
@@ -240,6 +482,31 @@ static int Install(sp<IGsiService> gsid, int argc, char** argv) {
             case 'n':
                 reboot = false;
                 break;
+            case 'q':
+                if (!ParseInstallQos(optarg, &qos)) {
+                    return EX_USAGE;
+                }
+                break;
+            case 'P':
+                if (!android::base::ParseInt(optarg, &patchSize) || patchSize <= 0) {
+                    std::cerr << "Could not parse patch size: " << optarg << std::endl;
+                    return EX_USAGE;
+                }
+                break;
+            case 'I':
+                incremental = true;
+                break;
+            case 'D':
+                digest = optarg;
+                std::transform(digest.begin(), digest.end(), digest.begin(), ::tolower);
+                if (!IsValidImageDigest(digest)) {
+                    std::cerr << "Could not parse SHA-256 digest: " << optarg << std::endl;
+                    return EX_USAGE;
+                }
+                break;
+            case 'd':
+                dryRun = true;
+                break;
         }
     }
 
@@ -247,6 +514,10 @@ static int Install(sp<IGsiService> gsid, int argc, char** argv) {
         std::cerr << "Must specify --gsi-size." << std::endl;
         return EX_USAGE;
     }
+    if (patchSize && incremental) {
+        std::cerr << "--patch-size and --incremental cannot be combined." << std::endl;
+        return EX_USAGE;
+    }
 
     bool running_gsi = false;
     gsid->isGsiRunning(&running_gsi);
@@ -256,6 +527,29 @@ static int Install(sp<IGsiService> gsid, int argc, char** argv) {
         return EX_SOFTWARE;
     }
 
+    // Allocate userdata and the image together; the image is created last
+    // so that it is the partition being written.
+    std::vector<PartitionSpec> partitions;
+    auto add_partition = [&](const std::string& name, int64_t size, bool read_only) -> void {
+        auto& spec = partitions.emplace_back();
+        spec.name = name;
+        spec.size = size;
+        spec.readOnly = read_only;
+    };
+    if (partition == kDefaultPartition) {
+        add_partition("userdata", userdataSize, false);
+        partitions.back().maxSize = userdataMaxSize;
+    }
+    // With a digest, the image may already be shared by another slot, in
+    // which case it is not allocated at all.
+    if (digest.empty() || dryRun) {
+        add_partition(partition, gsiSize, true);
+    }
+    int error;
+    if (dryRun) {
+        return PlanInstall(gsid, installDir, partitions);
+    }
+
     android::base::unique_fd input(dup(1));
     if (input < 0) {
         std::cerr << "Error duplicating descriptor: " << strerror(errno) << std::endl;
@@ -264,23 +558,24 @@ static int Install(sp<IGsiService> gsid, int argc, char** argv) {
     // Note: the progress bar needs to be re-started in between each call.
     ProgressBar progress(gsid);
     progress.Display();
-    int error;
     auto status = gsid->openInstall(installDir, &error);
     if (!status.isOk() || error != IGsiService::INSTALL_OK) {
         std::cerr << "Could not open DSU installation: " << ErrorMessage(status, error) << "\n";
         return EX_SOFTWARE;
     }
-    if (partition == kDefaultPartition) {
-        auto status = gsid->createPartition("userdata", userdataSize, false, &error);
-        if (!status.isOk() || error != IGsiService::INSTALL_OK) {
-            std::cerr << "Could not start live image install: " << ErrorMessage(status, error)
-                      << "\n";
-            return EX_SOFTWARE;
-        }
-    }
-
-    status = gsid->createPartition(partition, gsiSize, true, &error);
+    status = gsid->setInstallQos(qos, &error);
     if (!status.isOk() || error != IGsiService::INSTALL_OK) {
+        std::cerr << "Could not set install QoS: " << ErrorMessage(status, error) << "\n";
+        return EX_SOFTWARE;
+    }
+    if (!partitions.empty()) {
+        status = gsid->createPartitions(partitions, &error);
+    }
+    if (!digest.empty() && status.isOk() && error == IGsiService::INSTALL_OK) {
+        status = gsid->createPartitionWithDigest(partition, gsiSize, digest, &error);
+    }
+    bool shared = error == IGsiService::INSTALL_SHARED;
+    if (!status.isOk() || (error != IGsiService::INSTALL_OK && !shared)) {
         std::cerr << "Could not start live image install: " << ErrorMessage(status, error) << "\n";
         return EX_SOFTWARE;
     }
@@ -288,7 +583,30 @@ static int Install(sp<IGsiService> gsid, int argc, char** argv) {
 
     bool ok = false;
     progress.Display();
-    status = gsid->commitGsiChunkFromStream(stream, gsiSize, &ok);
+    int64_t committed = 0;
+    if (shared) {
+        std::cout << "Image is shared with another slot; nothing to write." << std::endl;
+        ok = true;
+    } else if (incremental) {
+        ok = CommitIncremental(gsid, stream.get(), gsiSize);
+    } else if (patchSize) {
+        // The patch is consumed exactly up to where it stopped, so after a
+        // pause the rest of it is committed.
+        int64_t consumed = 0;
+        do {
+            int64_t rv = 0;
+            status = gsid->commitGsiPatchFromStream(stream, patchSize - consumed, &rv);
+            if (!status.isOk() || rv < 0) {
+                break;
+            }
+            consumed += rv;
+            ok = consumed == patchSize;
+        } while (!ok && WaitWhilePaused(gsid, &committed));
+    } else {
+        do {
+            status = gsid->commitGsiChunkFromStream(stream, gsiSize - committed, &ok);
+        } while (!ok && status.isOk() && WaitWhilePaused(gsid, &committed));
+    }
     if (!ok) {
         std::cerr << "Could not commit live image data: " << ErrorMessage(status) << "\n";
         return EX_SOFTWARE;
@@ -323,6 +641,369 @@ static int Install(sp<IGsiService> gsid, int argc, char** argv) {
     return 0;
 }
 
+// Synthetic image data for "gsi_tool bench". Each 4KiB block is either all
+// zeroes (with probability |zero_ratio| percent) or has |compressibility|
+// percent of its bytes set to a repeating pattern and the rest random. The
+// generator is seeded with a constant, so runs are reproducible.
+class BenchDataGenerator {
+  public:
+    BenchDataGenerator(int compressibility, int zero_ratio)
+        : compressibility_(compressibility), zero_ratio_(zero_ratio) {}
+
+    std::vector<uint8_t> Generate(size_t size) {
+        static constexpr size_t kBlockSize = 4096;
+        static constexpr char kPattern[] = "DSU";
+        std::vector<uint8_t> data(size, 0);
+        for (size_t offset = 0; offset < size; offset += kBlockSize) {
+            size_t block_size = std::min(kBlockSize, size - offset);
+            if (static_cast<int>(rng_() % 100) < zero_ratio_) {
+                continue;
+            }
+            size_t pattern_size = block_size * compressibility_ / 100;
+            for (size_t i = 0; i < block_size; i++) {
+                data[offset + i] = i < pattern_size ? kPattern[i % 3] : rng_();
+            }
+        }
+        return data;
+    }
+
+  private:
+    int compressibility_;
+    int zero_ratio_;
+    std::mt19937_64 rng_{0x6473755f62656e63};
+};
+
+struct BenchResult {
+    std::vector<std::pair<std::string, std::chrono::nanoseconds>> phases;
+    std::vector<std::chrono::nanoseconds> chunk_latencies;
+    std::chrono::nanoseconds commit_time{0};
+};
+
+// Feeds |chunks| through a pipe and commits them with
+// commitGsiChunkFromStream, one call per chunk.
+static bool BenchStreamCommit(sp<IGsiService> gsid, int64_t size, int64_t chunk_size,
+                              const std::vector<std::vector<uint8_t>>& chunks,
+                              BenchResult* result) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC)) {
+        std::cerr << "pipe: " << strerror(errno) << std::endl;
+        return false;
+    }
+    android::base::unique_fd read_end(fds[0]), write_end(fds[1]);
+    // Keep a full chunk in flight so gsid does not wait on this process.
+    fcntl(write_end, F_SETPIPE_SZ, static_cast<int>(std::min<int64_t>(chunk_size, 1 << 20)));
+
+    std::thread producer([&]() -> void {
+        size_t index = 0;
+        for (int64_t offset = 0; offset < size; offset += chunk_size) {
+            const auto& chunk = chunks[index++ % chunks.size()];
+            size_t bytes = std::min<int64_t>(chunk_size, size - offset);
+            if (!android::base::WriteFully(write_end, chunk.data(), bytes)) {
+                break;
+            }
+        }
+        write_end.reset();
+    });
+
+    bool ok = true;
+    {
+        android::os::ParcelFileDescriptor stream(std::move(read_end));
+        for (int64_t offset = 0; ok && offset < size; offset += chunk_size) {
+            int64_t bytes = std::min(chunk_size, size - offset);
+            auto start = std::chrono::steady_clock::now();
+            auto status = gsid->commitGsiChunkFromStream(stream, bytes, &ok);
+            result->chunk_latencies.emplace_back(std::chrono::steady_clock::now() - start);
+            if (!ok) {
+                std::cerr << "Could not commit live image data: " << ErrorMessage(status) << "\n";
+            }
+        }
+    }
+    // Closing the read end unblocks the producer if the commit failed part way.
+    producer.join();
+    return ok;
+}
+
+// Commits |chunks| through a shared ashmem region of |chunk_size| bytes.
+static bool BenchAshmemCommit(sp<IGsiService> gsid, int64_t size, int64_t chunk_size,
+                              const std::vector<std::vector<uint8_t>>& chunks,
+                              BenchResult* result) {
+    android::base::unique_fd ashmem(ashmem_create_region("gsi_tool_bench", chunk_size));
+    if (ashmem < 0) {
+        std::cerr << "ashmem_create_region: " << strerror(errno) << std::endl;
+        return false;
+    }
+    void* map = mmap(nullptr, chunk_size, PROT_READ | PROT_WRITE, MAP_SHARED, ashmem, 0);
+    if (map == MAP_FAILED) {
+        std::cerr << "mmap: " << strerror(errno) << std::endl;
+        return false;
+    }
+    auto unmap = android::base::make_scope_guard([&]() -> void { munmap(map, chunk_size); });
+
+    bool ok = false;
+    android::os::ParcelFileDescriptor region(android::base::unique_fd(dup(ashmem)));
+    auto status = gsid->setGsiAshmem(region, chunk_size, &ok);
+    if (!ok) {
+        std::cerr << "Could not map ashmem: " << ErrorMessage(status) << "\n";
+        return false;
+    }
+
+    size_t index = 0;
+    for (int64_t offset = 0; ok && offset < size; offset += chunk_size) {
+        int64_t bytes = std::min(chunk_size, size - offset);
+        memcpy(map, chunks[index++ % chunks.size()].data(), bytes);
+        auto start = std::chrono::steady_clock::now();
+        status = gsid->commitGsiChunkFromAshmem(bytes, &ok);
+        result->chunk_latencies.emplace_back(std::chrono::steady_clock::now() - start);
+        if (!ok) {
+            std::cerr << "Could not commit live image data: " << ErrorMessage(status) << "\n";
+        }
+    }
+    return ok;
+}
+
+static double ToMs(std::chrono::nanoseconds duration) {
+    return duration.count() / 1000000.0;
+}
+
+static double ToMBps(int64_t bytes, std::chrono::nanoseconds duration) {
+    return duration.count() ? bytes * 1000.0 / duration.count() : 0;
+}
+
+static void PrintBenchResult(const std::string& mode, int64_t size, BenchResult* result) {
+    std::chrono::nanoseconds total{0};
+    std::cout << mode << ":" << std::endl;
+    for (const auto& [phase, duration] : result->phases) {
+        std::cout << StringPrintf("  %-18s %10.1f ms", phase.c_str(), ToMs(duration)) << std::endl;
+        total += duration;
+    }
+    std::cout << StringPrintf("  %-18s %10.1f ms", "total", ToMs(total)) << std::endl;
+
+    auto& latencies = result->chunk_latencies;
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](size_t p) -> double {
+        return latencies.empty() ? 0 : ToMs(latencies[(latencies.size() - 1) * p / 100]);
+    };
+    std::cout << StringPrintf("  sustained write:   %10.1f MB/s", ToMBps(size, result->commit_time))
+              << std::endl;
+    std::cout << StringPrintf("  end to end:        %10.1f MB/s", ToMBps(size, total))
+              << std::endl;
+    std::cout << StringPrintf("  chunk latency:     p50 %.2f ms, p99 %.2f ms, max %.2f ms",
+                              percentile(50), percentile(99), percentile(100))
+              << " (" << latencies.size() << " chunks)" << std::endl;
+}
+
+static int RunBench(sp<IGsiService> gsid, const std::string& mode, const std::string& install_dir,
+                    int qos, int64_t size, int64_t chunk_size,
+                    const std::vector<std::vector<uint8_t>>& chunks) {
+    static constexpr char kBenchPartition[] = "bench";
+
+    BenchResult result;
+    auto timed = [&](const std::string& phase, auto&& fn) -> bool {
+        auto start = std::chrono::steady_clock::now();
+        bool ok = fn();
+        auto duration = std::chrono::steady_clock::now() - start;
+        result.phases.emplace_back(phase, duration);
+        if (phase == "commit") {
+            result.commit_time = duration;
+        }
+        return ok;
+    };
+
+    int error = IGsiService::INSTALL_OK;
+    android::binder::Status status;
+    bool ok = timed("openInstall", [&]() -> bool {
+        status = gsid->openInstall(install_dir, &error);
+        return status.isOk() && error == IGsiService::INSTALL_OK;
+    });
+    if (!ok) {
+        std::cerr << "Could not open DSU installation: " << ErrorMessage(status, error) << "\n";
+        return EX_SOFTWARE;
+    }
+    // Whatever happens from here, leave no slot behind.
+    auto remove = android::base::make_scope_guard([&]() -> void {
+        bool removed = false;
+        gsid->removeGsi(&removed);
+        if (!removed) {
+            std::cerr << "Could not remove the benchmark slot; use gsi_tool wipe." << std::endl;
+        }
+    });
+
+    status = gsid->setInstallQos(qos, &error);
+    if (!status.isOk() || error != IGsiService::INSTALL_OK) {
+        std::cerr << "Could not set install QoS: " << ErrorMessage(status, error) << "\n";
+        return EX_SOFTWARE;
+    }
+    ok = timed("createPartition", [&]() -> bool {
+        status = gsid->createPartition(kBenchPartition, size, true, &error);
+        return status.isOk() && error == IGsiService::INSTALL_OK;
+    });
+    if (!ok) {
+        std::cerr << "Could not create partition: " << ErrorMessage(status, error) << "\n";
+        return EX_SOFTWARE;
+    }
+    ok = timed("commit", [&]() -> bool {
+        if (mode == "stream") {
+            return BenchStreamCommit(gsid, size, chunk_size, chunks, &result);
+        }
+        return BenchAshmemCommit(gsid, size, chunk_size, chunks, &result);
+    });
+    if (!ok) {
+        return EX_SOFTWARE;
+    }
+    ok = timed("closeInstall", [&]() -> bool {
+        status = gsid->closeInstall(&error);
+        return status.isOk() && error == IGsiService::INSTALL_OK;
+    });
+    if (!ok) {
+        std::cerr << "Could not close DSU installation: " << ErrorMessage(status, error) << "\n";
+        return EX_SOFTWARE;
+    }
+
+    std::string dsu_slot;
+    std::vector<InstallPhase> report;
+    status = gsid->getActiveDsuSlot(&dsu_slot);
+    if (status.isOk()) {
+        status = gsid->getInstallReport(dsu_slot, &report);
+    }
+
+    ok = timed("removeGsi", [&]() -> bool {
+        remove.Disable();
+        bool removed = false;
+        status = gsid->removeGsi(&removed);
+        return removed;
+    });
+    if (!ok) {
+        std::cerr << "Could not remove the benchmark slot: " << ErrorMessage(status) << "\n";
+        return EX_SOFTWARE;
+    }
+
+    PrintBenchResult(mode, size, &result);
+    if (!report.empty()) {
+        std::cout << "  gsid phases:" << std::endl;
+    }
+    for (const auto& phase : report) {
+        std::string name = phase.partition + " " + phase.phase;
+        std::cout << StringPrintf("    %-16s %10.1f ms", name.c_str(),
+                                  ToMs(std::chrono::nanoseconds(phase.durationNs)));
+        if (phase.bytes > 0 && phase.durationNs > 0) {
+            auto duration = std::chrono::nanoseconds(phase.durationNs);
+            std::cout << StringPrintf("  %8.1f MB/s", ToMBps(phase.bytes, duration));
+        }
+        std::cout << std::endl;
+    }
+    return 0;
+}
+
+static int Bench(sp<IGsiService> gsid, int argc, char** argv) {
+    struct option options[] = {
+            {"install-dir", required_argument, nullptr, 'i'},
+            {"size", required_argument, nullptr, 's'},
+            {"chunk-size", required_argument, nullptr, 'c'},
+            {"mode", required_argument, nullptr, 'm'},
+            {"compressibility", required_argument, nullptr, 'z'},
+            {"zero-ratio", required_argument, nullptr, 'r'},
+            {"qos", required_argument, nullptr, 'q'},
+            {nullptr, 0, nullptr, 0},
+    };
+
+    int64_t size = 512 * 1024 * 1024;
+    int64_t chunk_size = 1024 * 1024;
+    int compressibility = 50;
+    int zero_ratio = 0;
+    int qos = IGsiService::INSTALL_QOS_FOREGROUND;
+    std::string mode = "all";
+    std::string install_dir = "";
+    if (getuid() != 0) {
+        std::cerr << "must be root to benchmark a GSI install" << std::endl;
+        return EX_NOPERM;
+    }
+
+    int rv, index;
+    while ((rv = getopt_long_only(argc, argv, "", options, &index)) != -1) {
+        switch (rv) {
+            case 'i':
+                install_dir = optarg;
+                break;
+            case 's':
+                if (!android::base::ParseInt(optarg, &size) || size <= 0 || size % 512) {
+                    std::cerr << "Image size must be a positive multiple of 512: " << optarg
+                              << std::endl;
+                    return EX_USAGE;
+                }
+                break;
+            case 'c':
+                if (!android::base::ParseInt(optarg, &chunk_size, int64_t(1),
+                                             int64_t(64 * 1024 * 1024))) {
+                    std::cerr << "Could not parse chunk size: " << optarg << std::endl;
+                    return EX_USAGE;
+                }
+                break;
+            case 'm':
+                mode = optarg;
+                if (mode != "stream" && mode != "ashmem" && mode != "all") {
+                    std::cerr << "Mode must be stream, ashmem or all: " << optarg << std::endl;
+                    return EX_USAGE;
+                }
+                break;
+            case 'z':
+                if (!android::base::ParseInt(optarg, &compressibility, 0, 100)) {
+                    std::cerr << "Compressibility must be a percentage: " << optarg << std::endl;
+                    return EX_USAGE;
+                }
+                break;
+            case 'r':
+                if (!android::base::ParseInt(optarg, &zero_ratio, 0, 100)) {
+                    std::cerr << "Zero ratio must be a percentage: " << optarg << std::endl;
+                    return EX_USAGE;
+                }
+                break;
+            case 'q':
+                if (!ParseInstallQos(optarg, &qos)) {
+                    return EX_USAGE;
+                }
+                break;
+            default:
+                return EX_USAGE;
+        }
+    }
+
+    // The benchmark removes its slot when done, which would also remove an
+    // existing install.
+    bool running = false, installed = false, installing = false;
+    gsid->isGsiRunning(&running);
+    gsid->isGsiInstalled(&installed);
+    gsid->isGsiInstallInProgress(&installing);
+    if (running || installed || installing) {
+        std::cerr << "Cannot benchmark while a GSI is installed or being installed." << std::endl;
+        std::cerr << "Use gsi_tool wipe first." << std::endl;
+        return EX_SOFTWARE;
+    }
+
+    // Generate the data up front so that it is not part of the timings.
+    // Chunks repeat once the pool is exhausted.
+    static constexpr int64_t kMaxPoolSize = 64 * 1024 * 1024;
+    BenchDataGenerator generator(compressibility, zero_ratio);
+    std::vector<std::vector<uint8_t>> chunks;
+    for (int64_t pool = 0; pool < std::min(size, kMaxPoolSize) || chunks.empty();
+         pool += chunk_size) {
+        chunks.emplace_back(generator.Generate(chunk_size));
+    }
+
+    std::cout << StringPrintf("%lld bytes, %lld byte chunks, %d%% compressible, %d%% zero blocks",
+                              static_cast<long long>(size), static_cast<long long>(chunk_size),
+                              compressibility, zero_ratio)
+              << std::endl;
+    for (const auto& variant : {"stream", "ashmem"}) {
+        if (mode != "all" && mode != variant) {
+            continue;
+        }
+        if (int rc = RunBench(gsid, variant, install_dir, qos, size, chunk_size, chunks)) {
+            return rc;
+        }
+    }
+    return 0;
+}
+
 static int Wipe(sp<IGsiService> gsid, int argc, char** /* argv */) {
     if (argc > 1) {
         std::cerr << "Unrecognized arguments to wipe." << std::endl;
@@ -381,6 +1062,153 @@ static int WipeData(sp<IGsiService> gsid, int argc, char** /* argv */) {
     return 0;
 }
 
+// Default size of the copy-on-write image of "snapshot-data".
+static constexpr int64_t kDefaultCowSize = 2LL * 1024 * 1024 * 1024;
+
+static int SnapshotData(sp<IGsiService> gsid, int argc, char** argv) {
+    int64_t cowSize = kDefaultCowSize;
+    bool remove = false;
+    struct option options[] = {
+            {"cow-size", required_argument, nullptr, 'c'},
+            {"remove", no_argument, nullptr, 'r'},
+            {nullptr, 0, nullptr, 0},
+    };
+    int rv, index;
+    while ((rv = getopt_long_only(argc, argv, "", options, &index)) != -1) {
+        switch (rv) {
+            case 'c':
+                if (!android::base::ParseInt(optarg, &cowSize) || cowSize <= 0) {
+                    std::cerr << "Could not parse copy-on-write size: " << optarg << std::endl;
+                    return EX_USAGE;
+                }
+                break;
+            case 'r':
+                remove = true;
+                break;
+            default:
+                std::cerr << "Unrecognized argument to snapshot-data\n";
+                return EX_USAGE;
+        }
+    }
+
+    int error;
+    auto status = remove ? gsid->removeUserdataSnapshot(&error)
+                         : gsid->createUserdataSnapshot(cowSize, &error);
+    if (!status.isOk() || error) {
+        std::cerr << "Could not " << (remove ? "remove" : "create")
+                  << " the GSI userdata snapshot: " << ErrorMessage(status, error) << "\n";
+        return EX_SOFTWARE;
+    }
+    return 0;
+}
+
+static int ResetData(sp<IGsiService> gsid, int argc, char** /* argv */) {
+    if (argc > 1) {
+        std::cerr << "Unrecognized arguments to reset-data.\n";
+        return EX_USAGE;
+    }
+    int error;
+    auto status = gsid->resetUserdataSnapshot(&error);
+    if (!status.isOk() || error) {
+        std::cerr << "Could not reset GSI userdata: " << ErrorMessage(status, error) << "\n";
+        return EX_SOFTWARE;
+    }
+    return 0;
+}
+
+static int Resize(sp<IGsiService> gsid, int argc, char** argv) {
+    std::string partition = "userdata";
+    int64_t size = 0;
+    struct option options[] = {
+            {"partition-name", required_argument, nullptr, 'p'},
+            {"size", required_argument, nullptr, 's'},
+            {nullptr, 0, nullptr, 0},
+    };
+    int rv, index;
+    while ((rv = getopt_long_only(argc, argv, "", options, &index)) != -1) {
+        switch (rv) {
+            case 'p':
+                partition = optarg;
+                break;
+            case 's':
+                if (!android::base::ParseInt(optarg, &size) || size <= 0) {
+                    std::cerr << "Could not parse size: " << optarg << std::endl;
+                    return EX_USAGE;
+                }
+                break;
+            default:
+                std::cerr << "Unrecognized argument to resize\n";
+                return EX_USAGE;
+        }
+    }
+    if (!size) {
+        std::cerr << "Must specify --size\n";
+        return EX_USAGE;
+    }
+
+    int error;
+    auto status = gsid->resizePartition(partition, size, &error);
+    if (!status.isOk() || error) {
+        std::cerr << "Could not resize " << partition << ": " << ErrorMessage(status, error)
+                  << "\n";
+        return EX_SOFTWARE;
+    }
+    return 0;
+}
+
+static int Reserve(sp<IGsiService> gsid, int argc, char** argv) {
+    int64_t size = -1;
+    struct option options[] = {
+            {"size", required_argument, nullptr, 's'},
+            {nullptr, 0, nullptr, 0},
+    };
+    int rv, index;
+    while ((rv = getopt_long_only(argc, argv, "", options, &index)) != -1) {
+        switch (rv) {
+            case 's':
+                if (!android::base::ParseInt(optarg, &size) || size < 0) {
+                    std::cerr << "Could not parse size: " << optarg << std::endl;
+                    return EX_USAGE;
+                }
+                break;
+            default:
+                std::cerr << "Unrecognized argument to reserve\n";
+                return EX_USAGE;
+        }
+    }
+    if (size < 0) {
+        std::cerr << "Must specify --size\n";
+        return EX_USAGE;
+    }
+
+    int error;
+    auto status = gsid->reserveImagePool(size, &error);
+    while (status.isOk() && error == IGsiService::INSTALL_POOL_INCOMPLETE) {
+        status = gsid->reserveImagePool(size, &error);
+    }
+    if (status.isOk() && error == IGsiService::INSTALL_POOL_STOPPED) {
+        std::cerr << "Stopped short of " << size << " bytes; the image pool only grows while "
+                  << "the device is charging and no GSI is installing or running.\n";
+        return EX_TEMPFAIL;
+    }
+    if (!status.isOk() || error) {
+        std::cerr << "Could not reserve the image pool: " << ErrorMessage(status, error) << "\n";
+        return EX_SOFTWARE;
+    }
+    return 0;
+}
+
+static std::string HexString(const std::vector<uint8_t>& bytes) {
+    if (bytes.empty()) {
+        return "[NONE]";
+    }
+    std::string hex;
+    for (auto b : bytes) {
+        hex += StringPrintf("%02x", b & 255);
+    }
+    return hex;
+}
+
 static int Status(sp<IGsiService> gsid, int argc, char** /* argv */) {
     if (argc > 1) {
         std::cerr << "Unrecognized arguments to status." << std::endl;
@@ -437,19 +1265,21 @@ static int Status(sp<IGsiService> gsid, int argc, char** /* argv */) {
             std::cerr << "error: " << status.exceptionMessage().string() << std::endl;
             return EX_SOFTWARE;
         }
-        for (auto&& image : images) {
-            std::cout << "installed: " << image << std::endl;
-            AvbPublicKey public_key;
-            int err = 0;
-            status = image_service->getAvbPublicKey(image, &public_key, &err);
-            std::cout << "AVB public key (sha1): ";
-            if (!public_key.bytes.empty()) {
-                for (auto b : public_key.sha1) {
-                    std::cout << StringPrintf("%02x", b & 255);
-                }
-                std::cout << std::endl;
-            } else {
-                std::cout << "[NONE]" << std::endl;
+        std::vector<AvbInfo> avb_info;
+        status = image_service->getAvbInfo(images, &avb_info);
+        if (!status.isOk()) {
+            std::cerr << "error: " << status.exceptionMessage().string() << std::endl;
+            return EX_SOFTWARE;
+        }
+        for (auto&& info : avb_info) {
+            std::cout << "installed: " << info.name << std::endl;
+            std::cout << "AVB public key (sha1): " << HexString(info.publicKeySha1) << std::endl;
+            std::cout << "AVB public key (sha256): " << HexString(info.publicKeySha256)
+                      << std::endl;
+            if (info.status == IImageService::IMAGE_OK) {
+                std::cout << "VBMeta digest (sha256): " << HexString(info.vbmetaSha256)
+                          << std::endl;
+                std::cout << "Rollback index: " << info.rollbackIndex << std::endl;
             }
         }
     }
@@ -470,6 +1300,35 @@ static int Cancel(sp<IGsiService> gsid, int /* argc */, char** /* argv */) {
     return 0;
 }
 
+static int Pause(sp<IGsiService> gsid, int argc, char** /* argv */) {
+    if (argc > 1) {
+        std::cerr << "Unrecognized arguments to pause." << std::endl;
+        return EX_USAGE;
+    }
+    int error;
+    auto status = gsid->pauseInstall(&error);
+    if (!status.isOk() || error != IGsiService::INSTALL_OK) {
+        std::cerr << "Could not pause the installation: " << ErrorMessage(status, error) << "\n";
+        return EX_SOFTWARE;
+    }
+    return 0;
+}
+
+static int Resume(sp<IGsiService> gsid, int argc, char** /* argv */) {
+    if (argc > 1) {
+        std::cerr << "Unrecognized arguments to resume." << std::endl;
+        return EX_USAGE;
+    }
+    int error;
+    auto status = gsid->resumeInstall(&error);
+    if (!status.isOk() || error != IGsiService::INSTALL_OK) {
+        std::cerr << "Could not resume the installation: " << ErrorMessage(status, error)
+                  << "\n";
+        return EX_SOFTWARE;
+    }
+    return 0;
+}
+
 static int Enable(sp<IGsiService> gsid, int argc, char** argv) {
     bool one_shot = false;
     std::string dsuSlot = {};
@@ -557,13 +1416,48 @@ static int usage(int /* argc */, char* argv[]) {
             "  enable       [-s, --single-boot]\n"
             "               [-d, --dsuslot slotname]\n"
             "               Enable a previously disabled GSI.\n"
+            "  bench        [--size bytes] [--chunk-size bytes]\n"
+            "               [--mode stream|ashmem|all] [--install-dir dir]\n"
+            "               [--compressibility percent] [--zero-ratio percent]\n"
+            "               [--qos foreground|background|idle]\n"
+            "               Install a synthetic image into a temporary slot,\n"
+            "               report per-phase timings and throughput, and then\n"
+            "               remove the slot.\n"
             "  install      Install a new GSI. Specify the image size with\n"
             "               --gsi-size and the desired userdata size with\n"
             "               --userdata-size (the latter defaults to 8GiB)\n"
+            "               --userdata-max-size (make userdata thin: start at\n"
+            "               --userdata-size, or 512MiB, and grow it up to this\n"
+            "               size as it fills, between GSI boots)\n"
             "               --wipe (remove old gsi userdata first)\n"
+            "               --qos foreground|background|idle (disk priority)\n"
+            "               --patch-size (read a delta patch of this size against\n"
+            "               the previous install, instead of the image)\n"
+            "               --incremental (only write the blocks of the image\n"
+            "               that differ from the previous install)\n"
+            "               --digest (SHA-256 of the image: link to a copy\n"
+            "               already installed in another slot if there is one,\n"
+            "               otherwise share this one once it is written)\n"
+            "               --dry-run (only report whether the install would\n"
+            "               fit, and the space it needs)\n"
             "  wipe         Completely remove a GSI and its associated data\n"
             "  wipe-data    Ensure the GSI's userdata will be formatted\n"
+            "  snapshot-data [--cow-size <bytes>] [--remove]\n"
+            "               Snapshot the GSI's userdata, so that reset-data can\n"
+            "               return it to its current state. Changes are kept\n"
+            "               in a copy-on-write image (2GiB by default).\n"
+            "               --remove drops the snapshot and its changes.\n"
+            "               (Not supported until first-stage init maps it.)\n"
+            "  reset-data   Discard userdata changes since snapshot-data\n"
+            "  resize       [--partition-name <name>] --size <bytes>\n"
+            "               Grow a writable partition of the installed GSI\n"
+            "               (userdata by default) in place, keeping its data\n"
+            "  reserve      --size <bytes>\n"
+            "               Grow or shrink the pool of storage reserved for\n"
+            "               creating DSU images quickly (0 frees it)\n"
             "  cancel       Cancel the installation\n"
+            "  pause        Pause the installation, keeping what was written\n"
+            "  resume       Resume a paused installation\n"
             "  status       Show status\n",
             argv[0], argv[0]);
     return EX_USAGE;
@@ -572,6 +1466,10 @@ static int usage(int /* argc */, char* argv[]) {
 int main(int argc, char** argv) {
     android::base::InitLogging(argv, android::base::StdioLogger, android::base::DefaultAborter);
 
+    // gsid closes the read end of a stream when a commit fails. Writers see
+    // EPIPE instead of being killed, so that they can clean up.
+    signal(SIGPIPE, SIG_IGN);
+
     android::sp<IGsiService> service = GetGsiService();
     if (!service) {
         return EX_SOFTWARE;
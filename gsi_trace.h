@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+// Trace sections and counters for the install pipeline. They are emitted
+// under the "pm" atrace category, and can be compiled out entirely by
+// building with -DGSID_TRACE_ENABLED=0.
+#ifndef GSID_TRACE_ENABLED
+#define GSID_TRACE_ENABLED 1
+#endif
+
+#if GSID_TRACE_ENABLED
+
+#ifndef ATRACE_TAG
+#define ATRACE_TAG ATRACE_TAG_PACKAGE_MANAGER
+#endif
+#include <cutils/trace.h>
+#include <utils/Trace.h>
+
+#define GSI_TRACE_CALL() ATRACE_CALL()
+#define GSI_TRACE_NAME(name) ATRACE_NAME(name)
+#define GSI_TRACE_INT64(name, value) ATRACE_INT64(name, value)
+
+#else
+
+#define GSI_TRACE_CALL()
+#define GSI_TRACE_NAME(name)
+// Still evaluate the value, which may have side effects.
+#define GSI_TRACE_INT64(name, value) ((void)(name), (void)(value))
+
+#endif
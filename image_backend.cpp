@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "image_backend.h"
+
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include <android-base/logging.h>
+
+namespace android {
+namespace gsi {
+
+uint64_t GetImageSize(int fd) {
+    struct stat s;
+    if (fstat(fd, &s)) {
+        PLOG(ERROR) << "fstat failed";
+        return 0;
+    }
+    if (!S_ISBLK(s.st_mode)) {
+        return s.st_size;
+    }
+    uint64_t size;
+    if (ioctl(fd, BLKGETSIZE64, &size)) {
+        PLOG(ERROR) << "BLKGETSIZE64 failed";
+        return 0;
+    }
+    return size;
+}
+
+bool CreateImagesConcurrently(
+        const std::vector<ImageBackend::ImageSpec>& images,
+        const std::function<bool(size_t, ImageBackend::ProgressCallback&&)>& create,
+        ImageBackend::ProgressCallback&& on_progress, std::vector<bool>* created) {
+    uint64_t total = 0;
+    for (const auto& image : images) {
+        total += image.size;
+    }
+
+    std::mutex progress_lock;
+    std::vector<uint64_t> progress(images.size());
+    uint64_t current = 0;
+    std::atomic<bool> failed = false;
+    auto report = [&](size_t index, uint64_t bytes) -> bool {
+        if (failed) {
+            return false;
+        }
+        std::lock_guard<std::mutex> guard(progress_lock);
+        current += bytes - progress[index];
+        progress[index] = bytes;
+        if (on_progress && !on_progress(current, total)) {
+            failed = true;
+            return false;
+        }
+        return true;
+    };
+
+    // Each thread sets only its own entry; std::vector<bool> packs entries
+    // into shared words, so it cannot be used here.
+    auto results = std::make_unique<bool[]>(images.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < images.size(); i++) {
+        threads.emplace_back([&, i]() -> void {
+            auto callback = [&report, i](uint64_t bytes, uint64_t /* total */) -> bool {
+                return report(i, bytes);
+            };
+            results[i] = create(i, std::move(callback));
+            if (!results[i]) {
+                failed = true;
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    created->assign(results.get(), results.get() + images.size());
+    return !failed;
+}
+
+bool ImageBackend::CreateBackingImages(const std::vector<ImageSpec>& images,
+                                       ProgressCallback&& on_progress) {
+    auto create = [&, this](size_t index, ProgressCallback&& progress) -> bool {
+        const auto& image = images[index];
+        return CreateBackingImage(image.name, image.size, image.readonly, std::move(progress));
+    };
+    std::vector<bool> created;
+    if (CreateImagesConcurrently(images, create, std::move(on_progress), &created)) {
+        return true;
+    }
+    for (size_t i = 0; i < images.size(); i++) {
+        if (created[i]) {
+            DeleteBackingImage(images[i].name);
+        }
+    }
+    return false;
+}
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "image_extent_reader.h"
+
+#include <fcntl.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <liblp/liblp.h>
+#include <liblp/partition_opener.h>
+
+namespace android {
+namespace gsi {
+
+using namespace android::fs_mgr;
+using android::base::ReadFullyAtOffset;
+using android::base::unique_fd;
+
+std::unique_ptr<ImageExtentReader> ImageExtentReader::Open(const std::string& metadata_dir,
+                                                           const std::string& name) {
+    // This is the metadata file maintained by libfiemap's ImageManager.
+    auto metadata_file = metadata_dir + "/lp_metadata";
+    auto metadata = ReadFromImageFile(metadata_file);
+    if (!metadata) {
+        LOG(ERROR) << "Could not read image metadata: " << metadata_file;
+        return nullptr;
+    }
+
+    const LpMetadataPartition* partition = nullptr;
+    for (const auto& entry : metadata->partitions) {
+        if (GetPartitionName(entry) == name) {
+            partition = &entry;
+            break;
+        }
+    }
+    if (!partition) {
+        LOG(ERROR) << "Image " << name << " not found in " << metadata_file;
+        return nullptr;
+    }
+
+    std::unique_ptr<ImageExtentReader> reader(new ImageExtentReader());
+    for (const auto& block_device : metadata->block_devices) {
+        reader->block_devices_.emplace_back(GetBlockDevicePartitionName(block_device));
+    }
+
+    uint64_t logical_offset = 0;
+    for (uint32_t i = 0; i < partition->num_extents; i++) {
+        const auto& extent = metadata->extents[partition->first_extent_index + i];
+        Extent entry = {
+                .logical_offset = logical_offset,
+                .physical_offset = extent.target_data * LP_SECTOR_SIZE,
+                .length = extent.num_sectors * LP_SECTOR_SIZE,
+                .block_device = -1,
+        };
+        if (extent.target_type == LP_TARGET_TYPE_LINEAR) {
+            if (extent.target_source >= reader->block_devices_.size()) {
+                LOG(ERROR) << "Image " << name << " has an invalid block device index";
+                return nullptr;
+            }
+            entry.block_device = extent.target_source;
+        } else if (extent.target_type != LP_TARGET_TYPE_ZERO) {
+            LOG(ERROR) << "Image " << name << " has an unknown extent type";
+            return nullptr;
+        }
+        reader->extents_.emplace_back(entry);
+        logical_offset += entry.length;
+    }
+    reader->size_ = logical_offset;
+    return reader;
+}
+
+int ImageExtentReader::GetBlockDeviceFd(int32_t index) {
+    auto iter = fds_.find(index);
+    if (iter != fds_.end()) {
+        return iter->second.get();
+    }
+    // Resolve the block device the same way the dm-linear table does, so
+    // that we read exactly what a mapped device would return.
+    PartitionOpener opener;
+    unique_fd fd = opener.Open(block_devices_[index], O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        PLOG(ERROR) << "open " << block_devices_[index];
+        return -1;
+    }
+    return fds_.emplace(index, std::move(fd)).first->second.get();
+}
+
+bool ImageExtentReader::ReadAt(void* data, size_t size, uint64_t offset) {
+    if (offset > size_ || size > size_ - offset) {
+        LOG(ERROR) << "read of " << size << " bytes at " << offset << " exceeds image size "
+                   << size_;
+        return false;
+    }
+
+    // Find the first extent that ends after |offset|.
+    auto iter = std::upper_bound(extents_.begin(), extents_.end(), offset,
+                                 [](uint64_t value, const Extent& extent) -> bool {
+                                     return value < extent.logical_offset + extent.length;
+                                 });
+
+    auto buffer = reinterpret_cast<uint8_t*>(data);
+    while (size) {
+        CHECK(iter != extents_.end());
+        uint64_t extent_offset = offset - iter->logical_offset;
+        size_t chunk = std::min(static_cast<uint64_t>(size), iter->length - extent_offset);
+
+        if (iter->block_device < 0) {
+            memset(buffer, 0, chunk);
+        } else {
+            int fd = GetBlockDeviceFd(iter->block_device);
+            if (fd < 0) {
+                return false;
+            }
+            uint64_t physical_offset = iter->physical_offset + extent_offset;
+            if (!ReadFullyAtOffset(fd, buffer, chunk, physical_offset)) {
+                PLOG(ERROR) << "read " << block_devices_[iter->block_device] << " at "
+                            << physical_offset;
+                return false;
+            }
+        }
+        buffer += chunk;
+        offset += chunk;
+        size -= chunk;
+        iter++;
+    }
+    return true;
+}
+
+}  // namespace gsi
+}  // namespace android
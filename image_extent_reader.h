@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+
+namespace android {
+namespace gsi {
+
+// Reads the contents of a libfiemap image without mapping it. The image's
+// extents are resolved through the same liblp metadata that ImageManager
+// uses to build its dm-linear table, and the bytes are read directly from
+// the underlying block device. This is much cheaper than creating and
+// tearing down a device-mapper device when only a few small regions of the
+// image are needed.
+class ImageExtentReader final {
+  public:
+    static std::unique_ptr<ImageExtentReader> Open(const std::string& metadata_dir,
+                                                   const std::string& name);
+
+    // Read |size| bytes at logical |offset| of the image.
+    bool ReadAt(void* data, size_t size, uint64_t offset);
+
+    uint64_t size() const { return size_; }
+
+  private:
+    struct Extent {
+        uint64_t logical_offset;
+        uint64_t physical_offset;
+        uint64_t length;
+        // Index into block_devices_, or -1 for a zero extent.
+        int32_t block_device;
+    };
+
+    ImageExtentReader() = default;
+    int GetBlockDeviceFd(int32_t index);
+
+    std::vector<Extent> extents_;
+    std::vector<std::string> block_devices_;
+    std::map<int32_t, android::base::unique_fd> fds_;
+    uint64_t size_ = 0;
+};
+
+}  // namespace gsi
+}  // namespace android
@@ -16,6 +16,8 @@
 
 #pragma once
 
+#include <stdint.h>
+
 #include <string>
 
 namespace android {
@@ -41,6 +43,10 @@ static inline std::string DsuInstallDirFile(const std::string& dsu_slot) {
     return DSU_METADATA_PREFIX + dsu_slot + "/install_dir";
 }
 
+static inline std::string DsuUserdataSnapshotFile(const std::string& dsu_slot) {
+    return DSU_METADATA_PREFIX + dsu_slot + "/userdata_snapshot";
+}
+
 // install_dir "/data/gsi/dsu/dsu" has a slot name "dsu"
 // install_dir "/data/gsi/dsu/dsu2" has a slot name "dsu2"
 std::string GetDsuSlot(const std::string& install_dir);
@@ -80,5 +86,20 @@ bool CanBootIntoGsi(std::string* error);
 // GSI.
 bool MarkSystemAsGsi();
 
+// The userdata of a DSU slot can be made the base of a copy-on-write
+// snapshot, so that it can be reset to that state in constant time.
+// First-stage init must map a persistent dm-snapshot of |base| with the
+// exception store |cow|, in chunks of |chunk_sectors|, and mount that as
+// /data instead of |base|, which is read-only in the slot's metadata. gsid
+// does not create snapshots until first-stage init does so.
+struct UserdataSnapshot {
+    std::string base;
+    std::string cow;
+    uint32_t chunk_sectors;
+};
+
+// Returns false if userdata of |dsu_slot| is not a snapshot.
+bool GetUserdataSnapshot(const std::string& dsu_slot, UserdataSnapshot* snapshot);
+
 }  // namespace gsi
 }  // namespace android
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+#include <vector>
+
+namespace android {
+namespace gsi {
+
+using ReadAtOffsetFn = std::function<bool(void* data, size_t size, uint64_t offset)>;
+
+// Fields of an image's AVB footer and VBMeta image.
+struct AvbImageInfo {
+    // Serialized AVB public key, in the format generated by the
+    // `avbtool extract_public_key` command. Empty for unsigned images.
+    std::vector<uint8_t> public_key;
+    std::vector<uint8_t> public_key_sha1;
+    std::vector<uint8_t> public_key_sha256;
+    // Digest of the VBMeta header, authentication and auxiliary blocks.
+    std::vector<uint8_t> vbmeta_sha256;
+    uint64_t rollback_index = 0;
+    uint32_t algorithm_type = 0;
+    uint32_t flags = 0;
+};
+
+// Parse the AVB footer at the end of an image of |total_size| bytes, and
+// verify the VBMeta image it points to.
+bool ReadAvbImageInfo(uint64_t total_size, const ReadAtOffsetFn& read_at, AvbImageInfo* info);
+bool ReadAvbImageInfoFromFd(int fd, AvbImageInfo* info);
+
+}  // namespace gsi
+}  // namespace android
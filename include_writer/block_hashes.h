@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace gsi {
+
+// Size of each digest in a block hash manifest (SHA-256).
+static constexpr size_t kBlockHashSize = 32;
+
+// Bounds for the block size of a manifest.
+static constexpr uint32_t kMinHashBlockSize = 4096;
+static constexpr uint32_t kMaxHashBlockSize = 16 * 1024 * 1024;
+
+// Invoked with the number of bytes hashed so far; returning false aborts.
+// It may be called from several threads at once.
+using HashProgressCallback = std::function<bool(uint64_t)>;
+
+// Compute the block hash manifest of the first |size| bytes of |fd|: the
+// SHA-256 of each consecutive |block_size| block, concatenated. The last
+// block is hashed over its actual length if |size| is not a multiple of
+// |block_size|. Ranges of blocks are hashed in parallel, and the data read
+// is dropped from the page cache.
+bool ComputeBlockHashes(int fd, uint64_t size, uint32_t block_size, std::vector<uint8_t>* hashes,
+                        const HashProgressCallback& on_progress = nullptr);
+
+// Compute the SHA-256 of the first |size| bytes of |fd|, as a lowercase hex
+// string, the form used to publish shared images.
+bool ComputeImageDigest(int fd, uint64_t size, std::string* digest,
+                        const HashProgressCallback& on_progress = nullptr);
+bool IsValidImageDigest(const std::string& digest);
+
+}  // namespace gsi
+}  // namespace android
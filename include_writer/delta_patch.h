@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include "partition_writer.h"
+#include "service_stats.h"
+
+namespace android {
+namespace gsi {
+
+// Applies a block-level delta patch to an image that still holds the
+// previous install of the same partition. The patch is a sequence of
+// operations, each a DeltaOpHeader followed, for kData only, by |length|
+// bytes of image data. Operations produce the new image in order, from
+// the start, through a PartitionWriter.
+//
+// The patch is applied in place, so a copy may only read from blocks that
+// have not been written yet: its source must be at or after the current
+// position. A copy from the current position leaves the blocks untouched.
+// Every offset and length is a multiple of 4KiB, except that the last
+// operation may end at an unaligned image size.
+class DeltaPatchApplier final {
+  public:
+    enum OpType : uint32_t {
+        // Copy |length| bytes from |source_offset| of the previous image.
+        kCopy = 0,
+        // Write the |length| bytes following the header.
+        kData = 1,
+        // Write |length| zero bytes.
+        kZero = 2,
+    };
+
+    // All fields are little-endian.
+    struct DeltaOpHeader {
+        uint32_t type;
+        uint32_t reserved;
+        uint64_t length;
+        uint64_t source_offset;
+    } __attribute__((packed));
+
+    DeltaPatchApplier(PartitionWriter* writer, ServiceStats* stats)
+        : writer_(writer), stats_(stats) {}
+
+    // Read up to |bytes| of patch from |stream_fd| and apply it. Patches may
+    // be split across calls at any byte. Returns the number of bytes read,
+    // which is less than |bytes| if the writer stopped (the rest may be
+    // applied by a later call), or -1 if the patch is malformed.
+    int64_t Apply(int stream_fd, int64_t bytes);
+
+    // True between operations, when plain image data may be committed.
+    bool idle() const { return !header_filled_ && !op_remaining_; }
+
+  private:
+    static constexpr uint64_t kBlockSize = 4096;
+
+    bool ReadHeader(int stream_fd, uint64_t bytes, uint64_t* consumed);
+    bool StartOp();
+    bool ContinueOp(int stream_fd, uint64_t bytes, uint64_t* consumed);
+
+    PartitionWriter* writer_;
+    ServiceStats* stats_;
+    // Set once the patch is found to be malformed; nothing more is applied.
+    bool failed_ = false;
+
+    DeltaOpHeader op_ = {};
+    size_t header_filled_ = 0;
+    uint64_t op_remaining_ = 0;
+};
+
+}  // namespace gsi
+}  // namespace android
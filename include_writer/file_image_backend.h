@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <set>
+#include <string>
+
+#include "image_backend.h"
+
+namespace android {
+namespace gsi {
+
+// ImageBackend that keeps each image as a plain file, <dir>/<name>.img, and
+// writes to it directly. It needs no device-mapper or pinning support, so it
+// runs on any Linux host; it is used to benchmark the write engine.
+class FileImageBackend final : public ImageBackend {
+  public:
+    explicit FileImageBackend(const std::string& dir, bool sparse = true);
+
+    bool BackingImageExists(const std::string& name) override;
+    bool CreateBackingImage(const std::string& name, uint64_t size, bool readonly,
+                            ProgressCallback&& on_progress) override;
+    bool ExtendBackingImage(const std::string& name, uint64_t size,
+                            ProgressCallback&& on_progress) override;
+    bool DeleteBackingImage(const std::string& name) override;
+    bool CanReuseBackingImage(const ImageSpec& image) override;
+    uint64_t GetImageAllocation(const std::string& name) override;
+    bool IsImageMapped(const std::string& name) override;
+    bool UnmapImageDevice(const std::string& name) override;
+    bool UnmapImageIfExists(const std::string& name) override;
+    std::unique_ptr<ImageDevice> OpenImageDevice(const std::string& name) override;
+    bool Validate() override;
+
+    std::string GetImagePath(const std::string& name) const;
+
+  private:
+    std::string dir_;
+    // If false, images are fully allocated with fallocate() when created.
+    bool sparse_;
+    // Images with an open device.
+    std::set<std::string> mapped_;
+};
+
+}  // namespace gsi
+}  // namespace android
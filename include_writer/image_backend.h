@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace gsi {
+
+// A partition image opened for I/O, for example by mapping it as a block
+// device. Closing the device (destroying the object) releases the mapping.
+class ImageDevice {
+  public:
+    virtual ~ImageDevice() = default;
+
+    virtual int fd() = 0;
+    virtual const std::string& path() = 0;
+};
+
+// Size of an image opened as either a block device or a regular file, or 0
+// on error.
+uint64_t GetImageSize(int fd);
+
+// Storage for partition images. PartitionInstaller only talks to images
+// through this interface, so that its write engine can run against
+// something other than libfiemap (such as plain files on a host).
+class ImageBackend {
+  public:
+    // Invoked with (current, total) bytes; returning false aborts.
+    using ProgressCallback = std::function<bool(uint64_t, uint64_t)>;
+
+    struct ImageSpec {
+        std::string name;
+        uint64_t size;
+        bool readonly;
+    };
+
+    // Where an image's data lives on the backing storage. A mapped image
+    // has one device-mapper target per extent.
+    struct ImageLayout {
+        uint64_t extents = 0;
+        uint64_t bytes = 0;
+    };
+
+    virtual ~ImageBackend() = default;
+
+    virtual bool BackingImageExists(const std::string& name) = 0;
+    virtual bool CreateBackingImage(const std::string& name, uint64_t size, bool readonly,
+                                    ProgressCallback&& on_progress) = 0;
+    // Create several images at once, reporting their combined progress.
+    // Either every image is created, or none are. By default the images are
+    // created concurrently with CreateBackingImage(), which suits backends
+    // whose images are independent of each other.
+    virtual bool CreateBackingImages(const std::vector<ImageSpec>& images,
+                                     ProgressCallback&& on_progress);
+    // Grow an unmapped, writable image to |size| bytes, keeping its
+    // contents.
+    virtual bool ExtendBackingImage(const std::string& name, uint64_t size,
+                                    ProgressCallback&& on_progress) = 0;
+    virtual bool DeleteBackingImage(const std::string& name) = 0;
+    // True if an existing image can stand in for a new one created with
+    // |image|, keeping its allocation. Its contents are left as they are.
+    virtual bool CanReuseBackingImage(const ImageSpec& image) = 0;
+    // Bytes of storage that deleting |name| would free: none if it does not
+    // exist, or if its storage is shared with another image.
+    virtual uint64_t GetImageAllocation(const std::string& name) = 0;
+    virtual bool IsImageMapped(const std::string& name) = 0;
+    virtual bool UnmapImageDevice(const std::string& name) = 0;
+    virtual bool UnmapImageIfExists(const std::string& name) = 0;
+    virtual std::unique_ptr<ImageDevice> OpenImageDevice(const std::string& name) = 0;
+    // Check that the backing storage of every image is still valid.
+    virtual bool Validate() = 0;
+    // Change whether |name| is mapped read-only, from the next time it is
+    // mapped. Backends that do not record this return false.
+    virtual bool SetImageReadOnly(const std::string& /* name */, bool /* readonly */) {
+        return false;
+    }
+    // Backends that do not track extents return false.
+    virtual bool GetImageLayout(const std::string& /* name */, ImageLayout* /* layout */) {
+        return false;
+    }
+    // An image can be allocated again as GetReplacementName(name) while it
+    // still holds its own extents, so that the new allocation cannot be
+    // handed them back. Replace |name| with that image. Deleting |name|
+    // also deletes a replacement left behind. Backends that do not track
+    // extents return false.
+    static std::string GetReplacementName(const std::string& name) { return name + ".new"; }
+    virtual bool ReplaceBackingImage(const std::string& /* name */) { return false; }
+
+    // Read-only images can be shared between DSU slots on the same
+    // filesystem. A complete image is published under the SHA-256 |digest|
+    // of its contents, and other slots then refer to the same storage
+    // instead of writing their own copy. The storage is freed once no slot
+    // uses it. Backends without support for this return false.
+    virtual bool ShareBackingImage(const std::string& /* name */,
+                                   const std::string& /* digest */) {
+        return false;
+    }
+    // If an image with |digest| and |size| has been published, make |name|
+    // refer to it, replacing any existing image of that name.
+    virtual bool LinkSharedImage(const std::string& /* digest */, const std::string& /* name */,
+                                 uint64_t /* size */) {
+        return false;
+    }
+
+    // Storage may be reserved ahead of time in a pool of pinned chunks on
+    // the same filesystem. Create |name| from as much of the pool as it can
+    // take, allocating only the rest, which is much faster than allocating
+    // the whole image. Returns false, leaving nothing behind, if there is
+    // no pool to use; the caller then creates the image as usual.
+    virtual bool CreateBackingImageFromPool(const std::string& /* name */, uint64_t /* size */,
+                                            bool /* readonly */) {
+        return false;
+    }
+};
+
+// Calls |create| for each of |images| on a thread of its own, passing it
+// the image's index and a progress callback. Progress is summed across the
+// images before being passed to |on_progress|, and once any image fails or
+// |on_progress| returns false, the callbacks of the rest return false too.
+// |created| is set to which images were created, for the caller to clean up
+// after a failure.
+bool CreateImagesConcurrently(
+        const std::vector<ImageBackend::ImageSpec>& images,
+        const std::function<bool(size_t, ImageBackend::ProgressCallback&&)>& create,
+        ImageBackend::ProgressCallback&& on_progress, std::vector<bool>* created);
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "image_backend.h"
+
+namespace android {
+namespace gsi {
+
+// We are looking for /data to have at least 40% free space before an
+// install allocates its images.
+static constexpr uint32_t kMinimumFreeSpaceThreshold = 40;
+
+// The storage accounting behind an install plan (see InstallPlan.aidl for
+// what each field means), kept apart from where the numbers come from.
+struct InstallSpace {
+    int64_t required = 0;
+    int64_t replaced = 0;
+    int64_t pool = 0;
+    int64_t reclaimable = 0;
+    int64_t free = 0;
+    int64_t total = 0;
+    int64_t headroom = 0;
+    bool needs_reclaim = false;
+    // Names of the images the install replaces.
+    std::set<std::string> replaced_images;
+};
+
+enum class SpaceCheck {
+    kOk,
+    kNoSpace,
+    kCluttered,
+};
+
+// Account for creating |images| in |backend|. Images it can reuse need no
+// space, and the ones it replaces are counted as free, as is the part of
+// |pool_bytes| the images can take in whole |chunk_size| chunks.
+void AccountInstallImages(ImageBackend* backend, const std::vector<ImageBackend::ImageSpec>& images,
+                          uint64_t pool_bytes, uint64_t chunk_size, InstallSpace* space);
+
+// Account for the disabled image |name| of |backend|, which removing it
+// would free. |own_slot| is true if |backend| holds the slot being
+// installed, whose replaced images are already counted.
+void AccountDisabledImage(ImageBackend* backend, const std::string& name, bool own_slot,
+                          InstallSpace* space);
+
+// The rules an install must meet with |available| bytes free: it must fit,
+// and /data must not be so full that pinning its images would fragment it.
+SpaceCheck CheckFreeSpace(const InstallSpace& space, int64_t available);
+
+// Decide whether the install fits, with |free| and |total| filled in. If it
+// only fits once the disabled images are removed, |needs_reclaim| is set.
+// Sets |headroom| either way.
+SpaceCheck CheckInstallSpace(InstallSpace* space);
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "service_stats.h"
+
+namespace android {
+namespace gsi {
+
+// How aggressively an install may use the disk. The values match the
+// IGsiService::INSTALL_QOS_* constants.
+enum class InstallQos {
+    kForeground = 0,
+    kBackground = 1,
+    kIdle = 2,
+};
+
+// Lowers the I/O priority of the calling thread for its lifetime, and
+// restores the previous priority afterwards. Background installs use the
+// lowest best-effort level, and idle installs the idle class, which only
+// gets disk time nobody else wants. Foreground installs are left alone.
+class ScopedIoPriority final {
+  public:
+    explicit ScopedIoPriority(InstallQos qos);
+    ~ScopedIoPriority();
+
+    ScopedIoPriority(const ScopedIoPriority&) = delete;
+    ScopedIoPriority& operator=(const ScopedIoPriority&) = delete;
+
+  private:
+    // The ioprio value to restore, or -1 if nothing was changed.
+    int saved_ = -1;
+};
+
+// A token bucket limiting how fast an install writes to disk. The rate
+// backs off (halves) whenever the average read latency of the underlying
+// block device exceeds a target, and creeps back up (additively) while it
+// stays below. Reads are used as the signal since an install is almost all
+// writes, so read latency mostly reflects what other apps see.
+class IoThrottle final {
+  public:
+    struct Options {
+        // Bounds and starting point of the rate, in bytes per second.
+        uint64_t min_rate;
+        uint64_t max_rate;
+        // Average read latency above which the rate is cut.
+        std::chrono::microseconds target_latency;
+    };
+
+    // Returns null for foreground installs, which are never throttled.
+    // |dir| is where the images live; its block device is monitored.
+    static std::unique_ptr<IoThrottle> ForQos(InstallQos qos, const std::string& dir,
+                                              ServiceStats* stats);
+
+    // |stat_file| is the sysfs stat file of a block device. If it cannot be
+    // read, the rate stays fixed at |options.max_rate|.
+    IoThrottle(const std::string& stat_file, const Options& options, ServiceStats* stats);
+
+    // Block until |bytes| more may be written. The wait ends early, with the
+    // bytes still owed, once |should_abort| returns true; it is polled
+    // between slices of the wait.
+    void Acquire(uint64_t bytes, const std::function<bool()>& should_abort = nullptr);
+
+    uint64_t rate() const { return rate_; }
+
+  private:
+    bool ReadDeviceStats(uint64_t* reads, uint64_t* read_ms);
+    void Adapt(std::chrono::steady_clock::time_point now);
+
+    std::string stat_file_;
+    Options options_;
+    ServiceStats* stats_;
+
+    uint64_t rate_;
+    // May go negative; the writer then sleeps until it is paid back.
+    double tokens_ = 0;
+    std::chrono::steady_clock::time_point last_refill_;
+
+    bool has_device_stats_ = false;
+    uint64_t last_reads_ = 0;
+    uint64_t last_read_ms_ = 0;
+    std::chrono::steady_clock::time_point last_sample_;
+};
+
+}  // namespace gsi
+}  // namespace android
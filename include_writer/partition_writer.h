@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+
+#include <android-base/unique_fd.h>
+
+#include "image_backend.h"
+#include "io_throttle.h"
+#include "service_stats.h"
+
+namespace android {
+namespace gsi {
+
+// Destroy the first 1MiB of an image, ensuring both the first block and an
+// ext4 superblock are erased.
+bool WipeImageDevice(ImageDevice* device);
+
+// Streams image data into an open ImageDevice, keeping track of how much has
+// been written and enforcing the image size. This is the write engine behind
+// PartitionInstaller; it has no dependency on binder or libfiemap.
+class PartitionWriter final {
+  public:
+    struct Callbacks {
+        // Invoked with the total number of bytes written whenever progress,
+        // in permille, changes during a stream commit.
+        std::function<void(uint64_t)> on_progress;
+        // Polled before each read from a stream, and before each buffer is
+        // committed; returning true aborts the commit. Data is never read
+        // without being written, so a stream is left positioned exactly
+        // bytes_written() from where the image started.
+        std::function<bool()> should_abort;
+    };
+
+    struct Options {
+        // Write through a second, O_DIRECT descriptor for the device, so
+        // that image data bypasses the page cache. Data is staged into
+        // aligned buffers whose size adapts to the observed throughput.
+        // Falls back to buffered writes if the device does not support it.
+        bool direct_io = false;
+        // For buffered writes, start writeback of each window of this many
+        // bytes once it is complete, and wait for the window before it. This
+        // bounds the dirty data left for Flush(). Zero disables it.
+        uint64_t writeback_window = 0;
+        // If set, every write to the device is paced by this throttle.
+        IoThrottle* throttle = nullptr;
+    };
+
+    PartitionWriter(std::unique_ptr<ImageDevice>&& device, uint64_t size, ServiceStats* stats,
+                    Callbacks&& callbacks, const Options& options);
+    PartitionWriter(std::unique_ptr<ImageDevice>&& device, uint64_t size, ServiceStats* stats,
+                    Callbacks&& callbacks)
+        : PartitionWriter(std::move(device), size, stats, std::move(callbacks), Options{}) {}
+    ~PartitionWriter();
+
+    // Read |bytes| from |stream_fd| and write them to the image.
+    bool CommitChunk(int stream_fd, int64_t bytes);
+    bool CommitChunk(const void* data, size_t bytes);
+
+    // Write |bytes| read from |source_offset| of the image itself, which
+    // must not be before the current position. Used by delta installs.
+    bool CopyChunk(uint64_t source_offset, uint64_t bytes);
+    // Move past |bytes| of the image, keeping what is already there.
+    bool SkipChunk(uint64_t bytes);
+    bool ZeroChunk(uint64_t bytes);
+
+    // Polls Callbacks::should_abort.
+    bool ShouldAbort();
+
+    bool MapAshmem(int fd, size_t size);
+    // Write |bytes| from the start of the mapped ashmem region to the image.
+    bool CommitAshmemChunk(size_t bytes);
+    bool IsAshmemMapped() const { return ashmem_data_ != MAP_FAILED; }
+    void UnmapAshmem();
+
+    // Flush all written data to storage.
+    bool Flush();
+
+    bool IsFinishedWriting() const { return bytes_written_ == size_; }
+    bool IsDirect() const { return direct_fd_ >= 0; }
+    uint64_t bytes_written() const { return bytes_written_; }
+    uint64_t size() const { return size_; }
+    int fd() const { return device_->fd(); }
+
+  private:
+    static constexpr size_t kBlockSize = 4096;
+    // Bounds for the adaptive O_DIRECT write size.
+    static constexpr size_t kMinDirectChunkSize = 64 * 1024;
+    static constexpr size_t kMaxDirectChunkSize = 4 * 1024 * 1024;
+    // Size of the buffer used by CopyChunk() and ZeroChunk().
+    static constexpr size_t kCopyBufferSize = 1024 * 1024;
+
+    bool CheckChunk(uint64_t bytes);
+    void UpdateProgress();
+    bool WriteChunk(const uint8_t* data, size_t bytes);
+    void Throttle(size_t bytes);
+    void Account(size_t bytes);
+    bool WriteBuffered(const uint8_t* data, size_t bytes);
+    void WriteBehind();
+    void DisableDirectIo();
+    bool WriteDirect(const uint8_t* data, size_t bytes);
+    bool Stage(const uint8_t* data, size_t bytes);
+    // Write out the aligned part of the staging buffer. If |final|, the
+    // unaligned tail is written too, through the buffered descriptor.
+    bool WriteStaged(bool final);
+    void AdaptDirectChunkSize(size_t bytes, std::chrono::steady_clock::duration elapsed);
+
+    std::unique_ptr<ImageDevice> device_;
+    uint64_t size_;
+    ServiceStats* stats_;
+    Callbacks callbacks_;
+
+    // Bytes accepted from the client, and bytes written to the device. They
+    // differ by the data held in the staging buffer.
+    uint64_t bytes_written_ = 0;
+    uint64_t device_offset_ = 0;
+    // Last progress reported, in permille.
+    int progress_ = -1;
+    std::unique_ptr<uint8_t[]> copy_buffer_;
+    size_t ashmem_size_ = 0;
+    void* ashmem_data_ = MAP_FAILED;
+
+    IoThrottle* throttle_;
+
+    uint64_t writeback_window_;
+    // Start of the first window whose writeback has not been started.
+    uint64_t writeback_offset_ = 0;
+
+    android::base::unique_fd direct_fd_;
+    uint8_t* staging_ = nullptr;
+    size_t staged_ = 0;
+    size_t direct_chunk_size_ = 256 * 1024;
+    // State of the hill climb in AdaptDirectChunkSize().
+    bool grow_direct_chunk_ = true;
+    double last_direct_throughput_ = 0;
+    size_t window_writes_ = 0;
+    uint64_t window_bytes_ = 0;
+    std::chrono::steady_clock::duration window_time_{};
+};
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+
+namespace android {
+namespace gsi {
+
+// A lock-free histogram with power-of-two buckets. Values are recorded in
+// microseconds by convention, but any unit works.
+class Histogram final {
+  public:
+    void Record(uint64_t value);
+    void Record(std::chrono::steady_clock::duration duration);
+
+    // Approximate percentile (0-100), reported as the upper bound of the
+    // bucket containing it.
+    uint64_t Percentile(double percentile) const;
+    uint64_t count() const { return count_; }
+    uint64_t sum() const { return sum_; }
+    uint64_t max() const { return max_; }
+
+    std::string ToString() const;
+
+  private:
+    static constexpr size_t kNumBuckets = 64;
+
+    std::array<std::atomic<uint64_t>, kNumBuckets> buckets_ = {};
+    std::atomic<uint64_t> count_ = 0;
+    std::atomic<uint64_t> sum_ = 0;
+    std::atomic<uint64_t> max_ = 0;
+};
+
+// Measures the time between construction and destruction (or Stop()).
+class ScopedTimer final {
+  public:
+    explicit ScopedTimer(Histogram* histogram);
+    ~ScopedTimer() { Stop(); }
+
+    std::chrono::steady_clock::duration Stop();
+
+  private:
+    Histogram* histogram_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// Contention statistics for a mutex.
+struct LockStats {
+    // Name of the trace counter tracking the number of waiters.
+    const char* waiters_counter;
+    Histogram wait_us;
+    std::atomic<int64_t> waiters = 0;
+};
+
+// A lock_guard that records how long it waited to acquire the mutex.
+class TimedLockGuard final {
+  public:
+    TimedLockGuard(std::mutex& lock, LockStats* stats);
+    ~TimedLockGuard() { lock_.unlock(); }
+
+    TimedLockGuard(const TimedLockGuard&) = delete;
+    TimedLockGuard& operator=(const TimedLockGuard&) = delete;
+
+  private:
+    std::mutex& lock_;
+};
+
+// Counters collected over the lifetime of gsid, reported by
+// GsiService::dump().
+struct ServiceStats {
+    // Data written into partition images by CommitGsiChunk.
+    std::atomic<uint64_t> bytes_committed = 0;
+    // Latency of each write into the mapped partition.
+    Histogram chunk_write_us;
+    // Time spent in CommitGsiChunk, split between reading the source stream
+    // and writing to the partition.
+    std::atomic<uint64_t> commit_read_ns = 0;
+    std::atomic<uint64_t> commit_write_ns = 0;
+    // Data written with O_DIRECT, and the current adaptive write size.
+    std::atomic<uint64_t> direct_bytes_written = 0;
+    std::atomic<uint64_t> direct_chunk_size = 0;
+    // Time spent waiting for write-behind of buffered writes.
+    Histogram writeback_wait_us;
+    // Background install throttling: the current write rate limit, in bytes
+    // per second, and time spent waiting on it.
+    std::atomic<uint64_t> throttle_rate = 0;
+    Histogram throttle_wait_us;
+    // Delta installs: image data left in place, copied from elsewhere in
+    // the previous image, and sent in the patch.
+    std::atomic<uint64_t> delta_kept_bytes = 0;
+    std::atomic<uint64_t> delta_copied_bytes = 0;
+    std::atomic<uint64_t> delta_data_bytes = 0;
+    // Block hash manifests computed for incremental reflashes.
+    std::atomic<uint64_t> block_hash_bytes = 0;
+    std::atomic<uint64_t> block_hash_ns = 0;
+    // Duration of the fsync in PartitionInstaller::Finish().
+    Histogram finish_fsync_us;
+    // Backing image allocation (CreateBackingImage).
+    std::atomic<uint64_t> create_image_bytes = 0;
+    std::atomic<uint64_t> create_image_ns = 0;
+    // Existing images kept instead of being deleted and allocated again.
+    std::atomic<uint64_t> reused_image_bytes = 0;
+    // Read-only images linked to a copy shared by another slot.
+    std::atomic<uint64_t> shared_image_bytes = 0;
+    // Images created from the pre-reserved image pool.
+    std::atomic<uint64_t> pool_image_bytes = 0;
+    // Extents of each newly allocated image, and the allocations that were
+    // redone because an image was too fragmented.
+    Histogram image_extents;
+    std::atomic<uint64_t> reallocated_images = 0;
+    // Deferred deletion of removed slots: the space freed, how long each
+    // image took to delete, and the freed blocks that were discarded.
+    std::atomic<uint64_t> reaped_image_bytes = 0;
+    Histogram delete_image_us;
+    std::atomic<uint64_t> discarded_bytes = 0;
+    // Contention on GsiService::lock_ and progress_lock_.
+    LockStats lock{"gsid.lock_waiters"};
+    LockStats progress_lock{"gsid.progress_lock_waiters"};
+
+    // Count a call to |method| of the interface named by |prefix|. Both
+    // must be string constants, such as __func__: calls are told apart by
+    // pointer, so that counting takes no lock once a method has been seen.
+    void RecordBinderCall(const char* method, const char* prefix = "");
+    std::string ToString() const;
+
+  private:
+    static constexpr size_t kMaxBinderMethods = 128;
+
+    struct BinderCallCount {
+        const char* prefix = nullptr;
+        const char* method = nullptr;
+        std::atomic<uint64_t> count = 0;
+    };
+
+    // Entries are only ever appended, under binder_calls_lock_, and are
+    // published by incrementing num_binder_calls_.
+    std::array<BinderCallCount, kMaxBinderMethods> binder_calls_;
+    std::atomic<size_t> num_binder_calls_ = 0;
+    std::mutex binder_calls_lock_;
+};
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "install_planner.h"
+
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include <functional>
+#include <utility>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android/gsi/IGsiService.h>
+
+#include "fiemap_image_backend.h"
+#include "file_paths.h"
+#include "gsi_service.h"
+#include "gsi_trace.h"
+
+namespace android {
+namespace gsi {
+
+// libsnapshot keeps the images of OTA updates here, and may leave them
+// disabled when they cannot be deleted right away.
+static constexpr char kOtaMetadataDir[] = "/metadata/gsi/ota";
+static constexpr char kOtaDataDir[] = "/data/gsi/ota";
+
+using DisabledImageCallback =
+        std::function<void(FiemapImageBackend* images, const std::string& name, bool own_slot)>;
+
+// Calls |fn| for each disabled image whose storage is on the filesystem of
+// |install_dir|.
+static void ForEachDisabledImage(const std::string& active_dsu, const std::string& install_dir,
+                                 const DisabledImageCallback& fn) {
+    std::vector<std::pair<std::string, std::string>> dirs = {
+            {MetadataDir(active_dsu), install_dir},
+    };
+    for (const auto& slot : GsiService::GetInstalledDsuSlots()) {
+        std::string data_dir;
+        if (slot != active_dsu &&
+            android::base::ReadFileToString(DsuInstallDirFile(slot), &data_dir)) {
+            dirs.emplace_back(MetadataDir(slot), data_dir);
+        }
+    }
+    dirs.emplace_back(kOtaMetadataDir, kOtaDataDir);
+
+    struct stat install_dir_stat;
+    if (stat(install_dir.c_str(), &install_dir_stat)) {
+        return;
+    }
+    for (size_t i = 0; i < dirs.size(); i++) {
+        const auto& [metadata_dir, data_dir] = dirs[i];
+        struct stat s;
+        if (access((metadata_dir + "/lp_metadata").c_str(), F_OK) ||
+            stat(data_dir.c_str(), &s) || s.st_dev != install_dir_stat.st_dev) {
+            continue;
+        }
+        auto images = FiemapImageBackend::Open(metadata_dir, data_dir);
+        if (!images) {
+            continue;
+        }
+        for (const auto& name : images->GetDisabledImages()) {
+            fn(images.get(), name, i == 0);
+        }
+    }
+}
+
+static int ToInstallStatus(SpaceCheck check) {
+    switch (check) {
+        case SpaceCheck::kOk:
+            return IGsiService::INSTALL_OK;
+        case SpaceCheck::kNoSpace:
+            return IGsiService::INSTALL_ERROR_NO_SPACE;
+        case SpaceCheck::kCluttered:
+            return IGsiService::INSTALL_ERROR_FILE_SYSTEM_CLUTTERED;
+    }
+    return IGsiService::INSTALL_ERROR_GENERIC;
+}
+
+static void ToInstallPlan(const InstallSpace& space, InstallPlan* plan) {
+    plan->requiredBytes = space.required;
+    plan->replacedBytes = space.replaced;
+    plan->poolBytes = space.pool;
+    plan->reclaimableBytes = space.reclaimable;
+    plan->freeBytes = space.free;
+    plan->totalBytes = space.total;
+    plan->headroomBytes = space.headroom;
+    plan->needsReclaim = space.needs_reclaim;
+}
+
+int CheckGrowthHeadroom(const std::string& install_dir, uint64_t bytes) {
+    struct statvfs sb;
+    if (statvfs(install_dir.c_str(), &sb)) {
+        PLOG(ERROR) << "failed to read file system stats";
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    uint64_t free_space = 1ULL * sb.f_bavail * sb.f_frsize;
+    uint64_t reserve = 1ULL * sb.f_blocks * sb.f_frsize * kMinimumFreeSpaceThreshold / 100;
+    if (free_space < reserve + bytes) {
+        LOG(ERROR) << "growing by " << bytes << " bytes would leave too little free space (only "
+                   << free_space << " bytes available)";
+        return IGsiService::INSTALL_ERROR_NO_SPACE;
+    }
+    return IGsiService::INSTALL_OK;
+}
+
+static int PlanInstallSpace(const std::string& active_dsu, const std::string& install_dir,
+                            const std::vector<ImageBackend::ImageSpec>& images,
+                            InstallSpace* space) {
+    *space = {};
+    auto backend = FiemapImageBackend::Open(MetadataDir(active_dsu), install_dir);
+    if (!backend) {
+        LOG(ERROR) << "unable to create image manager";
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    // Images that map through loop devices are not built from the pool.
+    uint64_t pool = FiemapImageBackend::CanMapExtents(install_dir)
+                            ? FiemapImageBackend::GetImagePoolSize(install_dir)
+                            : 0;
+    AccountInstallImages(backend.get(), images, pool, FiemapImageBackend::kImagePoolChunkSize,
+                         space);
+    ForEachDisabledImage(active_dsu, install_dir,
+                         [&](FiemapImageBackend* images, const std::string& name, bool own_slot) {
+                             AccountDisabledImage(images, name, own_slot, space);
+                         });
+
+    // This is the same as android::vold::GetFreebytes() but we also
+    // need the total file system size so we open code it here.
+    struct statvfs sb;
+    if (statvfs(install_dir.c_str(), &sb)) {
+        PLOG(ERROR) << "failed to read file system stats";
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    space->free = 1LL * sb.f_bavail * sb.f_frsize;
+    space->total = 1LL * sb.f_blocks * sb.f_frsize;
+    return ToInstallStatus(CheckInstallSpace(space));
+}
+
+int PlanInstall(const std::string& active_dsu, const std::string& install_dir,
+                const std::vector<ImageBackend::ImageSpec>& images, InstallPlan* plan) {
+    GSI_TRACE_CALL();
+    InstallSpace space;
+    int status = PlanInstallSpace(active_dsu, install_dir, images, &space);
+    ToInstallPlan(space, plan);
+    return status;
+}
+
+int AdmitInstall(const std::string& active_dsu, const std::string& install_dir,
+                 const std::vector<ImageBackend::ImageSpec>& images, InstallPlan* plan) {
+    GSI_TRACE_CALL();
+    InstallSpace space;
+    int status = PlanInstallSpace(active_dsu, install_dir, images, &space);
+    if (status == IGsiService::INSTALL_OK && space.needs_reclaim) {
+        LOG(INFO) << "removing disabled images to free " << space.reclaimable << " bytes";
+        ForEachDisabledImage(active_dsu, install_dir,
+                             [](FiemapImageBackend* images, const std::string& name, bool) {
+                                 if (!images->DeleteBackingImage(name)) {
+                                     LOG(ERROR) << "could not remove disabled image " << name;
+                                 }
+                             });
+        status = PlanInstallSpace(active_dsu, install_dir, images, &space);
+        // Whatever could not be removed is no help.
+        if (status == IGsiService::INSTALL_OK && space.needs_reclaim) {
+            status = ToInstallStatus(
+                    CheckFreeSpace(space, space.free + space.replaced + space.pool));
+        }
+    }
+    if (status == IGsiService::INSTALL_ERROR_NO_SPACE) {
+        LOG(ERROR) << "not enough free space: the install needs " << space.required
+                   << " bytes, and only " << space.free << " are available, plus "
+                   << space.replaced << " held by the images it replaces and " << space.pool
+                   << " in the image pool";
+    } else if (status == IGsiService::INSTALL_ERROR_FILE_SYSTEM_CLUTTERED) {
+        auto percent = (space.free + space.replaced + space.pool) * 100 / space.total;
+        LOG(ERROR) << "free space " << percent << "% is below the minimum threshold of "
+                   << kMinimumFreeSpaceThreshold << "%";
+    } else if (status == IGsiService::INSTALL_OK) {
+        LOG(INFO) << "install needs " << space.required << " bytes, leaving " << space.headroom
+                  << " bytes free";
+    }
+    ToInstallPlan(space, plan);
+    return status;
+}
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <android/gsi/InstallPlan.h>
+
+#include "image_backend.h"
+#include "install_space.h"
+
+namespace android {
+namespace gsi {
+
+// Work out whether creating |images| in DSU slot |active_dsu| fits on the
+// filesystem of |install_dir|, without allocating anything. Images the slot
+// can reuse need no space, and the ones it replaces are counted as free, as
+// is the part of the image pool the images can be created from.
+// Disabled images (see IImageService.removeDisabledImages()) of any slot on
+// the same filesystem, and of OTA updates, can be removed to make room.
+//
+// Returns INSTALL_OK if the install fits, possibly only after reclaiming
+// (plan->needsReclaim), INSTALL_ERROR_NO_SPACE or
+// INSTALL_ERROR_FILE_SYSTEM_CLUTTERED if it does not, or
+// INSTALL_ERROR_GENERIC.
+int PlanInstall(const std::string& active_dsu, const std::string& install_dir,
+                const std::vector<ImageBackend::ImageSpec>& images, InstallPlan* plan);
+
+// Check that allocating |bytes| more, outside of an install, leaves at
+// least kMinimumFreeSpaceThreshold of the filesystem free.
+int CheckGrowthHeadroom(const std::string& install_dir, uint64_t bytes);
+
+// As PlanInstall(), but also removes the disabled images if the install
+// needs their space, and then plans again.
+int AdmitInstall(const std::string& active_dsu, const std::string& install_dir,
+                 const std::vector<ImageBackend::ImageSpec>& images, InstallPlan* plan);
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "install_space.h"
+
+#include <algorithm>
+
+namespace android {
+namespace gsi {
+
+void AccountInstallImages(ImageBackend* backend, const std::vector<ImageBackend::ImageSpec>& images,
+                          uint64_t pool_bytes, uint64_t chunk_size, InstallSpace* space) {
+    for (const auto& image : images) {
+        if (backend->CanReuseBackingImage(image)) {
+            continue;
+        }
+        space->required += image.size;
+        space->replaced += backend->GetImageAllocation(image.name);
+        space->replaced_images.emplace(image.name);
+        // Images take whole chunks of the pool.
+        uint64_t from_pool = std::min(pool_bytes, image.size / chunk_size * chunk_size);
+        space->pool += from_pool;
+        pool_bytes -= from_pool;
+    }
+}
+
+void AccountDisabledImage(ImageBackend* backend, const std::string& name, bool own_slot,
+                          InstallSpace* space) {
+    // A disabled image the install replaces is already counted.
+    if (!own_slot || !space->replaced_images.count(name)) {
+        space->reclaimable += backend->GetImageAllocation(name);
+    }
+}
+
+SpaceCheck CheckFreeSpace(const InstallSpace& space, int64_t available) {
+    if (available <= space.required) {
+        return SpaceCheck::kNoSpace;
+    }
+    if (available * 100 < space.total * kMinimumFreeSpaceThreshold) {
+        return SpaceCheck::kCluttered;
+    }
+    return SpaceCheck::kOk;
+}
+
+SpaceCheck CheckInstallSpace(InstallSpace* space) {
+    int64_t available = space->free + space->replaced + space->pool;
+    auto status = CheckFreeSpace(*space, available);
+    space->needs_reclaim = false;
+    if (status != SpaceCheck::kOk &&
+        CheckFreeSpace(*space, available + space->reclaimable) == SpaceCheck::kOk) {
+        space->needs_reclaim = true;
+        available += space->reclaimable;
+        status = SpaceCheck::kOk;
+    }
+    space->headroom = available - space->required;
+    return status;
+}
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "io_throttle.h"
+
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <sstream>
+#include <thread>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+
+#include "gsi_trace.h"
+
+namespace android {
+namespace gsi {
+
+using android::base::StringPrintf;
+using std::chrono::steady_clock;
+
+// From linux/ioprio.h, which is not exported by every libc.
+static constexpr int kIoprioClassShift = 13;
+static constexpr int kIoprioClassBe = 2;
+static constexpr int kIoprioClassIdle = 3;
+static constexpr int kIoprioWhoProcess = 1;
+static constexpr int kIoprioLowestBeLevel = 7;
+
+// How often the device latency is sampled, and the fewest reads in a sample
+// for its latency to count. Fewer reads than that means the disk is not
+// busy with anyone else, and the install may speed up.
+static constexpr auto kSampleInterval = std::chrono::milliseconds(500);
+static constexpr uint64_t kMinSampleReads = 8;
+// Burst allowed after a quiet period, as time at the current rate.
+static constexpr auto kMaxBurst = std::chrono::milliseconds(100);
+// Longest sleep between checks for an abort.
+static constexpr auto kSleepSlice = std::chrono::milliseconds(50);
+
+ScopedIoPriority::ScopedIoPriority(InstallQos qos) {
+    int ioprio;
+    switch (qos) {
+        case InstallQos::kBackground:
+            ioprio = (kIoprioClassBe << kIoprioClassShift) | kIoprioLowestBeLevel;
+            break;
+        case InstallQos::kIdle:
+            ioprio = kIoprioClassIdle << kIoprioClassShift;
+            break;
+        default:
+            return;
+    }
+    // With IOPRIO_WHO_PROCESS, a |who| of zero means the calling thread.
+    int saved = syscall(SYS_ioprio_get, kIoprioWhoProcess, 0);
+    if (saved < 0) {
+        PLOG(WARNING) << "ioprio_get failed";
+        return;
+    }
+    if (syscall(SYS_ioprio_set, kIoprioWhoProcess, 0, ioprio)) {
+        PLOG(WARNING) << "ioprio_set failed";
+        return;
+    }
+    saved_ = saved;
+}
+
+ScopedIoPriority::~ScopedIoPriority() {
+    if (saved_ >= 0 && syscall(SYS_ioprio_set, kIoprioWhoProcess, 0, saved_)) {
+        PLOG(WARNING) << "ioprio_set failed";
+    }
+}
+
+std::unique_ptr<IoThrottle> IoThrottle::ForQos(InstallQos qos, const std::string& dir,
+                                               ServiceStats* stats) {
+    Options options;
+    switch (qos) {
+        case InstallQos::kBackground:
+            options = {
+                    .min_rate = 8 * 1024 * 1024,
+                    .max_rate = 256 * 1024 * 1024,
+                    .target_latency = std::chrono::milliseconds(10),
+            };
+            break;
+        case InstallQos::kIdle:
+            options = {
+                    .min_rate = 2 * 1024 * 1024,
+                    .max_rate = 64 * 1024 * 1024,
+                    .target_latency = std::chrono::milliseconds(5),
+            };
+            break;
+        default:
+            return nullptr;
+    }
+
+    std::string stat_file;
+    struct stat s;
+    if (stat(dir.c_str(), &s)) {
+        PLOG(WARNING) << "stat " << dir << ", I/O latency will not be monitored";
+    } else {
+        stat_file = StringPrintf("/sys/dev/block/%u:%u/stat", major(s.st_dev), minor(s.st_dev));
+    }
+    return std::make_unique<IoThrottle>(stat_file, options, stats);
+}
+
+IoThrottle::IoThrottle(const std::string& stat_file, const Options& options, ServiceStats* stats)
+    : stat_file_(stat_file),
+      options_(options),
+      stats_(stats),
+      rate_(options.max_rate),
+      last_refill_(steady_clock::now()),
+      last_sample_(last_refill_) {
+    if (!stat_file_.empty()) {
+        has_device_stats_ = ReadDeviceStats(&last_reads_, &last_read_ms_);
+    }
+    stats_->throttle_rate = rate_;
+}
+
+bool IoThrottle::ReadDeviceStats(uint64_t* reads, uint64_t* read_ms) {
+    // The first four fields are reads completed, reads merged, sectors read
+    // and milliseconds spent reading.
+    std::string content;
+    if (!android::base::ReadFileToString(stat_file_, &content)) {
+        PLOG(WARNING) << "read " << stat_file_ << ", I/O latency will not be monitored";
+        return false;
+    }
+    std::istringstream fields(content);
+    uint64_t merged, sectors;
+    if (!(fields >> *reads >> merged >> sectors >> *read_ms)) {
+        LOG(WARNING) << "could not parse " << stat_file_ << ", I/O latency will not be monitored";
+        return false;
+    }
+    return true;
+}
+
+void IoThrottle::Adapt(steady_clock::time_point now) {
+    if (!has_device_stats_ || now - last_sample_ < kSampleInterval) {
+        return;
+    }
+    uint64_t reads, read_ms;
+    if (!ReadDeviceStats(&reads, &read_ms)) {
+        has_device_stats_ = false;
+        return;
+    }
+    uint64_t sample_reads = reads - last_reads_;
+    uint64_t sample_ms = read_ms - last_read_ms_;
+    last_reads_ = reads;
+    last_read_ms_ = read_ms;
+    last_sample_ = now;
+
+    auto latency = std::chrono::milliseconds(sample_ms) / std::max(sample_reads, uint64_t(1));
+    if (sample_reads >= kMinSampleReads && latency > options_.target_latency) {
+        rate_ = std::max(rate_ / 2, options_.min_rate);
+    } else {
+        // Climbing from the minimum to the maximum takes a few seconds.
+        rate_ = std::min(rate_ + options_.max_rate / 16, options_.max_rate);
+    }
+    stats_->throttle_rate = rate_;
+    GSI_TRACE_INT64("gsid.throttle_rate", rate_);
+}
+
+void IoThrottle::Acquire(uint64_t bytes, const std::function<bool()>& should_abort) {
+    auto now = steady_clock::now();
+    Adapt(now);
+
+    double burst = rate_ * std::chrono::duration<double>(kMaxBurst).count();
+    tokens_ += rate_ * std::chrono::duration<double>(now - last_refill_).count();
+    tokens_ = std::min(tokens_, burst);
+    last_refill_ = now;
+
+    tokens_ -= bytes;
+    if (tokens_ >= 0) {
+        return;
+    }
+    // The sleep is paid for by the next refill. If it is cut short, the rest
+    // is paid by the next call.
+    GSI_TRACE_NAME("throttle");
+    ScopedTimer timer(&stats_->throttle_wait_us);
+    auto deadline = now + std::chrono::duration_cast<steady_clock::duration>(
+                                  std::chrono::duration<double>(-tokens_ / rate_));
+    while (true) {
+        if (should_abort && should_abort()) {
+            return;
+        }
+        auto left = deadline - steady_clock::now();
+        if (left <= steady_clock::duration::zero()) {
+            return;
+        }
+        std::this_thread::sleep_for(std::min<steady_clock::duration>(left, kSleepSlice));
+    }
+}
+
+}  // namespace gsi
+}  // namespace android
@@ -125,6 +125,23 @@ bool MarkSystemAsGsi() {
     return android::base::WriteStringToFile("1", kGsiBootedIndicatorFile);
 }
 
+bool GetUserdataSnapshot(const std::string& dsu_slot, UserdataSnapshot* snapshot) {
+    std::string contents;
+    if (!ReadFileToString(DsuUserdataSnapshotFile(dsu_slot), &contents)) {
+        return false;
+    }
+    // "<base> <cow> <chunk_sectors>"
+    auto fields = Split(android::base::Trim(contents), " ");
+    if (fields.size() != 3 || fields[0].empty() || fields[1].empty() ||
+        !android::base::ParseUint(fields[2], &snapshot->chunk_sectors) ||
+        !snapshot->chunk_sectors) {
+        return false;
+    }
+    snapshot->base = fields[0];
+    snapshot->cow = fields[1];
+    return true;
+}
+
 bool GetInstallStatus(std::string* status) {
     return android::base::ReadFileToString(kDsuInstallStatusFile, status);
 }
@@ -17,92 +17,169 @@
 #include "partition_installer.h"
 
 #include <sys/statvfs.h>
+#include <sys/wait.h>
+
+#include <algorithm>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/properties.h>
+#include <android-base/scopeguard.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
 #include <android-base/unique_fd.h>
-#include <ext4_utils/ext4_utils.h>
+#include <ext4_utils/ext4.h>
 #include <fs_mgr_dm_linear.h>
 #include <libdm/dm.h>
 #include <libgsi/libgsi.h>
 
+#include "block_hashes.h"
+#include "fiemap_image_backend.h"
 #include "file_paths.h"
 #include "gsi_service.h"
+#include "gsi_trace.h"
+#include "install_planner.h"
 #include "libgsi_private.h"
+#include "service_stats.h"
 
 namespace android {
 namespace gsi {
 
 using namespace std::literals;
 using namespace android::dm;
-using namespace android::fiemap;
 using namespace android::fs_mgr;
+using android::base::StringPrintf;
 using android::base::unique_fd;
 
-// The default size of userdata.img for GSI.
-// We are looking for /data to have atleast 40% free space
-static constexpr uint32_t kMinimumFreeSpaceThreshold = 40;
+// A read-only image allocated in more extents than this is allocated again,
+// up to kMaxAllocationAttempts times in all. gsid.max_image_extents
+// overrides the limit (0 disables it).
+static constexpr uint64_t kMaxImageExtents = 512;
+static constexpr uint32_t kMaxAllocationAttempts = 3;
+
+// The chunk size of a userdata snapshot (4KiB).
+static constexpr uint32_t kSnapshotChunkSectors = 8;
+
+// First-stage init does not stack userdata snapshots yet, and mounts their
+// base directly: the GSI would write to the base, and a reset would
+// restore nothing. Until it does, snapshots cannot be created or reset.
+static constexpr bool kUserdataSnapshotsMapped = false;
+
+// Thin userdata grows by this much at a time, once its filesystem is this
+// full.
+static constexpr uint64_t kThinUserdataGrowSize = 1024 * 1024 * 1024;
+static constexpr uint64_t kThinUserdataGrowPercent = 75;
+
+// A filesystem may fall short of its image by a partial block or a reserved
+// footer, which is not worth a resize.
+static constexpr uint64_t kResizeSlack = 1024 * 1024;
 
 PartitionInstaller::PartitionInstaller(GsiService* service, const std::string& install_dir,
                                        const std::string& name, const std::string& active_dsu,
-                                       int64_t size, bool read_only)
+                                       int64_t size, bool read_only, InstallQos qos)
     : service_(service),
       install_dir_(install_dir),
       name_(name),
       active_dsu_(active_dsu),
       size_(size),
-      readOnly_(read_only) {
-    images_ = ImageManager::Open(MetadataDir(active_dsu), install_dir_);
+      readOnly_(read_only),
+      qos_(qos) {
+    images_ = FiemapImageBackend::Open(MetadataDir(active_dsu), install_dir_);
 }
 
 PartitionInstaller::~PartitionInstaller() {
     Finish();
+    SaveInstallReport();
     if (!succeeded_) {
         // Close open handles before we remove files.
-        system_device_ = nullptr;
-        PostInstallCleanup(images_.get());
-    }
-    if (IsAshmemMapped()) {
-        UnmapAshmem();
+        patch_ = nullptr;
+        writer_ = nullptr;
+        if (images_) {
+            PostInstallCleanup(images_.get());
+        }
     }
 }
 
 void PartitionInstaller::PostInstallCleanup() {
-    auto manager = ImageManager::Open(MetadataDir(active_dsu_), install_dir_);
-    if (!manager) {
+    auto images = FiemapImageBackend::Open(MetadataDir(active_dsu_), install_dir_);
+    if (!images) {
         LOG(ERROR) << "Could not open image manager";
         return;
     }
-    return PostInstallCleanup(manager.get());
+    return PostInstallCleanup(images.get());
 }
 
-void PartitionInstaller::PostInstallCleanup(ImageManager* manager) {
+void PartitionInstaller::PostInstallCleanup(ImageBackend* images) {
     std::string file = GetBackingFile(name_);
-    if (manager->IsImageMapped(file)) {
+    if (images->IsImageMapped(file)) {
         LOG(ERROR) << "unmap " << file;
-        manager->UnmapImageDevice(file);
+        images->UnmapImageDevice(file);
     }
-    manager->DeleteBackingImage(file);
+    images->DeleteBackingImage(file);
 }
 
 int PartitionInstaller::StartInstall() {
-    if (int status = PerformSanityChecks()) {
-        return status;
+    GSI_TRACE_CALL();
+    auto end_failed_phase = android::base::make_scope_guard([this]() -> void { EndFailedPhase(); });
+    ScopedIoPriority priority(qos_);
+    if (readOnly_ && !digest_.empty() && LinkSharedImage()) {
+        succeeded_ = true;
+        return IGsiService::INSTALL_SHARED;
     }
-    if (int status = Preallocate()) {
-        return status;
+    if (!preallocated_) {
+        BeginPhase("checks");
+        if (int status = PerformSanityChecks()) {
+            return status;
+        }
+        InstallPlan plan;
+        if (int status = AdmitInstall(active_dsu_, install_dir_, {GetImageSpec()}, &plan)) {
+            return status;
+        }
+        EndPhase();
+        BeginPhase("allocate");
+        if (int status = Preallocate()) {
+            return status;
+        }
+        EndPhase(size_);
     }
     if (!readOnly_) {
+        BeginPhase("format");
         if (!Format()) {
             return IGsiService::INSTALL_ERROR_GENERIC;
         }
+        EndPhase();
         succeeded_ = true;
     } else {
         // Map ${name}_gsi so we can write to it.
-        system_device_ = OpenPartition(GetBackingFile(name_));
-        if (!system_device_) {
+        BeginPhase("map");
+        auto device = OpenPartition(GetBackingFile(name_));
+        if (!device) {
             return IGsiService::INSTALL_ERROR_GENERIC;
         }
+        PartitionWriter::Callbacks callbacks = {
+                .on_progress =
+                        [this](uint64_t bytes) -> void {
+                            service_->UpdateProgress(IGsiService::STATUS_WORKING, bytes);
+                        },
+                .should_abort =
+                        [this]() -> bool {
+                            return service_->should_abort() || service_->pause_requested();
+                        },
+        };
+        throttle_ = IoThrottle::ForQos(qos_, install_dir_, &service_->stats());
+        // O_DIRECT is opt-in until BM_ForegroundReadLatency shows it does not
+        // cost foreground reads more than buffered writes on real devices.
+        PartitionWriter::Options options = {
+                .direct_io = android::base::GetBoolProperty("gsid.direct_io", false),
+                .writeback_window =
+                        android::base::GetUintProperty<uint64_t>("gsid.writeback_window_mb", 8) *
+                        1024 * 1024,
+                .throttle = throttle_.get(),
+        };
+        writer_ = std::make_unique<PartitionWriter>(std::move(device), size_, &service_->stats(),
+                                                    std::move(callbacks), options);
+        EndPhase();
 
         // Clear the progress indicator.
         service_->UpdateProgress(IGsiService::STATUS_NO_OPERATION, 0);
@@ -110,7 +187,93 @@ int PartitionInstaller::StartInstall() {
     return IGsiService::INSTALL_OK;
 }
 
+int PartitionInstaller::PreallocateAll(const std::vector<PartitionInstaller*>& installers) {
+    GSI_TRACE_CALL();
+    CHECK(!installers.empty());
+    // The installers share a slot, so any of them can create the images.
+    auto first = installers.front();
+    auto service = first->service_;
+    auto end_failed_phases = android::base::make_scope_guard([&]() -> void {
+        for (auto installer : installers) {
+            installer->EndFailedPhase();
+        }
+    });
+    // Threads created to allocate the images inherit the I/O priority.
+    ScopedIoPriority priority(first->qos_);
+
+    // Nothing is allocated unless the whole batch fits.
+    std::vector<ImageBackend::ImageSpec> images;
+    for (auto installer : installers) {
+        installer->BeginPhase("checks");
+        if (int status = installer->PerformSanityChecks()) {
+            return status;
+        }
+        images.emplace_back(installer->GetImageSpec());
+    }
+    InstallPlan plan;
+    if (int status = AdmitInstall(first->active_dsu_, first->install_dir_, images, &plan)) {
+        return status;
+    }
+
+    uint64_t allocated = 0;
+    images.clear();
+    for (auto installer : installers) {
+        installer->EndPhase();
+        installer->BeginPhase("allocate");
+        if (installer->ReuseOldImage()) {
+            continue;
+        }
+        if (!installer->RemoveOldImage()) {
+            return IGsiService::INSTALL_ERROR_GENERIC;
+        }
+        auto image = installer->GetImageSpec();
+        if (first->images_->CreateBackingImageFromPool(image.name, image.size, image.readonly)) {
+            service->stats().pool_image_bytes += image.size;
+            continue;
+        }
+        images.emplace_back(std::move(image));
+        allocated += installer->size_;
+    }
+
+    if (!images.empty()) {
+        service->StartAsyncOperation("create", allocated);
+        auto progress = [service](uint64_t bytes, uint64_t /* total */) -> bool {
+            service->UpdateProgress(IGsiService::STATUS_WORKING, bytes);
+            return !service->should_abort();
+        };
+        auto& stats = service->stats();
+        ScopedTimer timer(nullptr);
+        if (!first->images_->CreateBackingImages(images, std::move(progress))) {
+            LOG(ERROR) << "Could not create partition images";
+            return IGsiService::INSTALL_ERROR_GENERIC;
+        }
+        stats.create_image_ns += std::chrono::nanoseconds(timer.Stop()).count();
+        stats.create_image_bytes += allocated;
+        service->UpdateProgress(IGsiService::STATUS_COMPLETE, 0);
+    }
+
+    for (auto installer : installers) {
+        if (!installer->reused_) {
+            if (int status = installer->CheckImageLayout()) {
+                return status;
+            }
+        }
+        installer->EndPhase(installer->size_);
+        installer->preallocated_ = true;
+    }
+    return IGsiService::INSTALL_OK;
+}
+
+ImageBackend::ImageSpec PartitionInstaller::GetImageSpec() const {
+    return ImageBackend::ImageSpec{
+            .name = GetBackingFile(name_),
+            .size = size_,
+            .readonly = readOnly_,
+    };
+}
+
 int PartitionInstaller::PerformSanityChecks() {
+    GSI_TRACE_CALL();
     if (!images_) {
         LOG(ERROR) << "unable to create image manager";
         return IGsiService::INSTALL_ERROR_GENERIC;
@@ -123,176 +286,348 @@ int PartitionInstaller::PerformSanityChecks() {
         LOG(ERROR) << "cannot install gsi inside a live gsi";
         return IGsiService::INSTALL_ERROR_GENERIC;
     }
+    return IGsiService::INSTALL_OK;
+}
 
-    struct statvfs sb;
-    if (statvfs(install_dir_.c_str(), &sb)) {
-        PLOG(ERROR) << "failed to read file system stats";
+int PartitionInstaller::Preallocate() {
+    GSI_TRACE_CALL();
+    std::string file = GetBackingFile(name_);
+    if (ReuseOldImage()) {
+        return IGsiService::INSTALL_OK;
+    }
+    if (!RemoveOldImage()) {
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    service_->StartAsyncOperation("create " + name_, size_);
+    if (!CreateImage(file, size_)) {
+        LOG(ERROR) << "Could not create userdata image";
         return IGsiService::INSTALL_ERROR_GENERIC;
     }
+    service_->UpdateProgress(IGsiService::STATUS_COMPLETE, 0);
+    return CheckImageLayout();
+}
 
-    // This is the same as android::vold::GetFreebytes() but we also
-    // need the total file system size so we open code it here.
-    uint64_t free_space = 1ULL * sb.f_bavail * sb.f_frsize;
-    uint64_t fs_size = sb.f_blocks * sb.f_frsize;
-    if (free_space <= (size_)) {
-        LOG(ERROR) << "not enough free space (only " << free_space << " bytes available)";
-        return IGsiService::INSTALL_ERROR_NO_SPACE;
+int PartitionInstaller::CheckImageLayout() {
+    GSI_TRACE_CALL();
+    std::string file = GetBackingFile(name_);
+    ImageBackend::ImageLayout layout;
+    if (!images_->GetImageLayout(file, &layout)) {
+        return IGsiService::INSTALL_OK;
+    }
+    // Read-only images are read at GSI boot through a table with one
+    // target per extent, so a badly fragmented one maps slowly and reads
+    // slowly. Allocating it again often finds larger free ranges, as long
+    // as the image still holds its own; whichever of the two has fewer
+    // extents is kept. The pool is skipped then: its chunks are no less
+    // fragmented, and each attempt would use up more of them.
+    auto max_extents = android::base::GetUintProperty<uint64_t>("gsid.max_image_extents",
+                                                                kMaxImageExtents);
+    auto& stats = service_->stats();
+    auto replacement = ImageBackend::GetReplacementName(file);
+    bool fragmented = readOnly_ && max_extents && layout.extents > max_extents;
+    for (uint32_t attempt = 1; fragmented && attempt < kMaxAllocationAttempts; attempt++) {
+        LOG(WARNING) << file << " has " << layout.extents << " extents, more than "
+                     << max_extents << "; allocating it again";
+        stats.reallocated_images++;
+        // Left over by an interrupted install.
+        if (images_->BackingImageExists(replacement) &&
+            !images_->DeleteBackingImage(replacement)) {
+            return IGsiService::INSTALL_ERROR_GENERIC;
+        }
+        service_->StartAsyncOperation("create " + name_, size_);
+        if (!CreateImage(replacement, size_, false)) {
+            if (images_->BackingImageExists(replacement)) {
+                images_->DeleteBackingImage(replacement);
+            }
+            if (service_->should_abort()) {
+                return IGsiService::INSTALL_ERROR_GENERIC;
+            }
+            // There may be no room for both copies at once.
+            LOG(WARNING) << "could not allocate " << file << " again";
+            break;
+        }
+        service_->UpdateProgress(IGsiService::STATUS_COMPLETE, 0);
+        ImageBackend::ImageLayout new_layout;
+        if (!images_->GetImageLayout(replacement, &new_layout)) {
+            images_->DeleteBackingImage(replacement);
+            return IGsiService::INSTALL_ERROR_GENERIC;
+        }
+        if (new_layout.extents < layout.extents) {
+            if (!images_->ReplaceBackingImage(file)) {
+                return IGsiService::INSTALL_ERROR_GENERIC;
+            }
+            layout = new_layout;
+        } else if (!images_->DeleteBackingImage(replacement)) {
+            return IGsiService::INSTALL_ERROR_GENERIC;
+        }
+        fragmented = layout.extents > max_extents;
     }
-    // We are asking for 40% of the /data to be empty.
-    // TODO: may be not hard code it like this
-    double free_space_percent = ((1.0 * free_space) / fs_size) * 100;
-    if (free_space_percent < kMinimumFreeSpaceThreshold) {
-        LOG(ERROR) << "free space " << static_cast<uint64_t>(free_space_percent)
-                   << "% is below the minimum threshold of " << kMinimumFreeSpaceThreshold << "%";
-        return IGsiService::INSTALL_ERROR_FILE_SYSTEM_CLUTTERED;
+    stats.image_extents.Record(layout.extents);
+    LOG(INFO) << file << " has " << layout.extents << " extents, averaging "
+              << layout.bytes / std::max<uint64_t>(layout.extents, 1) << " bytes";
+
+    if (fragmented) {
+        if (android::base::GetBoolProperty("gsid.strict_image_extents", false)) {
+            LOG(ERROR) << file << " is too fragmented (" << layout.extents << " extents)";
+            return IGsiService::INSTALL_ERROR_FILE_SYSTEM_CLUTTERED;
+        }
+        LOG(WARNING) << "keeping " << file << " with " << layout.extents << " extents";
     }
     return IGsiService::INSTALL_OK;
 }
 
-int PartitionInstaller::Preallocate() {
+bool PartitionInstaller::RemoveOldImage() {
     std::string file = GetBackingFile(name_);
     if (!images_->UnmapImageIfExists(file)) {
         LOG(ERROR) << "failed to UnmapImageIfExists " << file;
-        return IGsiService::INSTALL_ERROR_GENERIC;
+        return false;
     }
     // always delete the old one when it presents in case there might a partition
     // with same name but different size.
     if (images_->BackingImageExists(file)) {
         if (!images_->DeleteBackingImage(file)) {
             LOG(ERROR) << "failed to DeleteBackingImage " << file;
-            return IGsiService::INSTALL_ERROR_GENERIC;
+            return false;
         }
     }
-    service_->StartAsyncOperation("create " + name_, size_);
-    if (!CreateImage(file, size_)) {
-        LOG(ERROR) << "Could not create userdata image";
-        return IGsiService::INSTALL_ERROR_GENERIC;
+    return true;
+}
+
+bool PartitionInstaller::ReuseOldImage() {
+    GSI_TRACE_CALL();
+    if (!android::base::GetBoolProperty("gsid.reuse_images", true)) {
+        return false;
     }
-    service_->UpdateProgress(IGsiService::STATUS_COMPLETE, 0);
-    return IGsiService::INSTALL_OK;
+    std::string file = GetBackingFile(name_);
+    ImageBackend::ImageSpec image = {
+            .name = file,
+            .size = size_,
+            .readonly = readOnly_,
+    };
+    if (!images_->CanReuseBackingImage(image)) {
+        return false;
+    }
+    // Read-only images are overwritten by the stream, and writable ones
+    // are reformatted, so nothing from the previous install survives.
+    if (!images_->UnmapImageIfExists(file)) {
+        LOG(ERROR) << "failed to UnmapImageIfExists " << file;
+        return false;
+    }
+    LOG(INFO) << "reusing existing image " << file << " (" << size_ << " bytes)";
+    service_->stats().reused_image_bytes += size_;
+    reused_ = true;
+    return true;
 }
 
-bool PartitionInstaller::CreateImage(const std::string& name, uint64_t size) {
+bool PartitionInstaller::CreateImage(const std::string& name, uint64_t size, bool use_pool) {
+    GSI_TRACE_CALL();
     auto progress = [this](uint64_t bytes, uint64_t /* total */) -> bool {
         service_->UpdateProgress(IGsiService::STATUS_WORKING, bytes);
         if (service_->should_abort()) return false;
         return true;
     };
-    int flags = ImageManager::CREATE_IMAGE_DEFAULT;
-    if (readOnly_) {
-        flags |= ImageManager::CREATE_IMAGE_READONLY;
+    auto& stats = service_->stats();
+    ScopedTimer timer(nullptr);
+    if (use_pool && images_->CreateBackingImageFromPool(name, size, readOnly_)) {
+        stats.pool_image_bytes += size;
+    } else if (!images_->CreateBackingImage(name, size, readOnly_, std::move(progress))) {
+        return false;
     }
-    return images_->CreateBackingImage(name, size, flags, std::move(progress));
+    stats.create_image_ns += std::chrono::nanoseconds(timer.Stop()).count();
+    stats.create_image_bytes += size;
+    return true;
 }
 
-std::unique_ptr<MappedDevice> PartitionInstaller::OpenPartition(const std::string& name) {
-    return MappedDevice::Open(images_.get(), 10s, name);
+std::unique_ptr<ImageDevice> PartitionInstaller::OpenPartition(const std::string& name) {
+    GSI_TRACE_CALL();
+    return images_->OpenImageDevice(name);
+}
+
+bool PartitionInstaller::CheckWritable() {
+    if (!writer_) {
+        LOG(ERROR) << name_ << " is not open for writing";
+        return false;
+    }
+    if (paused_) {
+        LOG(ERROR) << "install of " << name_ << " is paused";
+        return false;
+    }
+    return true;
 }
 
 bool PartitionInstaller::CommitGsiChunk(int stream_fd, int64_t bytes) {
+    GSI_TRACE_CALL();
+    if (!CheckWritable() || !CheckPatchIdle()) {
+        return false;
+    }
     service_->StartAsyncOperation("write " + name_, size_);
 
-    if (bytes < 0) {
-        LOG(ERROR) << "chunk size " << bytes << " is negative";
+    ScopedIoPriority priority(qos_);
+    BeginWritePhase();
+    bool success = writer_->CommitChunk(stream_fd, bytes);
+    EndPhase(writer_->bytes_written());
+    if (!success) {
+        PauseIfRequested();
         return false;
     }
+    service_->UpdateProgress(IGsiService::STATUS_COMPLETE, size_);
+    return true;
+}
 
-    static const size_t kBlockSize = 4096;
-    auto buffer = std::make_unique<char[]>(kBlockSize);
+bool PartitionInstaller::CommitGsiChunk(const void* data, size_t bytes) {
+    if (!CheckWritable() || !CheckPatchIdle()) {
+        return false;
+    }
+    ScopedIoPriority priority(qos_);
+    if (!writer_->CommitChunk(data, bytes)) {
+        PauseIfRequested();
+        return false;
+    }
+    return true;
+}
 
-    int progress = -1;
-    uint64_t remaining = bytes;
-    while (remaining) {
-        size_t max_to_read = std::min(static_cast<uint64_t>(kBlockSize), remaining);
-        ssize_t rv = TEMP_FAILURE_RETRY(read(stream_fd, buffer.get(), max_to_read));
-        if (rv < 0) {
-            PLOG(ERROR) << "read gsi chunk";
-            return false;
-        }
-        if (rv == 0) {
-            LOG(ERROR) << "no bytes left in stream";
-            return false;
-        }
-        if (!CommitGsiChunk(buffer.get(), rv)) {
-            return false;
-        }
-        CHECK(static_cast<uint64_t>(rv) <= remaining);
-        remaining -= rv;
-
-        // Only update the progress when the % (or permille, in this case)
-        // significantly changes.
-        int new_progress = ((size_ - remaining) * 1000) / size_;
-        if (new_progress != progress) {
-            service_->UpdateProgress(IGsiService::STATUS_WORKING, size_ - remaining);
+int64_t PartitionInstaller::CommitGsiPatch(int stream_fd, int64_t bytes) {
+    GSI_TRACE_CALL();
+    if (!CheckWritable()) {
+        return -1;
+    }
+    if (!patch_) {
+        // The patch is applied in place, so the image must still hold a
+        // complete copy of the previous install.
+        if (!HasPatchBase()) {
+            return -1;
         }
+        patch_ = std::make_unique<DeltaPatchApplier>(writer_.get(), &service_->stats());
     }
+    service_->StartAsyncOperation("write " + name_, size_);
 
+    ScopedIoPriority priority(qos_);
+    BeginWritePhase();
+    int64_t consumed = patch_->Apply(stream_fd, bytes);
+    EndPhase(writer_->bytes_written());
+    if (consumed != bytes) {
+        PauseIfRequested();
+        return consumed;
+    }
     service_->UpdateProgress(IGsiService::STATUS_COMPLETE, size_);
-    return true;
+    return consumed;
 }
 
-bool PartitionInstaller::IsFinishedWriting() {
-    return gsi_bytes_written_ == size_;
-}
+int PartitionInstaller::WriteBlockHashes(uint32_t block_size, int output_fd) {
+    GSI_TRACE_CALL();
+    if (!CheckWritable() || !HasPatchBase()) {
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    if (writer_->bytes_written()) {
+        LOG(ERROR) << name_ << " has already been written to";
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    service_->StartAsyncOperation("hash " + name_, size_);
+    auto progress = [this](uint64_t bytes) -> bool {
+        service_->UpdateProgress(IGsiService::STATUS_WORKING, bytes);
+        return !service_->should_abort();
+    };
 
-bool PartitionInstaller::IsAshmemMapped() {
-    return ashmem_data_ != MAP_FAILED;
-}
+    ScopedIoPriority priority(qos_);
+    auto end_failed_phase = android::base::make_scope_guard([this]() -> void { EndFailedPhase(); });
+    BeginPhase("hash");
+    auto& stats = service_->stats();
+    ScopedTimer timer(nullptr);
+    std::vector<uint8_t> hashes;
+    if (!ComputeBlockHashes(writer_->fd(), size_, block_size, &hashes, progress)) {
+        LOG(ERROR) << "could not hash " << name_;
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    stats.block_hash_ns += std::chrono::nanoseconds(timer.Stop()).count();
+    stats.block_hash_bytes += size_;
+    EndPhase(size_);
 
-bool PartitionInstaller::CommitGsiChunk(const void* data, size_t bytes) {
-    if (static_cast<uint64_t>(bytes) > size_ - gsi_bytes_written_) {
-        // We cannot write past the end of the image file.
-        LOG(ERROR) << "chunk size " << bytes << " exceeds remaining image size (" << size_
-                   << " expected, " << gsi_bytes_written_ << " written)";
-        return false;
+    if (!android::base::WriteFully(output_fd, hashes.data(), hashes.size())) {
+        PLOG(ERROR) << "write block hashes of " << name_;
+        return IGsiService::INSTALL_ERROR_GENERIC;
     }
-    if (service_->should_abort()) {
+    service_->UpdateProgress(IGsiService::STATUS_COMPLETE, size_);
+    return IGsiService::INSTALL_OK;
+}
+
+bool PartitionInstaller::HasPatchBase() {
+    if (!reused_ || !service_->previous_install_complete()) {
+        LOG(ERROR) << "no complete previous image of " << name_ << " to patch";
         return false;
     }
-    if (!android::base::WriteFully(system_device_->fd(), data, bytes)) {
-        PLOG(ERROR) << "write failed";
+    return true;
+}
+
+bool PartitionInstaller::CheckPatchIdle() {
+    if (patch_ && !patch_->idle()) {
+        LOG(ERROR) << "a delta operation on " << name_ << " is incomplete";
         return false;
     }
-    gsi_bytes_written_ += bytes;
     return true;
 }
 
 int PartitionInstaller::GetPartitionFd() {
-    return system_device_->fd();
+    return writer_ ? writer_->fd() : -1;
 }
 
 bool PartitionInstaller::MapAshmem(int fd, size_t size) {
-    ashmem_size_ = size;
-    ashmem_data_ = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    return ashmem_data_ != MAP_FAILED;
-}
-
-void PartitionInstaller::UnmapAshmem() {
-    if (munmap(ashmem_data_, ashmem_size_) != 0) {
-        PLOG(ERROR) << "cannot munmap";
-        return;
+    if (!writer_) {
+        LOG(ERROR) << name_ << " is not open for writing";
+        return false;
     }
-    ashmem_data_ = MAP_FAILED;
-    ashmem_size_ = -1;
+    return writer_->MapAshmem(fd, size);
 }
 
 bool PartitionInstaller::CommitGsiChunk(size_t bytes) {
-    if (!IsAshmemMapped()) {
-        PLOG(ERROR) << "ashmem is not mapped";
+    GSI_TRACE_CALL();
+    if (!CheckWritable() || !CheckPatchIdle()) {
         return false;
     }
-    bool success = CommitGsiChunk(ashmem_data_, bytes);
-    if (success && IsFinishedWriting()) {
-        UnmapAshmem();
+    ScopedIoPriority priority(qos_);
+    BeginWritePhase();
+    bool success = writer_->CommitAshmemChunk(bytes);
+    EndPhase(writer_->bytes_written());
+    if (!success) {
+        PauseIfRequested();
     }
     return success;
 }
 
+void PartitionInstaller::PauseIfRequested() {
+    // Pausing here, rather than waiting for pauseInstall() to take the lock,
+    // means the client sees STATUS_PAUSED as soon as its commit fails.
+    if (service_->pause_requested()) {
+        Pause();
+    }
+}
+
+void PartitionInstaller::Pause() {
+    if (paused_) {
+        return;
+    }
+    LOG(INFO) << "pausing install of " << name_ << " at " << bytes_written() << " bytes";
+    paused_ = true;
+    BeginPhase("paused");
+    service_->StartAsyncOperation("write " + name_, size_);
+    service_->UpdateProgress(IGsiService::STATUS_PAUSED, bytes_written());
+}
+
+void PartitionInstaller::Resume() {
+    if (!paused_) {
+        return;
+    }
+    LOG(INFO) << "resuming install of " << name_;
+    paused_ = false;
+    EndPhase();
+    service_->UpdateProgress(IGsiService::STATUS_WORKING, bytes_written());
+}
+
 const std::string PartitionInstaller::GetBackingFile(std::string name) {
     return name + "_gsi";
 }
 
 bool PartitionInstaller::Format() {
+    GSI_TRACE_CALL();
     auto file = GetBackingFile(name_);
     auto device = OpenPartition(file);
     if (!device) {
@@ -309,49 +644,484 @@ bool PartitionInstaller::Format() {
 }
 
 int PartitionInstaller::Finish() {
-    if (readOnly_ && gsi_bytes_written_ != size_) {
+    GSI_TRACE_CALL();
+    auto end_failed_phase = android::base::make_scope_guard([this]() -> void { EndFailedPhase(); });
+    if (shared_) {
+        return IGsiService::INSTALL_OK;
+    }
+    uint64_t bytes_written = writer_ ? writer_->bytes_written() : 0;
+    if (readOnly_ && bytes_written != size_) {
         // We cannot boot if the image is incomplete.
         LOG(ERROR) << "image incomplete; expected " << size_ << " bytes, waiting for "
-                   << (size_ - gsi_bytes_written_) << " bytes";
+                   << (size_ - bytes_written) << " bytes";
         return IGsiService::INSTALL_ERROR_GENERIC;
     }
-    if (system_device_ != nullptr && fsync(system_device_->fd())) {
-        PLOG(ERROR) << "fsync failed for " << name_ << "_gsi";
-        return IGsiService::INSTALL_ERROR_GENERIC;
+    patch_ = {};
+    if (writer_ != nullptr) {
+        ScopedIoPriority priority(qos_);
+        BeginPhase("fsync");
+        if (!writer_->Flush()) {
+            return IGsiService::INSTALL_ERROR_GENERIC;
+        }
+        EndPhase(bytes_written);
     }
-    system_device_ = {};
 
     // If files moved (are no longer pinned), the metadata file will be invalid.
     // This check can be removed once b/133967059 is fixed.
+    BeginPhase("validate");
     if (!images_->Validate()) {
+        writer_ = {};
         return IGsiService::INSTALL_ERROR_GENERIC;
     }
+    EndPhase();
+
+    if (writer_ && !digest_.empty()) {
+        ShareImage();
+    }
+    writer_ = {};
 
     succeeded_ = true;
     return IGsiService::INSTALL_OK;
 }
 
+bool PartitionInstaller::LinkSharedImage() {
+    if (!images_ || !android::base::GetBoolProperty("gsid.share_images", true)) {
+        return false;
+    }
+    BeginPhase("link");
+    if (!images_->LinkSharedImage(digest_, GetBackingFile(name_), size_)) {
+        EndPhase();
+        return false;
+    }
+    EndPhase(size_);
+    LOG(INFO) << "Linked " << name_ << " to a shared image, skipping the write";
+    service_->stats().shared_image_bytes += size_;
+    shared_ = true;
+    return true;
+}
+
+void PartitionInstaller::ShareImage() {
+    if (!android::base::GetBoolProperty("gsid.share_images", true)) {
+        return;
+    }
+    // The digest comes from the client, so check it against what was
+    // actually written before other slots trust it.
+    BeginPhase("digest");
+    std::string digest;
+    if (!ComputeImageDigest(writer_->fd(), size_, &digest)) {
+        LOG(ERROR) << "could not compute the digest of " << name_ << ", not sharing it";
+        return;
+    }
+    EndPhase(size_);
+    if (digest != digest_) {
+        LOG(ERROR) << name_ << " has digest " << digest << ", expected " << digest_
+                   << "; not sharing it";
+        return;
+    }
+    images_->ShareBackingImage(GetBackingFile(name_), digest_);
+}
+
+void PartitionInstaller::BeginPhase(const std::string& phase) {
+    auto now = std::chrono::steady_clock::now();
+    phases_.emplace_back(Phase{phase, now, now});
+}
+
+void PartitionInstaller::EndPhase(uint64_t bytes) {
+    CHECK(!phases_.empty());
+    phases_.back().end = std::chrono::steady_clock::now();
+    phases_.back().bytes = bytes;
+    phases_.back().ended = true;
+}
+
+void PartitionInstaller::EndFailedPhase() {
+    if (!phases_.empty() && !phases_.back().ended) {
+        EndPhase();
+    }
+}
+
+void PartitionInstaller::BeginWritePhase() {
+    // Data usually arrives over many commit calls; they all extend a single
+    // "write" phase.
+    if (phases_.empty() || phases_.back().name != "write") {
+        BeginPhase("write");
+    }
+}
+
+void PartitionInstaller::SaveInstallReport() {
+    // A phase still open here, such as a pause the install was cancelled
+    // in, lasted until now.
+    auto now = std::chrono::steady_clock::now();
+    std::string report;
+    for (const auto& phase : phases_) {
+        auto end = phase.ended ? phase.end : now;
+        auto start = std::chrono::nanoseconds(phase.start.time_since_epoch()).count();
+        auto duration = std::chrono::nanoseconds(end - phase.start).count();
+        report += StringPrintf("%s %s %lld %lld %llu\n", name_.c_str(), phase.name.c_str(),
+                               static_cast<long long>(start), static_cast<long long>(duration),
+                               static_cast<unsigned long long>(phase.bytes));
+    }
+    phases_.clear();
+
+    auto file = DsuInstallReportFile(active_dsu_);
+    unique_fd fd(open(file.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644));
+    if (fd < 0 || !android::base::WriteStringToFd(report, fd)) {
+        PLOG(ERROR) << "write failed: " << file;
+    }
+}
+
 int PartitionInstaller::WipeWritable(const std::string& active_dsu, const std::string& install_dir,
                                      const std::string& name) {
-    auto image = ImageManager::Open(MetadataDir(active_dsu), install_dir);
+    GSI_TRACE_CALL();
+    // Wiping userdata discards a snapshot of it along with everything else.
+    if (name == GetBackingFile("userdata")) {
+        if (int status = RemoveUserdataSnapshot(active_dsu, install_dir)) {
+            return status;
+        }
+    }
+    auto images = FiemapImageBackend::Open(MetadataDir(active_dsu), install_dir);
+    if (!images) {
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
     // The device object has to be destroyed before the image object
-    auto device = MappedDevice::Open(image.get(), 10s, name);
-    if (!device) {
+    auto device = images->OpenImageDevice(name);
+    if (!device || !WipeImageDevice(device.get())) {
         return IGsiService::INSTALL_ERROR_GENERIC;
     }
+    return IGsiService::INSTALL_OK;
+}
 
-    // Wipe the first 1MiB of the device, ensuring both the first block and
-    // the superblock are destroyed.
-    static constexpr uint64_t kEraseSize = 1024 * 1024;
+// What gsid can tell of the filesystem on a writable image, which it reads
+// from the raw image rather than through whatever the GSI stacks on top.
+enum class ImageFs {
+    // Still zeroed by WipeImageDevice(); the GSI formats it at full size.
+    kNone,
+    kExt4,
+    // Anything else, such as ext4 under metadata encryption, which gsid
+    // only sees as ciphertext and so cannot resize.
+    kUnknown,
+};
 
-    std::string zeroes(4096, 0);
-    uint64_t erase_size = std::min(kEraseSize, get_block_device_size(device->fd()));
-    for (uint64_t i = 0; i < erase_size; i += zeroes.size()) {
-        if (!android::base::WriteFully(device->fd(), zeroes.data(), zeroes.size())) {
-            PLOG(ERROR) << "write " << name;
+// Read the size and usage of the ext4 filesystem on |fd|, if it holds one.
+// The free block count is as of the last unmount.
+static ImageFs ReadExt4Usage(int fd, uint64_t* used, uint64_t* total) {
+    struct ext4_super_block sb;
+    if (!android::base::ReadFullyAtOffset(fd, &sb, sizeof(sb), 1024)) {
+        PLOG(ERROR) << "read superblock";
+        return ImageFs::kUnknown;
+    }
+    if (sb.s_magic != EXT4_SUPER_MAGIC) {
+        auto bytes = reinterpret_cast<const uint8_t*>(&sb);
+        bool zeroed = std::all_of(bytes, bytes + sizeof(sb), [](uint8_t b) { return !b; });
+        return zeroed ? ImageFs::kNone : ImageFs::kUnknown;
+    }
+    uint64_t blocks = sb.s_blocks_count_lo;
+    uint64_t free_blocks = sb.s_free_blocks_count_lo;
+    if (sb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT) {
+        blocks |= uint64_t(sb.s_blocks_count_hi) << 32;
+        free_blocks |= uint64_t(sb.s_free_blocks_count_hi) << 32;
+    }
+    uint64_t block_size = 1024ULL << sb.s_log_block_size;
+    *total = blocks * block_size;
+    *used = (blocks - std::min(blocks, free_blocks)) * block_size;
+    return ImageFs::kExt4;
+}
+
+static bool ResizeExt4(const std::string& device) {
+    // -f: the filesystem was last checked by the GSI, not by us.
+    const char* argv[] = {"/system/bin/resize2fs", "-f", device.c_str(), nullptr};
+    pid_t pid = fork();
+    if (pid < 0) {
+        PLOG(ERROR) << "fork";
+        return false;
+    }
+    if (pid == 0) {
+        execv(argv[0], const_cast<char**>(argv));
+        _exit(127);
+    }
+    int status;
+    if (TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) != pid) {
+        PLOG(ERROR) << "waitpid";
+        return false;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        LOG(ERROR) << "resize2fs " << device << " failed with status " << status;
+        return false;
+    }
+    return true;
+}
+
+int PartitionInstaller::GrowThinUserdata(const std::string& active_dsu,
+                                         const std::string& install_dir) {
+    GSI_TRACE_CALL();
+    std::string contents;
+    if (!android::base::ReadFileToString(DsuUserdataMaxSizeFile(active_dsu), &contents)) {
+        return IGsiService::INSTALL_OK;
+    }
+    uint64_t max_size;
+    if (!android::base::ParseUint(android::base::Trim(contents), &max_size)) {
+        LOG(ERROR) << "invalid userdata size limit: " << contents;
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    // The base of a snapshot must stay as it was frozen.
+    UserdataSnapshot snapshot;
+    if (GetUserdataSnapshot(active_dsu, &snapshot)) {
+        return IGsiService::INSTALL_OK;
+    }
+
+    auto images = FiemapImageBackend::Open(MetadataDir(active_dsu), install_dir);
+    if (!images) {
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    auto name = GetBackingFile("userdata");
+    uint64_t size, used, fs_size;
+    {
+        auto device = images->OpenImageDevice(name);
+        if (!device) {
+            return IGsiService::INSTALL_ERROR_GENERIC;
+        }
+        size = GetImageSize(device->fd());
+        switch (ReadExt4Usage(device->fd(), &used, &fs_size)) {
+            case ImageFs::kNone:
+                return IGsiService::INSTALL_OK;
+            case ImageFs::kExt4:
+                break;
+            case ImageFs::kUnknown:
+                LOG(ERROR) << "userdata of " << active_dsu
+                           << " is not plain ext4 (it may be encrypted), so it cannot grow";
+                return IGsiService::INSTALL_ERROR_GENERIC;
+        }
+    }
+
+    if (size < max_size && used * 100 >= fs_size * kThinUserdataGrowPercent) {
+        uint64_t new_size = std::min(max_size, size + kThinUserdataGrowSize);
+        if (int status = CheckGrowthHeadroom(install_dir, new_size - size)) {
+            return status;
+        }
+        if (!images->UnmapImageIfExists(name) ||
+            !images->ExtendBackingImage(name, new_size, nullptr)) {
+            return IGsiService::INSTALL_ERROR_GENERIC;
+        }
+        size = new_size;
+    }
+
+    // This also finishes a resize that an earlier boot did not get to.
+    if (fs_size + kResizeSlack < size) {
+        auto device = images->OpenImageDevice(name);
+        if (!device || !ResizeExt4(device->path())) {
+            LOG(ERROR) << "userdata of " << active_dsu << " is " << size
+                       << " bytes, but its filesystem is still " << fs_size << " bytes";
+            return IGsiService::INSTALL_ERROR_GENERIC;
+        }
+        LOG(INFO) << "Grew userdata of " << active_dsu << " (" << used << " of " << fs_size
+                  << " bytes used) to " << size << " bytes";
+    }
+    return IGsiService::INSTALL_OK;
+}
+
+int PartitionInstaller::ResizeWritable(const std::string& active_dsu,
+                                       const std::string& install_dir, const std::string& name,
+                                       uint64_t size) {
+    GSI_TRACE_CALL();
+    auto images = FiemapImageBackend::Open(MetadataDir(active_dsu), install_dir);
+    if (!images) {
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    auto file = GetBackingFile(name);
+    if (!images->BackingImageExists(file)) {
+        LOG(ERROR) << "no image " << file << " to resize";
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    uint64_t old_size, used, fs_size;
+    ImageFs fs;
+    {
+        auto device = images->OpenImageDevice(file);
+        if (!device) {
+            return IGsiService::INSTALL_ERROR_GENERIC;
+        }
+        old_size = GetImageSize(device->fd());
+        fs = ReadExt4Usage(device->fd(), &used, &fs_size);
+    }
+    // Asking for the current size again finishes a resize whose filesystem
+    // step failed.
+    if (size == old_size && (fs != ImageFs::kExt4 || fs_size + kResizeSlack >= size)) {
+        return IGsiService::INSTALL_OK;
+    }
+    if (size < old_size) {
+        LOG(ERROR) << "cannot shrink " << file << " from " << old_size << " to " << size
+                   << " bytes";
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    // Growing the image alone would leave a filesystem that does not use
+    // the new space.
+    if (fs == ImageFs::kUnknown) {
+        LOG(ERROR) << file << " of " << active_dsu
+                   << " is not plain ext4 (it may be encrypted), so it cannot be resized";
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    if (size > old_size) {
+        if (int status = CheckGrowthHeadroom(install_dir, size - old_size)) {
+            return status;
+        }
+        if (!images->UnmapImageIfExists(file) ||
+            !images->ExtendBackingImage(file, size, nullptr)) {
             return IGsiService::INSTALL_ERROR_GENERIC;
         }
     }
+    // An image that has not been formatted yet is formatted at its new size.
+    if (fs == ImageFs::kExt4) {
+        auto device = images->OpenImageDevice(file);
+        if (!device || !ResizeExt4(device->path())) {
+            LOG(ERROR) << file << " of " << active_dsu << " was extended to " << size
+                       << " bytes, but its filesystem was not";
+            return IGsiService::INSTALL_ERROR_GENERIC;
+        }
+    }
+
+    // Thin userdata may keep growing from its new size.
+    auto max_size_file = DsuUserdataMaxSizeFile(active_dsu);
+    std::string contents;
+    uint64_t max_size;
+    if (name == "userdata" && android::base::ReadFileToString(max_size_file, &contents) &&
+        android::base::ParseUint(android::base::Trim(contents), &max_size) && max_size < size &&
+        !android::base::WriteStringToFile(std::to_string(size), max_size_file)) {
+        PLOG(WARNING) << "write " << max_size_file;
+    }
+    LOG(INFO) << "Resized " << file << " of " << active_dsu << " from " << old_size << " to "
+              << size << " bytes";
+    return IGsiService::INSTALL_OK;
+}
+
+int PartitionInstaller::CreateUserdataSnapshot(const std::string& active_dsu,
+                                               const std::string& install_dir,
+                                               uint64_t cow_size) {
+    GSI_TRACE_CALL();
+    if (!kUserdataSnapshotsMapped) {
+        LOG(ERROR) << "userdata snapshots are not supported: first-stage init does not map them";
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    UserdataSnapshot snapshot = {
+            .base = GetBackingFile("userdata"),
+            .cow = FiemapImageBackend::GetCowName(GetBackingFile("userdata")),
+            .chunk_sectors = kSnapshotChunkSectors,
+    };
+    UserdataSnapshot existing;
+    if (GetUserdataSnapshot(active_dsu, &existing)) {
+        LOG(ERROR) << "userdata of " << active_dsu << " is already a snapshot";
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    if (!cow_size) {
+        LOG(ERROR) << "copy-on-write image size must not be zero";
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    // The exception store is addressed in whole chunks.
+    uint64_t chunk_size = snapshot.chunk_sectors * LP_SECTOR_SIZE;
+    cow_size = (cow_size + chunk_size - 1) / chunk_size * chunk_size;
+
+    auto images = FiemapImageBackend::Open(MetadataDir(active_dsu), install_dir);
+    if (!images) {
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    if (!images->BackingImageExists(snapshot.base)) {
+        LOG(ERROR) << "no userdata to snapshot in " << install_dir;
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    // Left over by an interrupted call.
+    if (images->BackingImageExists(snapshot.cow) && !images->DeleteBackingImage(snapshot.cow)) {
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    if (!images->CreateBackingImage(snapshot.cow, cow_size, false, nullptr)) {
+        LOG(ERROR) << "could not create a " << cow_size << " byte copy-on-write image";
+        return IGsiService::INSTALL_ERROR_NO_SPACE;
+    }
+    // A persistent exception store with a zeroed header is empty.
+    auto device = images->OpenImageDevice(snapshot.cow);
+    if (!device || !WipeImageDevice(device.get())) {
+        device = nullptr;
+        images->DeleteBackingImage(snapshot.cow);
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    device = nullptr;
+
+    // The snapshot file makes first-stage init map the snapshot, so it is
+    // written before the base is frozen; a base that is read-only without a
+    // snapshot could not be mounted.
+    auto contents = StringPrintf("%s %s %u\n", snapshot.base.c_str(), snapshot.cow.c_str(),
+                                 snapshot.chunk_sectors);
+    auto file = DsuUserdataSnapshotFile(active_dsu);
+    if (!android::base::WriteStringToFile(contents, file)) {
+        PLOG(ERROR) << "write " << file;
+        images->DeleteBackingImage(snapshot.cow);
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    if (!images->UnmapImageIfExists(snapshot.base) ||
+        !images->SetImageReadOnly(snapshot.base, true)) {
+        RemoveUserdataSnapshot(active_dsu, install_dir);
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    LOG(INFO) << "Froze userdata of " << active_dsu << " under a " << cow_size
+              << " byte snapshot";
+    return IGsiService::INSTALL_OK;
+}
+
+int PartitionInstaller::ResetUserdataSnapshot(const std::string& active_dsu,
+                                              const std::string& install_dir) {
+    GSI_TRACE_CALL();
+    if (!kUserdataSnapshotsMapped) {
+        LOG(ERROR) << "userdata snapshots are not supported: first-stage init does not map them";
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    UserdataSnapshot snapshot;
+    if (!GetUserdataSnapshot(active_dsu, &snapshot)) {
+        LOG(ERROR) << "userdata of " << active_dsu << " is not a snapshot";
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    auto images = FiemapImageBackend::Open(MetadataDir(active_dsu), install_dir);
+    if (!images) {
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    // Only the header of the exception store is rewritten, so this takes
+    // the same time however much userdata has changed.
+    auto device = images->OpenImageDevice(snapshot.cow);
+    if (!device || !WipeImageDevice(device.get())) {
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    LOG(INFO) << "Reset userdata of " << active_dsu << " to its snapshot";
+    return IGsiService::INSTALL_OK;
+}
+
+int PartitionInstaller::RemoveUserdataSnapshot(const std::string& active_dsu,
+                                               const std::string& install_dir) {
+    GSI_TRACE_CALL();
+    UserdataSnapshot snapshot = {
+            .base = GetBackingFile("userdata"),
+            .cow = FiemapImageBackend::GetCowName(GetBackingFile("userdata")),
+    };
+    bool found = GetUserdataSnapshot(active_dsu, &snapshot);
+    auto images = FiemapImageBackend::Open(MetadataDir(active_dsu), install_dir);
+    if (!images) {
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    // The copy-on-write image goes last, so that an interrupted call can be
+    // finished by calling again.
+    if (!found && !images->BackingImageExists(snapshot.cow)) {
+        return IGsiService::INSTALL_OK;
+    }
+    std::string message;
+    if (!android::base::RemoveFileIfExists(DsuUserdataSnapshotFile(active_dsu), &message)) {
+        LOG(ERROR) << message;
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    if (images->BackingImageExists(snapshot.base) &&
+        (!images->UnmapImageIfExists(snapshot.base) ||
+         !images->SetImageReadOnly(snapshot.base, false))) {
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    if (images->BackingImageExists(snapshot.cow) &&
+        (!images->UnmapImageIfExists(snapshot.cow) ||
+         !images->DeleteBackingImage(snapshot.cow))) {
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    LOG(INFO) << "Removed the userdata snapshot of " << active_dsu;
     return IGsiService::INSTALL_OK;
 }
 
@@ -18,75 +18,177 @@
 #include <stdint.h>
 #include <sys/mman.h>
 
+#include <chrono>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <android-base/unique_fd.h>
 #include <android/gsi/IGsiService.h>
 #include <android/gsi/MappedImage.h>
-#include <libfiemap/image_manager.h>
 #include <liblp/builder.h>
 
+#include "delta_patch.h"
+#include "image_backend.h"
+#include "io_throttle.h"
+#include "partition_writer.h"
+
 namespace android {
 namespace gsi {
 
 class GsiService;
 
 class PartitionInstaller final {
-    using ImageManager = android::fiemap::ImageManager;
-    using MappedDevice = android::fiemap::MappedDevice;
-
   public:
     // Constructor for a new GSI installation.
     PartitionInstaller(GsiService* service, const std::string& installDir, const std::string& name,
-                       const std::string& active_dsu, int64_t size, bool read_only);
+                       const std::string& active_dsu, int64_t size, bool read_only,
+                       InstallQos qos = InstallQos::kForeground);
     ~PartitionInstaller();
 
     // Methods for a clean GSI install.
     int StartInstall();
+    // Allocate the images of several installers at once, for example
+    // userdata alongside system. StartInstall() then skips straight to
+    // formatting or mapping the image.
+    static int PreallocateAll(const std::vector<PartitionInstaller*>& installers);
     bool CommitGsiChunk(int stream_fd, int64_t bytes);
+    // Apply a delta patch against the previous install of this partition;
+    // see DeltaPatchApplier. Returns the number of patch bytes consumed, or
+    // -1 on error.
+    int64_t CommitGsiPatch(int stream_fd, int64_t bytes);
+    // Write the block hash manifest (see ComputeBlockHashes()) of the
+    // previous install of this partition to |output_fd|, so the client can
+    // patch in only the blocks that changed. The image must not have been
+    // written yet.
+    int WriteBlockHashes(uint32_t block_size, int output_fd);
     bool CommitGsiChunk(const void* data, size_t bytes);
     bool MapAshmem(int fd, size_t size);
     bool CommitGsiChunk(size_t bytes);
     int GetPartitionFd();
 
+    // Reject commits until Resume(), keeping the image mapped and the
+    // writer's position. Both are no-ops if already in that state.
+    void Pause();
+    void Resume();
+    bool paused() const { return paused_; }
+    uint64_t bytes_written() const { return writer_ ? writer_->bytes_written() : 0; }
+
+    // The SHA-256 (see ComputeImageDigest()) the client expects a read-only
+    // image to have. StartInstall() then links the image to a copy shared by
+    // another slot if there is one, returning INSTALL_SHARED; otherwise the
+    // image is verified and shared once it is complete.
+    void set_digest(const std::string& digest) { digest_ = digest; }
+
+    static const std::string GetBackingFile(std::string name);
+
     static int WipeWritable(const std::string& active_dsu, const std::string& install_dir,
                             const std::string& name);
+    // Grow the writable partition |name| to |size| bytes, keeping its data.
+    // An ext4 filesystem on it is grown to match.
+    static int ResizeWritable(const std::string& active_dsu, const std::string& install_dir,
+                              const std::string& name, uint64_t size);
+
+    // Userdata snapshots; see GetUserdataSnapshot(). Create records the
+    // current userdata as the base of a new, empty copy-on-write image of
+    // |cow_size| bytes. Reset empties the copy-on-write image, returning
+    // userdata to the recorded state. Both fail until first-stage init maps
+    // snapshots. Remove drops one; this is a no-op without a snapshot.
+    static int CreateUserdataSnapshot(const std::string& active_dsu,
+                                      const std::string& install_dir, uint64_t cow_size);
+    static int ResetUserdataSnapshot(const std::string& active_dsu,
+                                     const std::string& install_dir);
+    static int RemoveUserdataSnapshot(const std::string& active_dsu,
+                                      const std::string& install_dir);
+
+    // If userdata is thin (see PartitionSpec.maxSize) and mostly full, grow
+    // its image, and its ext4 filesystem to match. Must not be called while
+    // the GSI is running.
+    static int GrowThinUserdata(const std::string& active_dsu, const std::string& install_dir);
 
     // Clean up install state if gsid crashed and restarted.
     void PostInstallCleanup();
-    void PostInstallCleanup(ImageManager* manager);
+    void PostInstallCleanup(ImageBackend* images);
 
     const std::string& install_dir() const { return install_dir_; }
+    const std::string& name() const { return name_; }
+    uint64_t size() const { return size_; }
+    bool read_only() const { return readOnly_; }
 
   private:
     int Finish();
+    // Free space is checked separately, by AdmitInstall().
     int PerformSanityChecks();
+    ImageBackend::ImageSpec GetImageSpec() const;
     int Preallocate();
+    bool RemoveOldImage();
+    // Returns true if the existing image already has the right size and
+    // layout, so its extents can be kept and its contents overwritten.
+    bool ReuseOldImage();
+    bool LinkSharedImage();
+    // Publish the complete image for other slots, if it matches digest_.
+    void ShareImage();
     bool Format();
-    bool CreateImage(const std::string& name, uint64_t size);
-    std::unique_ptr<MappedDevice> OpenPartition(const std::string& name);
+    // Create the image from the image pool if |use_pool| and the pool has
+    // chunks to spare, or else allocate it as usual.
+    bool CreateImage(const std::string& name, uint64_t size, bool use_pool = true);
+    // Record how fragmented the newly allocated image is, and allocate a
+    // read-only image again if it has too many extents.
+    int CheckImageLayout();
+    std::unique_ptr<ImageDevice> OpenPartition(const std::string& name);
     int CheckInstallState();
-    static const std::string GetBackingFile(std::string name);
-    bool IsFinishedWriting();
-    bool IsAshmemMapped();
-    void UnmapAshmem();
+    bool CheckWritable();
+    // Plain image data cannot be committed in the middle of a patch operation.
+    bool CheckPatchIdle();
+    // True if the image holds a complete copy of the previous install.
+    bool HasPatchBase();
+    // Pause if a failed commit was interrupted by GsiService::pauseInstall().
+    void PauseIfRequested();
+
+    // Install phase timing, persisted to DsuInstallReportFile().
+    void BeginPhase(const std::string& phase);
+    void EndPhase(uint64_t bytes = 0);
+    // End the last phase now if it is still open, because the step that
+    // began it failed.
+    void EndFailedPhase();
+    void BeginWritePhase();
+    void SaveInstallReport();
 
     GsiService* service_;
 
     std::string install_dir_;
     std::string name_;
     std::string active_dsu_;
-    std::unique_ptr<ImageManager> images_;
+    std::unique_ptr<ImageBackend> images_;
     uint64_t size_ = 0;
     bool readOnly_;
-    // Remaining data we're waiting to receive for the GSI image.
-    uint64_t gsi_bytes_written_ = 0;
     bool succeeded_ = false;
-    uint64_t ashmem_size_ = -1;
-    void* ashmem_data_ = MAP_FAILED;
-
-    std::unique_ptr<MappedDevice> system_device_;
+    bool paused_ = false;
+    bool preallocated_ = false;
+    // Set if the image left by the previous install was kept.
+    bool reused_ = false;
+    std::string digest_;
+    // Set if the image was linked to a shared copy instead of written.
+    bool shared_ = false;
+    InstallQos qos_;
+    // Paces writes for background installs. Declared before writer_, which
+    // refers to it.
+    std::unique_ptr<IoThrottle> throttle_;
+
+    // Writes data into the mapped ${name}_gsi image. Only set for read-only
+    // partitions, whose contents are streamed in by the client.
+    std::unique_ptr<PartitionWriter> writer_;
+    // Set by the first CommitGsiPatch(), and destroyed before writer_.
+    std::unique_ptr<DeltaPatchApplier> patch_;
+
+    struct Phase {
+        std::string name;
+        std::chrono::steady_clock::time_point start;
+        std::chrono::steady_clock::time_point end;
+        uint64_t bytes = 0;
+        bool ended = false;
+    };
+    std::vector<Phase> phases_;
 };
 
 }  // namespace gsi
@@ -0,0 +1,506 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "partition_writer.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+
+#include "gsi_trace.h"
+
+namespace android {
+namespace gsi {
+
+using std::chrono::steady_clock;
+
+bool WipeImageDevice(ImageDevice* device) {
+    static constexpr uint64_t kEraseSize = 1024 * 1024;
+
+    std::string zeroes(4096, 0);
+    uint64_t erase_size = std::min(kEraseSize, GetImageSize(device->fd()));
+    for (uint64_t i = 0; i < erase_size; i += zeroes.size()) {
+        if (!android::base::WriteFully(device->fd(), zeroes.data(), zeroes.size())) {
+            PLOG(ERROR) << "write " << device->path();
+            return false;
+        }
+    }
+    return true;
+}
+
+PartitionWriter::PartitionWriter(std::unique_ptr<ImageDevice>&& device, uint64_t size,
+                                 ServiceStats* stats, Callbacks&& callbacks,
+                                 const Options& options)
+    : device_(std::move(device)),
+      size_(size),
+      stats_(stats),
+      callbacks_(std::move(callbacks)),
+      throttle_(options.throttle),
+      writeback_window_(options.writeback_window) {
+    if (!options.direct_io) {
+        return;
+    }
+    direct_fd_.reset(open(device_->path().c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC));
+    if (direct_fd_ < 0) {
+        PLOG(WARNING) << "cannot open " << device_->path() << " with O_DIRECT, using buffered I/O";
+        return;
+    }
+    void* staging = mmap(nullptr, kMaxDirectChunkSize, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (staging == MAP_FAILED) {
+        PLOG(WARNING) << "cannot allocate staging buffer, using buffered I/O";
+        direct_fd_ = {};
+        return;
+    }
+    staging_ = reinterpret_cast<uint8_t*>(staging);
+    stats_->direct_chunk_size = direct_chunk_size_;
+}
+
+PartitionWriter::~PartitionWriter() {
+    if (IsAshmemMapped()) {
+        UnmapAshmem();
+    }
+    if (staging_) {
+        munmap(staging_, kMaxDirectChunkSize);
+    }
+}
+
+bool PartitionWriter::CommitChunk(int stream_fd, int64_t bytes) {
+    if (bytes < 0) {
+        LOG(ERROR) << "chunk size " << bytes << " is negative";
+        return false;
+    }
+    if (static_cast<uint64_t>(bytes) > size_ - bytes_written_) {
+        // We cannot write past the end of the image file.
+        LOG(ERROR) << "chunk size " << bytes << " exceeds remaining image size (" << size_
+                   << " expected, " << bytes_written_ << " written)";
+        return false;
+    }
+
+    auto buffer = std::make_unique<uint8_t[]>(kBlockSize);
+
+    uint64_t remaining = bytes;
+    while (remaining) {
+        if (ShouldAbort()) {
+            return false;
+        }
+
+        // In direct mode, read straight into the staging buffer to save a
+        // copy. IsDirect() is re-checked since a failed write falls back.
+        uint8_t* dest = buffer.get();
+        size_t max_to_read = std::min(static_cast<uint64_t>(kBlockSize), remaining);
+        if (IsDirect()) {
+            if (staged_ >= direct_chunk_size_ && !WriteStaged(false)) {
+                return false;
+            }
+            dest = staging_ + staged_;
+            max_to_read = std::min(static_cast<uint64_t>(direct_chunk_size_ - staged_), remaining);
+        }
+
+        ScopedTimer read_timer(nullptr);
+        ssize_t rv = TEMP_FAILURE_RETRY(read(stream_fd, dest, max_to_read));
+        stats_->commit_read_ns += std::chrono::nanoseconds(read_timer.Stop()).count();
+        if (rv < 0) {
+            PLOG(ERROR) << "read gsi chunk";
+            return false;
+        }
+        if (rv == 0) {
+            LOG(ERROR) << "no bytes left in stream";
+            return false;
+        }
+        if (dest != buffer.get()) {
+            if (!CheckChunk(rv) || !Stage(nullptr, rv)) {
+                return false;
+            }
+        } else if (!CheckChunk(rv) || !WriteChunk(dest, rv)) {
+            return false;
+        }
+        CHECK(static_cast<uint64_t>(rv) <= remaining);
+        remaining -= rv;
+        UpdateProgress();
+    }
+    return true;
+}
+
+void PartitionWriter::UpdateProgress() {
+    // Only update the progress when the % (or permille, in this case)
+    // significantly changes.
+    int new_progress = (bytes_written_ * 1000) / size_;
+    if (new_progress != progress_) {
+        progress_ = new_progress;
+        if (callbacks_.on_progress) {
+            callbacks_.on_progress(bytes_written_);
+        }
+        GSI_TRACE_INT64("gsid.bytes_committed", stats_->bytes_committed);
+    }
+}
+
+bool PartitionWriter::CommitChunk(const void* data, size_t bytes) {
+    if (!CheckChunk(bytes) || ShouldAbort()) {
+        return false;
+    }
+    return WriteChunk(reinterpret_cast<const uint8_t*>(data), bytes);
+}
+
+bool PartitionWriter::CopyChunk(uint64_t source_offset, uint64_t bytes) {
+    if (!CheckChunk(bytes)) {
+        return false;
+    }
+    if (source_offset < bytes_written_) {
+        LOG(ERROR) << "copy source " << source_offset << " has already been overwritten";
+        return false;
+    }
+    if (source_offset > size_ - bytes) {
+        LOG(ERROR) << "copy source " << source_offset << " + " << bytes
+                   << " is past the end of the image";
+        return false;
+    }
+    if (!copy_buffer_) {
+        copy_buffer_ = std::make_unique<uint8_t[]>(kCopyBufferSize);
+    }
+    // Reading ahead of the position is safe even when the source and
+    // destination overlap, since each read lands before it is overwritten.
+    while (bytes) {
+        if (ShouldAbort()) {
+            return false;
+        }
+        size_t chunk = std::min(static_cast<uint64_t>(kCopyBufferSize), bytes);
+        ScopedTimer read_timer(nullptr);
+        if (!android::base::ReadFullyAtOffset(device_->fd(), copy_buffer_.get(), chunk,
+                                              source_offset)) {
+            PLOG(ERROR) << "read " << device_->path() << " at " << source_offset;
+            return false;
+        }
+        stats_->commit_read_ns += std::chrono::nanoseconds(read_timer.Stop()).count();
+        if (!WriteChunk(copy_buffer_.get(), chunk)) {
+            return false;
+        }
+        source_offset += chunk;
+        bytes -= chunk;
+        UpdateProgress();
+    }
+    return true;
+}
+
+bool PartitionWriter::SkipChunk(uint64_t bytes) {
+    if (!CheckChunk(bytes)) {
+        return false;
+    }
+    // Write out anything staged, so the device offset catches up with the
+    // data accepted so far.
+    if (staged_ && !WriteStaged(true)) {
+        return false;
+    }
+    bytes_written_ += bytes;
+    device_offset_ += bytes;
+    UpdateProgress();
+    return true;
+}
+
+bool PartitionWriter::ZeroChunk(uint64_t bytes) {
+    if (!CheckChunk(bytes)) {
+        return false;
+    }
+    if (!copy_buffer_) {
+        copy_buffer_ = std::make_unique<uint8_t[]>(kCopyBufferSize);
+    }
+    memset(copy_buffer_.get(), 0, kCopyBufferSize);
+    while (bytes) {
+        if (ShouldAbort()) {
+            return false;
+        }
+        size_t chunk = std::min(static_cast<uint64_t>(kCopyBufferSize), bytes);
+        if (!WriteChunk(copy_buffer_.get(), chunk)) {
+            return false;
+        }
+        bytes -= chunk;
+        UpdateProgress();
+    }
+    return true;
+}
+
+bool PartitionWriter::WriteChunk(const uint8_t* data, size_t bytes) {
+    if (IsDirect()) {
+        return WriteDirect(data, bytes);
+    }
+    if (!WriteBuffered(data, bytes)) {
+        return false;
+    }
+    Account(bytes);
+    return true;
+}
+
+bool PartitionWriter::CheckChunk(uint64_t bytes) {
+    if (bytes > size_ - bytes_written_) {
+        // We cannot write past the end of the image file.
+        LOG(ERROR) << "chunk size " << bytes << " exceeds remaining image size (" << size_
+                   << " expected, " << bytes_written_ << " written)";
+        return false;
+    }
+    return true;
+}
+
+bool PartitionWriter::ShouldAbort() {
+    return callbacks_.should_abort && callbacks_.should_abort();
+}
+
+void PartitionWriter::Throttle(size_t bytes) {
+    // An abort cuts the wait short, but the data in hand is still written,
+    // since it has already been taken from the stream. The commit stops at
+    // the next ShouldAbort() check.
+    if (throttle_) {
+        throttle_->Acquire(bytes, callbacks_.should_abort);
+    }
+}
+
+void PartitionWriter::Account(size_t bytes) {
+    stats_->bytes_committed += bytes;
+    bytes_written_ += bytes;
+}
+
+bool PartitionWriter::WriteBuffered(const uint8_t* data, size_t bytes) {
+    Throttle(bytes);
+    ScopedTimer timer(&stats_->chunk_write_us);
+    if (!android::base::WriteFullyAtOffset(device_->fd(), data, bytes, device_offset_)) {
+        PLOG(ERROR) << "write failed";
+        return false;
+    }
+    stats_->commit_write_ns += std::chrono::nanoseconds(timer.Stop()).count();
+    device_offset_ += bytes;
+    WriteBehind();
+    return true;
+}
+
+void PartitionWriter::DisableDirectIo() {
+    direct_fd_ = {};
+    // Nothing written so far is in the page cache.
+    if (writeback_window_) {
+        writeback_offset_ = device_offset_ - device_offset_ % writeback_window_;
+    }
+}
+
+void PartitionWriter::WriteBehind() {
+    // Direct writes bypass the page cache, apart from the unaligned tail.
+    if (!writeback_window_ || IsDirect()) {
+        return;
+    }
+    int fd = device_->fd();
+    while (device_offset_ - writeback_offset_ >= writeback_window_) {
+        uint64_t offset = writeback_offset_;
+        if (sync_file_range(fd, offset, writeback_window_, SYNC_FILE_RANGE_WRITE)) {
+            PLOG(WARNING) << "sync_file_range failed, disabling write-behind";
+            writeback_window_ = 0;
+            return;
+        }
+        if (offset >= writeback_window_) {
+            // The previous window has had a whole window's worth of writes
+            // to complete, so this wait is usually short. Its pages are clean
+            // afterwards, and no longer needed.
+            uint64_t previous = offset - writeback_window_;
+            ScopedTimer timer(&stats_->writeback_wait_us);
+            if (sync_file_range(fd, previous, writeback_window_,
+                                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                                        SYNC_FILE_RANGE_WAIT_AFTER)) {
+                PLOG(WARNING) << "sync_file_range failed, disabling write-behind";
+                writeback_window_ = 0;
+                return;
+            }
+            posix_fadvise(fd, previous, writeback_window_, POSIX_FADV_DONTNEED);
+        }
+        writeback_offset_ += writeback_window_;
+    }
+}
+
+bool PartitionWriter::WriteDirect(const uint8_t* data, size_t bytes) {
+    // Aligned client buffers, such as the ashmem region, are written in
+    // place; anything else goes through the staging buffer.
+    while (bytes && IsDirect() && !staged_ &&
+           reinterpret_cast<uintptr_t>(data) % kBlockSize == 0 && bytes >= kBlockSize) {
+        size_t chunk = std::min(bytes, direct_chunk_size_) & ~(kBlockSize - 1);
+
+        Throttle(chunk);
+        ScopedTimer timer(&stats_->chunk_write_us);
+        if (!android::base::WriteFullyAtOffset(direct_fd_, data, chunk, device_offset_)) {
+            PLOG(WARNING) << "O_DIRECT write failed, using buffered I/O";
+            DisableDirectIo();
+            break;
+        }
+        auto elapsed = timer.Stop();
+        stats_->commit_write_ns += std::chrono::nanoseconds(elapsed).count();
+        stats_->direct_bytes_written += chunk;
+        device_offset_ += chunk;
+        Account(chunk);
+        AdaptDirectChunkSize(chunk, elapsed);
+
+        data += chunk;
+        bytes -= chunk;
+    }
+    if (!bytes) {
+        return !IsFinishedWriting() || WriteStaged(true);
+    }
+    if (!IsDirect()) {
+        if (!WriteStaged(true) || !WriteBuffered(data, bytes)) {
+            return false;
+        }
+        Account(bytes);
+        return true;
+    }
+    return Stage(data, bytes);
+}
+
+bool PartitionWriter::Stage(const uint8_t* data, size_t bytes) {
+    // A null |data| means the bytes were read into place by the caller.
+    while (bytes) {
+        if (staged_ >= direct_chunk_size_ && !WriteStaged(false)) {
+            return false;
+        }
+        size_t chunk = bytes;
+        if (data) {
+            chunk = std::min(bytes, direct_chunk_size_ - staged_);
+            memcpy(staging_ + staged_, data, chunk);
+            data += chunk;
+        }
+        Account(chunk);
+        staged_ += chunk;
+        bytes -= chunk;
+    }
+    if (IsFinishedWriting()) {
+        return WriteStaged(true);
+    }
+    if (staged_ >= direct_chunk_size_) {
+        return WriteStaged(false);
+    }
+    return true;
+}
+
+bool PartitionWriter::WriteStaged(bool final) {
+    size_t aligned = staged_ & ~(kBlockSize - 1);
+    if (aligned && IsDirect()) {
+        Throttle(aligned);
+        ScopedTimer timer(&stats_->chunk_write_us);
+        if (android::base::WriteFullyAtOffset(direct_fd_, staging_, aligned, device_offset_)) {
+            auto elapsed = timer.Stop();
+            stats_->commit_write_ns += std::chrono::nanoseconds(elapsed).count();
+            stats_->direct_bytes_written += aligned;
+            device_offset_ += aligned;
+            AdaptDirectChunkSize(aligned, elapsed);
+        } else {
+            PLOG(WARNING) << "O_DIRECT write failed, using buffered I/O";
+            DisableDirectIo();
+            aligned = 0;
+        }
+    }
+
+    // Once direct I/O is off, nothing is left staged.
+    size_t tail = staged_ - aligned;
+    if ((final || !IsDirect()) && tail) {
+        if (!WriteBuffered(staging_ + aligned, tail)) {
+            return false;
+        }
+        tail = 0;
+    } else if (tail) {
+        memmove(staging_, staging_ + aligned, tail);
+    }
+    staged_ = tail;
+    return true;
+}
+
+void PartitionWriter::AdaptDirectChunkSize(size_t bytes, steady_clock::duration elapsed) {
+    // Hill-climb: after each window of writes, keep moving the write size in
+    // the same direction while throughput improves, and turn around when it
+    // drops.
+    static constexpr size_t kWindowWrites = 8;
+
+    window_bytes_ += bytes;
+    window_time_ += elapsed;
+    if (++window_writes_ < kWindowWrites) {
+        return;
+    }
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(window_time_).count();
+    double throughput = ns ? static_cast<double>(window_bytes_) / ns : 0;
+    if (throughput < last_direct_throughput_) {
+        grow_direct_chunk_ = !grow_direct_chunk_;
+    }
+    last_direct_throughput_ = throughput;
+    window_writes_ = 0;
+    window_bytes_ = 0;
+    window_time_ = {};
+
+    if (grow_direct_chunk_) {
+        direct_chunk_size_ = std::min(direct_chunk_size_ * 2, kMaxDirectChunkSize);
+        grow_direct_chunk_ = direct_chunk_size_ < kMaxDirectChunkSize;
+    } else {
+        direct_chunk_size_ = std::max(direct_chunk_size_ / 2, kMinDirectChunkSize);
+        grow_direct_chunk_ = direct_chunk_size_ == kMinDirectChunkSize;
+    }
+    stats_->direct_chunk_size = direct_chunk_size_;
+}
+
+bool PartitionWriter::MapAshmem(int fd, size_t size) {
+    if (IsAshmemMapped()) {
+        UnmapAshmem();
+    }
+    ashmem_size_ = size;
+    ashmem_data_ = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return ashmem_data_ != MAP_FAILED;
+}
+
+void PartitionWriter::UnmapAshmem() {
+    if (munmap(ashmem_data_, ashmem_size_) != 0) {
+        PLOG(ERROR) << "cannot munmap";
+        return;
+    }
+    ashmem_data_ = MAP_FAILED;
+    ashmem_size_ = 0;
+}
+
+bool PartitionWriter::CommitAshmemChunk(size_t bytes) {
+    if (!IsAshmemMapped()) {
+        PLOG(ERROR) << "ashmem is not mapped";
+        return false;
+    }
+    if (bytes > ashmem_size_) {
+        LOG(ERROR) << "chunk size " << bytes << " exceeds ashmem size " << ashmem_size_;
+        return false;
+    }
+    bool success = CommitChunk(ashmem_data_, bytes);
+    GSI_TRACE_INT64("gsid.bytes_committed", stats_->bytes_committed);
+    if (success && IsFinishedWriting()) {
+        UnmapAshmem();
+    }
+    return success;
+}
+
+bool PartitionWriter::Flush() {
+    if (staged_ && !WriteStaged(true)) {
+        return false;
+    }
+    GSI_TRACE_NAME("fsync");
+    ScopedTimer timer(&stats_->finish_fsync_us);
+    if (fsync(device_->fd())) {
+        PLOG(ERROR) << "fsync failed for " << device_->path();
+        return false;
+    }
+    return true;
+}
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "service_stats.h"
+
+#include <algorithm>
+#include <map>
+#include <sstream>
+
+#include <android-base/stringprintf.h>
+
+#include "gsi_trace.h"
+
+namespace android {
+namespace gsi {
+
+using android::base::StringPrintf;
+using std::chrono::steady_clock;
+
+void Histogram::Record(uint64_t value) {
+    // Bucket N holds values in [2^(N-1), 2^N), and bucket 0 holds zero.
+    size_t bucket = value ? 64 - __builtin_clzll(value) : 0;
+    buckets_[std::min(bucket, kNumBuckets - 1)]++;
+    count_++;
+    sum_ += value;
+
+    uint64_t max = max_;
+    while (value > max && !max_.compare_exchange_weak(max, value)) {
+    }
+}
+
+void Histogram::Record(steady_clock::duration duration) {
+    Record(std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+}
+
+uint64_t Histogram::Percentile(double percentile) const {
+    uint64_t count = count_;
+    if (!count) {
+        return 0;
+    }
+    uint64_t target = static_cast<uint64_t>(count * percentile / 100);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kNumBuckets; i++) {
+        seen += buckets_[i];
+        if (seen > target) {
+            return i ? std::min<uint64_t>((1ULL << i) - 1, max_) : 0;
+        }
+    }
+    return max_;
+}
+
+std::string Histogram::ToString() const {
+    uint64_t count = count_;
+    if (!count) {
+        return "count=0";
+    }
+    return StringPrintf("count=%llu avg=%llu p50=%llu p90=%llu p99=%llu max=%llu",
+                        static_cast<unsigned long long>(count),
+                        static_cast<unsigned long long>(sum_ / count),
+                        static_cast<unsigned long long>(Percentile(50)),
+                        static_cast<unsigned long long>(Percentile(90)),
+                        static_cast<unsigned long long>(Percentile(99)),
+                        static_cast<unsigned long long>(max_));
+}
+
+ScopedTimer::ScopedTimer(Histogram* histogram)
+    : histogram_(histogram), start_(steady_clock::now()) {}
+
+steady_clock::duration ScopedTimer::Stop() {
+    auto elapsed = steady_clock::now() - start_;
+    if (histogram_) {
+        histogram_->Record(elapsed);
+        histogram_ = nullptr;
+    }
+    return elapsed;
+}
+
+TimedLockGuard::TimedLockGuard(std::mutex& lock, LockStats* stats) : lock_(lock) {
+    GSI_TRACE_INT64(stats->waiters_counter, ++stats->waiters);
+    {
+        ScopedTimer timer(&stats->wait_us);
+        lock_.lock();
+    }
+    GSI_TRACE_INT64(stats->waiters_counter, --stats->waiters);
+}
+
+void ServiceStats::RecordBinderCall(const char* method, const char* prefix) {
+    auto find = [&](size_t begin, size_t end) -> BinderCallCount* {
+        for (size_t i = begin; i < end; i++) {
+            if (binder_calls_[i].method == method && binder_calls_[i].prefix == prefix) {
+                return &binder_calls_[i];
+            }
+        }
+        return nullptr;
+    };
+    size_t count = num_binder_calls_.load(std::memory_order_acquire);
+    auto entry = find(0, count);
+    if (!entry) {
+        std::lock_guard<std::mutex> guard(binder_calls_lock_);
+        size_t new_count = num_binder_calls_.load(std::memory_order_relaxed);
+        entry = find(count, new_count);
+        if (!entry) {
+            if (new_count == kMaxBinderMethods) {
+                return;
+            }
+            entry = &binder_calls_[new_count];
+            entry->prefix = prefix;
+            entry->method = method;
+            num_binder_calls_.store(new_count + 1, std::memory_order_release);
+        }
+    }
+    entry->count.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::string ServiceStats::ToString() const {
+    auto ns_to_ms = [](uint64_t ns) -> unsigned long long { return ns / 1000000; };
+
+    std::stringstream text;
+    text << "bytes committed: " << bytes_committed << "\n";
+    text << "chunk write latency (us): " << chunk_write_us.ToString() << "\n";
+    text << "commit time (ms): read=" << ns_to_ms(commit_read_ns)
+         << " write=" << ns_to_ms(commit_write_ns) << "\n";
+    text << "direct I/O: " << direct_bytes_written << " bytes, chunk size " << direct_chunk_size
+         << "\n";
+    text << "write-behind wait (us): " << writeback_wait_us.ToString() << "\n";
+    text << "throttle: rate " << throttle_rate << " bytes/s, wait (us): "
+         << throttle_wait_us.ToString() << "\n";
+    text << "delta: " << delta_kept_bytes << " bytes kept, " << delta_copied_bytes
+         << " copied, " << delta_data_bytes << " from patch\n";
+    text << "block hashes: " << block_hash_bytes << " bytes in " << ns_to_ms(block_hash_ns)
+         << " ms\n";
+    text << "finish fsync (us): " << finish_fsync_us.ToString() << "\n";
+
+    uint64_t create_ns = create_image_ns;
+    uint64_t create_bytes = create_image_bytes;
+    text << "image allocation: " << create_bytes << " bytes in " << ns_to_ms(create_ns) << " ms";
+    if (create_ns) {
+        text << " (" << (create_bytes * 1000 / create_ns) << " MB/s)";
+    }
+    text << ", " << reused_image_bytes << " bytes reused, " << shared_image_bytes
+         << " bytes shared, " << pool_image_bytes << " bytes from the image pool\n";
+    text << "image extents: " << image_extents.ToString() << ", " << reallocated_images
+         << " reallocated\n";
+    text << "deferred deletion: " << reaped_image_bytes << " bytes freed, " << discarded_bytes
+         << " bytes discarded\n";
+    text << "image delete latency (us): " << delete_image_us.ToString() << "\n";
+
+    text << "lock_ wait (us): " << lock.wait_us.ToString() << "\n";
+    text << "progress_lock_ wait (us): " << progress_lock.wait_us.ToString() << "\n";
+
+    // The same method may have been recorded through several pointers.
+    std::map<std::string, uint64_t> binder_calls;
+    size_t num_binder_calls = num_binder_calls_.load(std::memory_order_acquire);
+    for (size_t i = 0; i < num_binder_calls; i++) {
+        const auto& entry = binder_calls_[i];
+        binder_calls[std::string(entry.prefix) + entry.method] += entry.count;
+    }
+    text << "binder calls:\n";
+    for (const auto& [method, count] : binder_calls) {
+        text << "    " << method << ": " << count << "\n";
+    }
+    return text.str();
+}
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,228 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "slot_reaper.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <libgsi/libgsi.h>
+
+#include "fiemap_image_backend.h"
+#include "file_paths.h"
+#include "gsi_trace.h"
+
+namespace android {
+namespace gsi {
+
+using android::base::unique_fd;
+
+// Freed blocks are discarded this much at a time, so that the throttle can
+// space the discards out and each one returns promptly.
+static constexpr uint64_t kDiscardChunkSize = 64 * 1024 * 1024;
+
+bool MarkSlotDeleted(const std::string& dsu_slot, const std::string& install_dir) {
+    // Renamed into place, so that a reaper never reads a partial path.
+    auto file = DsuDeletePendingFile(dsu_slot);
+    auto tmp_file = file + ".tmp";
+    if (!android::base::WriteStringToFile(install_dir, tmp_file)) {
+        PLOG(ERROR) << "write " << tmp_file;
+        return false;
+    }
+    if (rename(tmp_file.c_str(), file.c_str())) {
+        PLOG(ERROR) << "rename " << tmp_file << " to " << file;
+        unlink(tmp_file.c_str());
+        return false;
+    }
+    return true;
+}
+
+std::vector<std::string> GetDeletedSlots() {
+    std::vector<std::string> dsu_slots;
+    auto d = std::unique_ptr<DIR, decltype(&closedir)>(opendir(DSU_METADATA_PREFIX), closedir);
+    if (d != nullptr) {
+        struct dirent* de;
+        while ((de = readdir(d.get())) != nullptr) {
+            if (de->d_name[0] == '.') {
+                continue;
+            }
+            auto dsu_slot = std::string(de->d_name);
+            if (access(DsuDeletePendingFile(dsu_slot).c_str(), F_OK) != 0) {
+                continue;
+            }
+            dsu_slots.push_back(dsu_slot);
+        }
+    }
+    return dsu_slots;
+}
+
+// The lock serializing deletions in |dsu_slot|. The metadata directory is
+// locked, rather than the mark, since the mark comes and goes.
+static unique_fd LockSlot(const std::string& dsu_slot) {
+    auto dir = MetadataDir(dsu_slot);
+    unique_fd fd(open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (fd < 0) {
+        PLOG(ERROR) << "open " << dir;
+        return {};
+    }
+    if (TEMP_FAILURE_RETRY(flock(fd, LOCK_EX)) < 0) {
+        PLOG(ERROR) << "flock " << dir;
+        return {};
+    }
+    return fd;
+}
+
+// Discard the free blocks in |ranges| of the filesystem holding
+// |install_dir|. Blocks that were reallocated in the meantime are left
+// alone by FITRIM.
+static void DiscardRanges(const std::string& install_dir,
+                          const std::vector<FiemapImageBackend::DiskRange>& ranges,
+                          IoThrottle* throttle, ServiceStats* stats) {
+    GSI_TRACE_CALL();
+    if (ranges.empty()) {
+        return;
+    }
+    unique_fd fd(open(install_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (fd < 0) {
+        PLOG(ERROR) << "open " << install_dir;
+        return;
+    }
+    for (const auto& range : ranges) {
+        for (uint64_t done = 0; done < range.length; done += kDiscardChunkSize) {
+            uint64_t length = std::min(kDiscardChunkSize, range.length - done);
+            if (throttle) {
+                throttle->Acquire(length);
+            }
+            struct fstrim_range trim = {
+                    .start = range.offset + done,
+                    .len = length,
+                    .minlen = 0,
+            };
+            if (ioctl(fd, FITRIM, &trim) < 0) {
+                // Not every filesystem or device supports discard. The
+                // blocks are free either way.
+                PLOG(WARNING) << "FITRIM " << install_dir;
+                return;
+            }
+            // FITRIM reports how much it discarded in |len|.
+            stats->discarded_bytes += trim.len;
+        }
+    }
+}
+
+bool ReapDeletedSlot(const std::string& dsu_slot, bool discard, IoThrottle* throttle,
+                     ServiceStats* stats) {
+    GSI_TRACE_CALL();
+    auto pending_file = DsuDeletePendingFile(dsu_slot);
+    while (true) {
+        auto lock = LockSlot(dsu_slot);
+        if (lock < 0) {
+            return false;
+        }
+        // Another reaper may have finished the slot while we waited.
+        std::string install_dir;
+        if (!android::base::ReadFileToString(pending_file, &install_dir)) {
+            if (errno == ENOENT) {
+                return true;
+            }
+            PLOG(ERROR) << "read " << pending_file;
+            return false;
+        }
+        auto backend = FiemapImageBackend::Open(MetadataDir(dsu_slot), install_dir);
+        if (!backend) {
+            return false;
+        }
+        // Extensions and copy-on-write images are not DSU partitions;
+        // DeleteBackingImage() removes them.
+        std::string image;
+        for (auto&& name : backend->manager()->GetAllBackingImages()) {
+            if (android::base::EndsWith(name, kDsuPostfix)) {
+                image = name;
+                break;
+            }
+        }
+        if (image.empty()) {
+            // Images this slot published may have lost their last other user.
+            FiemapImageBackend::RemoveUnusedSharedImages(install_dir);
+            std::string message;
+            if (!android::base::RemoveFileIfExists(pending_file, &message)) {
+                LOG(ERROR) << message;
+                return false;
+            }
+            LOG(INFO) << "deleted the images of removed DSU slot " << dsu_slot;
+            return true;
+        }
+
+        // A link to a shared image frees nothing, so it has nothing to discard.
+        uint64_t bytes = backend->GetImageAllocation(image);
+        std::vector<FiemapImageBackend::DiskRange> ranges;
+        if (discard && bytes && !backend->GetImageRanges(image, &ranges)) {
+            ranges.clear();
+        }
+        if (backend->IsImageMapped(image) && !backend->UnmapImageDevice(image)) {
+            LOG(ERROR) << "could not unmap " << image;
+            return false;
+        }
+        {
+            ScopedTimer timer(&stats->delete_image_us);
+            if (!backend->DeleteBackingImage(image)) {
+                LOG(ERROR) << "could not delete " << image;
+                return false;
+            }
+        }
+        stats->reaped_image_bytes += bytes;
+        // Discarding is slow, and needs no lock.
+        lock.reset();
+        DiscardRanges(install_dir, ranges, throttle, stats);
+    }
+}
+
+void ReapDeletedSlots(ServiceStats* stats) {
+    GSI_TRACE_CALL();
+    ScopedIoPriority priority(InstallQos::kIdle);
+    for (auto slots = GetDeletedSlots(); !slots.empty(); slots = GetDeletedSlots()) {
+        bool reaped = false;
+        for (const auto& slot : slots) {
+            std::string install_dir;
+            if (!android::base::ReadFileToString(DsuDeletePendingFile(slot), &install_dir)) {
+                continue;
+            }
+            auto throttle = IoThrottle::ForQos(InstallQos::kIdle, install_dir, stats);
+            reaped |= ReapDeletedSlot(slot, true, throttle.get(), stats);
+        }
+        // Slots that keep failing are retried by the next reaper, rather
+        // than in a loop.
+        if (!reaped) {
+            break;
+        }
+    }
+}
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "io_throttle.h"
+#include "service_stats.h"
+
+namespace android {
+namespace gsi {
+
+// Removing a DSU slot only marks its images for deletion, since unlinking
+// multi-GiB pinned files can stall for seconds. A reaper deletes them later,
+// one image at a time, and then discards the blocks they held. The mark is
+// kept in /metadata, so that the work is picked up again after gsid or the
+// device restarts. Each image is deleted under a lock on the slot's
+// metadata directory, so reapers may run in several threads or processes
+// at once.
+
+// Mark the images of |dsu_slot|, installed in |install_dir|, for deletion.
+bool MarkSlotDeleted(const std::string& dsu_slot, const std::string& install_dir);
+
+// Slots with images waiting to be deleted.
+std::vector<std::string> GetDeletedSlots();
+
+// Delete the remaining images of |dsu_slot| and clear its mark, waiting for
+// any other reaper of the slot. The freed blocks are discarded if
+// |discard|, rate limited by |throttle| unless it is null. Returns false if
+// an image could not be deleted; the slot stays marked, to be tried again.
+bool ReapDeletedSlot(const std::string& dsu_slot, bool discard, IoThrottle* throttle,
+                     ServiceStats* stats);
+
+// Reap every marked slot, including those marked while this runs, at idle
+// I/O priority.
+void ReapDeletedSlots(ServiceStats* stats);
+
+}  // namespace gsi
+}  // namespace android
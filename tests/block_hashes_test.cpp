@@ -0,0 +1,137 @@
+//
+// Copyright (C) 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+#include <openssl/sha.h>
+
+#include "block_hashes.h"
+
+using namespace android::gsi;
+
+static constexpr uint64_t kMiB = 1024 * 1024;
+
+class BlockHashesTest : public ::testing::Test {
+  protected:
+    // Makes |file_| a sparse file of |size| bytes, with data that differs
+    // from block to block around every |stride| bytes, so that misplaced
+    // hashes are noticed.
+    void CreateFile(uint64_t size, uint64_t stride) {
+        ASSERT_EQ(ftruncate(file_.fd, size), 0);
+        size_ = size;
+        for (uint64_t offset = 0; offset < size; offset += stride) {
+            for (uint64_t at : {offset, offset + stride - 4096, offset + stride - 1}) {
+                if (at >= size) {
+                    continue;
+                }
+                std::string data = std::to_string(at);
+                data.resize(std::min(uint64_t(data.size()), size - at));
+                ASSERT_TRUE(android::base::WriteFullyAtOffset(file_.fd, data.data(), data.size(),
+                                                              at));
+            }
+        }
+    }
+
+    // The manifest computed one block at a time.
+    std::vector<uint8_t> SerialHashes(uint32_t block_size) {
+        std::vector<uint8_t> hashes;
+        std::vector<uint8_t> buffer(block_size);
+        for (uint64_t offset = 0; offset < size_; offset += block_size) {
+            uint64_t bytes = std::min(uint64_t(block_size), size_ - offset);
+            EXPECT_TRUE(android::base::ReadFullyAtOffset(file_.fd, buffer.data(), bytes, offset));
+            uint8_t hash[SHA256_DIGEST_LENGTH];
+            SHA256(buffer.data(), bytes, hash);
+            hashes.insert(hashes.end(), hash, hash + sizeof(hash));
+        }
+        return hashes;
+    }
+
+    TemporaryFile file_;
+    uint64_t size_ = 0;
+};
+
+TEST_F(BlockHashesTest, MatchesSerialHashes) {
+    CreateFile(10 * kMiB, kMiB);
+    for (uint32_t block_size : {4096u, 12288u, 1024u * 1024u, 3u * 1024u * 1024u}) {
+        std::vector<uint8_t> hashes;
+        ASSERT_TRUE(ComputeBlockHashes(file_.fd, size_, block_size, &hashes));
+        EXPECT_EQ(hashes, SerialHashes(block_size)) << "block size " << block_size;
+    }
+}
+
+TEST_F(BlockHashesTest, PartitionsBlocksAcrossThreads) {
+    // Large enough to be split into ranges, with a block size that does not
+    // divide the range boundaries evenly.
+    CreateFile(200 * kMiB + 4096, 16 * kMiB);
+    for (uint32_t block_size : {12288u, 3u * 1024u * 1024u}) {
+        std::vector<uint8_t> hashes;
+        std::atomic<uint64_t> progress = 0;
+        auto on_progress = [&](uint64_t bytes) -> bool {
+            uint64_t seen = progress;
+            while (seen < bytes && !progress.compare_exchange_weak(seen, bytes)) {
+            }
+            return true;
+        };
+        ASSERT_TRUE(ComputeBlockHashes(file_.fd, size_, block_size, &hashes, on_progress));
+        EXPECT_EQ(hashes, SerialHashes(block_size)) << "block size " << block_size;
+        EXPECT_EQ(progress, size_) << "block size " << block_size;
+    }
+}
+
+TEST_F(BlockHashesTest, HashesLastBlockOverItsLength) {
+    CreateFile(3 * kMiB + 100, 512 * 1024);
+    std::vector<uint8_t> hashes;
+    ASSERT_TRUE(ComputeBlockHashes(file_.fd, size_, kMiB, &hashes));
+    ASSERT_EQ(hashes.size(), 4 * kBlockHashSize);
+    EXPECT_EQ(hashes, SerialHashes(kMiB));
+
+    uint8_t tail[100];
+    ASSERT_TRUE(android::base::ReadFullyAtOffset(file_.fd, tail, sizeof(tail), 3 * kMiB));
+    uint8_t hash[SHA256_DIGEST_LENGTH];
+    SHA256(tail, sizeof(tail), hash);
+    EXPECT_TRUE(std::equal(hash, hash + sizeof(hash), hashes.begin() + 3 * kBlockHashSize));
+}
+
+TEST_F(BlockHashesTest, EmptyImageHasNoHashes) {
+    std::vector<uint8_t> hashes(1);
+    ASSERT_TRUE(ComputeBlockHashes(file_.fd, 0, 4096, &hashes));
+    EXPECT_TRUE(hashes.empty());
+}
+
+TEST_F(BlockHashesTest, RejectsInvalidBlockSizes) {
+    CreateFile(kMiB, kMiB);
+    std::vector<uint8_t> hashes;
+    for (uint32_t block_size : {0u, 512u, 4095u, 6144u, kMaxHashBlockSize + 4096}) {
+        EXPECT_FALSE(ComputeBlockHashes(file_.fd, size_, block_size, &hashes))
+                << "block size " << block_size;
+    }
+    EXPECT_TRUE(ComputeBlockHashes(file_.fd, size_, kMaxHashBlockSize, &hashes));
+}
+
+TEST_F(BlockHashesTest, ProgressCanAbort) {
+    CreateFile(200 * kMiB, 16 * kMiB);
+    std::vector<uint8_t> hashes;
+    auto on_progress = [](uint64_t) -> bool { return false; };
+    EXPECT_FALSE(ComputeBlockHashes(file_.fd, size_, kMiB, &hashes, on_progress));
+}
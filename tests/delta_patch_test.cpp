@@ -0,0 +1,234 @@
+//
+// Copyright (C) 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "delta_patch.h"
+#include "file_image_backend.h"
+#include "partition_writer.h"
+#include "service_stats.h"
+
+using namespace android::gsi;
+
+using Op = DeltaPatchApplier::DeltaOpHeader;
+
+static constexpr char kImageName[] = "system_gsi";
+static constexpr uint64_t kBlock = 4096;
+
+class DeltaPatchTest : public ::testing::Test {
+  protected:
+    void SetUp() override { CreateImage(16 * kBlock); }
+
+    // Creates an image of |size| bytes holding a previous install, in which
+    // every byte is derived from its offset, and a writer replacing it.
+    void CreateImage(uint64_t size) {
+        writer_ = nullptr;
+        images_ = std::make_unique<FileImageBackend>(dir_.path);
+        if (images_->BackingImageExists(kImageName)) {
+            ASSERT_TRUE(images_->DeleteBackingImage(kImageName));
+        }
+        ASSERT_TRUE(images_->CreateBackingImage(kImageName, size, true, nullptr));
+        base_.resize(size);
+        for (uint64_t i = 0; i < size; i++) {
+            base_[i] = static_cast<uint8_t>(i / kBlock * 31 + i % 251);
+        }
+        ASSERT_TRUE(android::base::WriteStringToFile(std::string(base_.begin(), base_.end()),
+                                                     images_->GetImagePath(kImageName)));
+        auto device = images_->OpenImageDevice(kImageName);
+        ASSERT_NE(device, nullptr);
+        writer_ = std::make_unique<PartitionWriter>(std::move(device), size, &stats_,
+                                                    PartitionWriter::Callbacks{});
+        applier_ = std::make_unique<DeltaPatchApplier>(writer_.get(), &stats_);
+        patch_.clear();
+    }
+
+    void AddOp(uint32_t type, uint64_t length, uint64_t source_offset = 0) {
+        Op op = {.type = type, .reserved = 0, .length = length, .source_offset = source_offset};
+        auto bytes = reinterpret_cast<const uint8_t*>(&op);
+        patch_.insert(patch_.end(), bytes, bytes + sizeof(op));
+    }
+    void AddData(const std::vector<uint8_t>& data) {
+        AddOp(DeltaPatchApplier::kData, data.size());
+        patch_.insert(patch_.end(), data.begin(), data.end());
+    }
+
+    // Applies the patch in pieces of at most |step| bytes. Returns false as
+    // soon as a piece is not fully consumed.
+    bool Apply(size_t step) {
+        TemporaryFile stream;
+        if (!android::base::WriteFully(stream.fd, patch_.data(), patch_.size()) ||
+            lseek(stream.fd, 0, SEEK_SET) != 0) {
+            return false;
+        }
+        for (size_t offset = 0; offset < patch_.size(); offset += step) {
+            int64_t bytes = std::min(step, patch_.size() - offset);
+            if (applier_->Apply(stream.fd, bytes) != bytes) {
+                return false;
+            }
+        }
+        return applier_->idle();
+    }
+
+    std::vector<uint8_t> ReadImage() {
+        std::string content;
+        EXPECT_TRUE(android::base::ReadFileToString(images_->GetImagePath(kImageName), &content));
+        return std::vector<uint8_t>(content.begin(), content.end());
+    }
+
+    std::vector<uint8_t> Base(uint64_t offset, uint64_t length) {
+        return std::vector<uint8_t>(base_.begin() + offset, base_.begin() + offset + length);
+    }
+
+    TemporaryDir dir_;
+    ServiceStats stats_;
+    std::unique_ptr<FileImageBackend> images_;
+    std::unique_ptr<PartitionWriter> writer_;
+    std::unique_ptr<DeltaPatchApplier> applier_;
+    std::vector<uint8_t> base_;
+    std::vector<uint8_t> patch_;
+};
+
+TEST_F(DeltaPatchTest, AppliesEveryOperation) {
+    std::vector<uint8_t> data(2 * kBlock, 0x5a);
+    // Blocks 0-1 come from blocks 4-5, block 2-3 from the patch, 4-5 are
+    // zeroed, and the rest is kept.
+    AddOp(DeltaPatchApplier::kCopy, 2 * kBlock, 4 * kBlock);
+    AddData(data);
+    AddOp(DeltaPatchApplier::kZero, 2 * kBlock);
+    AddOp(DeltaPatchApplier::kCopy, 10 * kBlock, 6 * kBlock);
+    ASSERT_TRUE(Apply(patch_.size()));
+    EXPECT_TRUE(writer_->IsFinishedWriting());
+
+    auto expected = Base(4 * kBlock, 2 * kBlock);
+    expected.insert(expected.end(), data.begin(), data.end());
+    expected.insert(expected.end(), 2 * kBlock, 0);
+    auto rest = Base(6 * kBlock, 10 * kBlock);
+    expected.insert(expected.end(), rest.begin(), rest.end());
+    EXPECT_EQ(ReadImage(), expected);
+    EXPECT_EQ(stats_.delta_copied_bytes, 2 * kBlock);
+    EXPECT_EQ(stats_.delta_data_bytes, 2 * kBlock);
+    EXPECT_EQ(stats_.delta_kept_bytes, 10 * kBlock);
+}
+
+TEST_F(DeltaPatchTest, SplitsAtAnyByte) {
+    std::vector<uint8_t> data(3 * kBlock);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = static_cast<uint8_t>(i * 7);
+    }
+    AddOp(DeltaPatchApplier::kCopy, kBlock, 8 * kBlock);
+    AddData(data);
+    AddOp(DeltaPatchApplier::kZero, 4 * kBlock);
+    AddOp(DeltaPatchApplier::kCopy, 8 * kBlock, 8 * kBlock);
+    auto patch = patch_;
+
+    std::vector<uint8_t> expected;
+    for (size_t step : {size_t(1), size_t(7), sizeof(Op) - 1, sizeof(Op) + 1, size_t(4099)}) {
+        CreateImage(16 * kBlock);
+        patch_ = patch;
+        ASSERT_TRUE(Apply(step)) << "step " << step;
+        EXPECT_TRUE(writer_->IsFinishedWriting()) << "step " << step;
+        if (expected.empty()) {
+            expected = ReadImage();
+        } else {
+            EXPECT_EQ(ReadImage(), expected) << "step " << step;
+        }
+    }
+}
+
+TEST_F(DeltaPatchTest, CopyCompletesWhenHeaderEndsChunk) {
+    // Nothing follows a copy header, so it runs even though the chunk ends
+    // right after it.
+    AddOp(DeltaPatchApplier::kCopy, 16 * kBlock, 0);
+    TemporaryFile stream;
+    ASSERT_TRUE(android::base::WriteFully(stream.fd, patch_.data(), patch_.size()));
+    ASSERT_EQ(lseek(stream.fd, 0, SEEK_SET), 0);
+    ASSERT_EQ(applier_->Apply(stream.fd, patch_.size()), patch_.size());
+    EXPECT_TRUE(writer_->IsFinishedWriting());
+    EXPECT_EQ(ReadImage(), base_);
+}
+
+TEST_F(DeltaPatchTest, OverlappingCopyReadsAhead) {
+    // Shift the whole image down by one block; the source overlaps the
+    // destination.
+    AddOp(DeltaPatchApplier::kCopy, 15 * kBlock, kBlock);
+    AddOp(DeltaPatchApplier::kZero, kBlock);
+    ASSERT_TRUE(Apply(patch_.size()));
+
+    auto expected = Base(kBlock, 15 * kBlock);
+    expected.insert(expected.end(), kBlock, 0);
+    EXPECT_EQ(ReadImage(), expected);
+}
+
+TEST_F(DeltaPatchTest, RejectsCopyFromOverwrittenBlocks) {
+    AddOp(DeltaPatchApplier::kZero, 2 * kBlock);
+    AddOp(DeltaPatchApplier::kCopy, kBlock, kBlock);
+    EXPECT_FALSE(Apply(patch_.size()));
+    // The applier stays failed.
+    TemporaryFile stream;
+    EXPECT_EQ(applier_->Apply(stream.fd, 0), -1);
+}
+
+TEST_F(DeltaPatchTest, RejectsUnalignedOperations) {
+    AddOp(DeltaPatchApplier::kZero, 100);
+    EXPECT_FALSE(Apply(patch_.size()));
+
+    CreateImage(16 * kBlock);
+    AddOp(DeltaPatchApplier::kCopy, kBlock, kBlock + 512);
+    EXPECT_FALSE(Apply(patch_.size()));
+}
+
+TEST_F(DeltaPatchTest, AcceptsUnalignedFinalOperation) {
+    uint64_t size = 3 * kBlock + 1000;
+    CreateImage(size);
+    AddOp(DeltaPatchApplier::kCopy, 2 * kBlock, kBlock);
+    AddOp(DeltaPatchApplier::kZero, kBlock + 1000);
+    ASSERT_TRUE(Apply(patch_.size()));
+    EXPECT_TRUE(writer_->IsFinishedWriting());
+
+    auto expected = Base(kBlock, 2 * kBlock);
+    expected.insert(expected.end(), kBlock + 1000, 0);
+    EXPECT_EQ(ReadImage(), expected);
+}
+
+TEST_F(DeltaPatchTest, RejectsOperationsPastTheEnd) {
+    AddOp(DeltaPatchApplier::kZero, 17 * kBlock);
+    EXPECT_FALSE(Apply(patch_.size()));
+
+    CreateImage(16 * kBlock);
+    AddOp(DeltaPatchApplier::kCopy, 4 * kBlock, 14 * kBlock);
+    EXPECT_FALSE(Apply(patch_.size()));
+
+    CreateImage(16 * kBlock);
+    AddOp(DeltaPatchApplier::kZero, 0);
+    EXPECT_FALSE(Apply(patch_.size()));
+}
+
+TEST_F(DeltaPatchTest, RejectsMalformedHeaders) {
+    AddOp(3, kBlock);
+    EXPECT_FALSE(Apply(patch_.size()));
+
+    CreateImage(16 * kBlock);
+    AddOp(DeltaPatchApplier::kZero, kBlock, kBlock);
+    EXPECT_FALSE(Apply(patch_.size()));
+}
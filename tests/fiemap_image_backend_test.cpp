@@ -0,0 +1,212 @@
+//
+// Copyright (C) 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "fiemap_image_backend.h"
+
+using namespace android::gsi;
+
+// Slots live under these, and shared images next to the slots' data.
+static constexpr char kMetadataDir[] = "/metadata/gsi/test";
+static constexpr char kDataDir[] = "/data/gsi/test";
+
+static constexpr char kImageName[] = "system_gsi";
+static constexpr uint64_t kImageSize = 64 * 1024 * 1024;
+static const std::string kDigest(64, 'a');
+
+class FiemapImageBackendTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        RemoveAll();
+        for (const auto& dir : {kMetadataDir, kDataDir}) {
+            ASSERT_TRUE(mkdir(dir, 0755) == 0 || errno == EEXIST) << dir;
+        }
+        for (const auto& slot : {"slot1", "slot2"}) {
+            ASSERT_EQ(mkdir(MetadataDir(slot).c_str(), 0755), 0);
+            ASSERT_EQ(mkdir(DataDir(slot).c_str(), 0755), 0);
+        }
+    }
+    void TearDown() override { RemoveAll(); }
+
+    static std::string MetadataDir(const std::string& slot) {
+        return std::string(kMetadataDir) + "/" + slot;
+    }
+    static std::string DataDir(const std::string& slot) {
+        return std::string(kDataDir) + "/" + slot;
+    }
+    static std::string ImagePath(const std::string& slot) {
+        return DataDir(slot) + "/" + kImageName + ".img";
+    }
+
+    std::unique_ptr<FiemapImageBackend> Open(const std::string& slot) {
+        return FiemapImageBackend::Open(MetadataDir(slot), DataDir(slot));
+    }
+
+    // Publishes an image from slot1, and links slot2 to it.
+    void CreateSharedImage() {
+        auto publisher = Open("slot1");
+        ASSERT_NE(publisher, nullptr);
+        ASSERT_TRUE(publisher->CreateBackingImage(kImageName, kImageSize, true, nullptr));
+        ASSERT_TRUE(publisher->ShareBackingImage(kImageName, kDigest));
+
+        auto linked = Open("slot2");
+        ASSERT_NE(linked, nullptr);
+        ASSERT_TRUE(linked->LinkSharedImage(kDigest, kImageName, kImageSize));
+    }
+
+    void ExpectIntact(const std::string& slot,
+                      const std::vector<FiemapImageBackend::DiskRange>& ranges) {
+        struct stat s;
+        ASSERT_EQ(stat(ImagePath(slot).c_str(), &s), 0);
+        EXPECT_EQ(s.st_size, kImageSize);
+        EXPECT_GE(512ULL * s.st_blocks, kImageSize);
+
+        auto images = Open(slot);
+        ASSERT_NE(images, nullptr);
+        ASSERT_TRUE(images->BackingImageExists(kImageName));
+        std::vector<FiemapImageBackend::DiskRange> now;
+        ASSERT_TRUE(images->GetImageRanges(kImageName, &now));
+        ASSERT_EQ(now.size(), ranges.size());
+        for (size_t i = 0; i < ranges.size(); i++) {
+            EXPECT_EQ(now[i].offset, ranges[i].offset);
+            EXPECT_EQ(now[i].length, ranges[i].length);
+        }
+        EXPECT_TRUE(images->Validate());
+    }
+
+    // Maps |kImageName| the way it is written, and checks the size of the
+    // resulting block device.
+    void ExpectMappedSize(FiemapImageBackend* images, uint64_t size) {
+        auto device = images->OpenImageDevice(kImageName);
+        ASSERT_NE(device, nullptr);
+        EXPECT_EQ(GetImageSize(device->fd()), size);
+        device = nullptr;
+        EXPECT_TRUE(images->UnmapImageDevice(kImageName));
+    }
+
+    static void RemoveAll() {
+        for (const auto& slot : {"slot1", "slot2"}) {
+            if (auto images = FiemapImageBackend::Open(MetadataDir(slot), DataDir(slot))) {
+                images->DeleteBackingImage(kImageName);
+            }
+            rmdir(MetadataDir(slot).c_str());
+            rmdir(DataDir(slot).c_str());
+        }
+        FiemapImageBackend::RemoveUnusedSharedImages(DataDir("slot1"));
+        FiemapImageBackend::ShrinkImagePool(DataDir("slot1"), 0);
+        rmdir((std::string(kDataDir) + "/dsu_pool").c_str());
+        rmdir(kMetadataDir);
+        rmdir(kDataDir);
+    }
+};
+
+TEST_F(FiemapImageBackendTest, DeletingPublisherKeepsLinkedImage) {
+    CreateSharedImage();
+    auto publisher = Open("slot1");
+    ASSERT_NE(publisher, nullptr);
+    std::vector<FiemapImageBackend::DiskRange> ranges;
+    ASSERT_TRUE(publisher->GetImageRanges(kImageName, &ranges));
+    ASSERT_FALSE(ranges.empty());
+
+    ASSERT_TRUE(publisher->DeleteBackingImage(kImageName));
+    EXPECT_FALSE(publisher->BackingImageExists(kImageName));
+    EXPECT_NE(access(ImagePath("slot1").c_str(), F_OK), 0);
+    ExpectIntact("slot2", ranges);
+}
+
+TEST_F(FiemapImageBackendTest, DeletingLinkKeepsPublishedImage) {
+    CreateSharedImage();
+    auto linked = Open("slot2");
+    ASSERT_NE(linked, nullptr);
+    std::vector<FiemapImageBackend::DiskRange> ranges;
+    ASSERT_TRUE(linked->GetImageRanges(kImageName, &ranges));
+
+    ASSERT_TRUE(linked->DeleteBackingImage(kImageName));
+    EXPECT_FALSE(linked->BackingImageExists(kImageName));
+    EXPECT_EQ(linked->GetImageAllocation(kImageName), 0);
+    ExpectIntact("slot1", ranges);
+
+    // The published copy goes with its last user.
+    auto publisher = Open("slot1");
+    ASSERT_NE(publisher, nullptr);
+    ASSERT_TRUE(publisher->DeleteBackingImage(kImageName));
+    EXPECT_NE(access((std::string(kDataDir) + "/dsu_shared").c_str(), F_OK), 0);
+}
+
+TEST_F(FiemapImageBackendTest, ExtendedImageMapsAtFullSize) {
+    auto images = Open("slot1");
+    ASSERT_NE(images, nullptr);
+    ASSERT_TRUE(images->CreateBackingImage(kImageName, kImageSize, false, nullptr));
+    if (!FiemapImageBackend::CanMapExtents(DataDir("slot1"))) {
+        // A loop device would only map the image's own file.
+        EXPECT_FALSE(images->ExtendBackingImage(kImageName, 2 * kImageSize, nullptr));
+        ExpectMappedSize(images.get(), kImageSize);
+        return;
+    }
+    ASSERT_TRUE(images->ExtendBackingImage(kImageName, 2 * kImageSize, nullptr));
+    ExpectMappedSize(images.get(), 2 * kImageSize);
+}
+
+TEST_F(FiemapImageBackendTest, PoolImageMapsAtFullSize) {
+    auto data_dir = DataDir("slot1");
+    auto images = Open("slot1");
+    ASSERT_NE(images, nullptr);
+    uint64_t size = 2 * FiemapImageBackend::kImagePoolChunkSize + kImageSize;
+    if (!FiemapImageBackend::CanMapExtents(data_dir)) {
+        EXPECT_FALSE(FiemapImageBackend::AddImagePoolChunk(data_dir, nullptr));
+        EXPECT_FALSE(images->CreateBackingImageFromPool(kImageName, size, false));
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        ASSERT_TRUE(FiemapImageBackend::AddImagePoolChunk(data_dir, nullptr));
+    }
+    ASSERT_EQ(FiemapImageBackend::GetImagePoolSize(data_dir),
+              2 * FiemapImageBackend::kImagePoolChunkSize);
+
+    ASSERT_TRUE(images->CreateBackingImageFromPool(kImageName, size, false));
+    EXPECT_EQ(FiemapImageBackend::GetImagePoolSize(data_dir), 0);
+    ExpectMappedSize(images.get(), size);
+}
+
+TEST_F(FiemapImageBackendTest, ReplacesImageWithItsReplacement) {
+    auto images = Open("slot1");
+    ASSERT_NE(images, nullptr);
+    auto replacement = ImageBackend::GetReplacementName(kImageName);
+    ASSERT_TRUE(images->CreateBackingImage(kImageName, kImageSize, true, nullptr));
+    ASSERT_TRUE(images->CreateBackingImage(replacement, kImageSize, true, nullptr));
+    std::vector<FiemapImageBackend::DiskRange> ranges;
+    ASSERT_TRUE(images->GetImageRanges(replacement, &ranges));
+
+    ASSERT_TRUE(images->ReplaceBackingImage(kImageName));
+    EXPECT_FALSE(images->BackingImageExists(replacement));
+    ExpectIntact("slot1", ranges);
+    ExpectMappedSize(images.get(), kImageSize);
+
+    // A replacement left behind goes with its image.
+    ASSERT_TRUE(images->CreateBackingImage(replacement, kImageSize, true, nullptr));
+    ASSERT_TRUE(images->DeleteBackingImage(kImageName));
+    EXPECT_FALSE(images->BackingImageExists(replacement));
+}
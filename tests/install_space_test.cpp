@@ -0,0 +1,159 @@
+//
+// Copyright (C) 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "file_image_backend.h"
+#include "install_space.h"
+
+using namespace android::gsi;
+
+static constexpr int64_t kMiB = 1024 * 1024;
+
+class InstallSpaceTest : public ::testing::Test {
+  protected:
+    // Images are fully allocated, so that they count towards the space an
+    // install can free.
+    InstallSpaceTest() : images_(dir_.path, false), other_slot_(other_dir_.path, false) {}
+
+    void CreateImage(FileImageBackend* backend, const std::string& name, int64_t size) {
+        ASSERT_TRUE(backend->CreateBackingImage(name, size, true, nullptr));
+        ASSERT_EQ(backend->GetImageAllocation(name), size);
+    }
+
+    TemporaryDir dir_;
+    TemporaryDir other_dir_;
+    FileImageBackend images_;
+    FileImageBackend other_slot_;
+};
+
+TEST_F(InstallSpaceTest, CountsReplacedAndReusedImages) {
+    CreateImage(&images_, "system_gsi", 4 * kMiB);
+    CreateImage(&images_, "product_gsi", 2 * kMiB);
+
+    InstallSpace space;
+    AccountInstallImages(&images_,
+                         {{"system_gsi", 8 * kMiB, true},
+                          {"product_gsi", 2 * kMiB, true},
+                          {"userdata_gsi", 3 * kMiB, false}},
+                         0, kMiB, &space);
+    // product_gsi is reused as it is; system_gsi is replaced.
+    EXPECT_EQ(space.required, 11 * kMiB);
+    EXPECT_EQ(space.replaced, 4 * kMiB);
+    EXPECT_EQ(space.pool, 0);
+    EXPECT_EQ(space.replaced_images, (std::set<std::string>{"system_gsi", "userdata_gsi"}));
+}
+
+TEST_F(InstallSpaceTest, TakesWholeChunksFromThePool) {
+    InstallSpace space;
+    AccountInstallImages(&images_,
+                         {{"system_gsi", 5 * kMiB / 2, true},
+                          {"product_gsi", kMiB / 2, true},
+                          {"userdata_gsi", 8 * kMiB, false}},
+                         6 * kMiB, kMiB, &space);
+    // 2 chunks for system_gsi, none for product_gsi, and the rest of the
+    // pool for userdata_gsi.
+    EXPECT_EQ(space.pool, 6 * kMiB);
+
+    space = {};
+    AccountInstallImages(&images_, {{"system_gsi", 5 * kMiB / 2, true}}, 6 * kMiB, kMiB,
+                         &space);
+    EXPECT_EQ(space.pool, 2 * kMiB);
+}
+
+TEST_F(InstallSpaceTest, ReclaimsDisabledImagesOnce) {
+    CreateImage(&images_, "system_gsi", 4 * kMiB);
+    CreateImage(&images_, "vendor_gsi", kMiB);
+    CreateImage(&other_slot_, "system_gsi", 2 * kMiB);
+
+    InstallSpace space;
+    AccountInstallImages(&images_, {{"system_gsi", 8 * kMiB, true}}, 0, kMiB, &space);
+    ASSERT_EQ(space.replaced, 4 * kMiB);
+
+    // The slot's own system_gsi is already counted as replaced; an image of
+    // the same name in another slot is not.
+    AccountDisabledImage(&images_, "system_gsi", true, &space);
+    AccountDisabledImage(&images_, "vendor_gsi", true, &space);
+    AccountDisabledImage(&other_slot_, "system_gsi", false, &space);
+    EXPECT_EQ(space.reclaimable, 3 * kMiB);
+}
+
+TEST_F(InstallSpaceTest, SharedImagesFreeNothing) {
+    CreateImage(&other_slot_, "system_gsi", 2 * kMiB);
+    ASSERT_EQ(link(other_slot_.GetImagePath("system_gsi").c_str(),
+                   images_.GetImagePath("system_gsi").c_str()),
+              0);
+
+    InstallSpace space;
+    AccountInstallImages(&images_, {{"system_gsi", 4 * kMiB, true}}, 0, kMiB, &space);
+    EXPECT_EQ(space.replaced, 0);
+    AccountDisabledImage(&other_slot_, "system_gsi", false, &space);
+    EXPECT_EQ(space.reclaimable, 0);
+}
+
+TEST_F(InstallSpaceTest, ChecksFreeSpace) {
+    InstallSpace space;
+    space.total = 100 * kMiB;
+    space.required = 10 * kMiB;
+    space.replaced = 5 * kMiB;
+    space.pool = 5 * kMiB;
+
+    // The images always need to fit.
+    space.free = 0;
+    EXPECT_EQ(CheckInstallSpace(&space), SpaceCheck::kNoSpace);
+    EXPECT_EQ(space.headroom, 0);
+
+    // Even if they fit, 40% of the filesystem has to be free.
+    space.free = 29 * kMiB;
+    EXPECT_EQ(CheckInstallSpace(&space), SpaceCheck::kCluttered);
+    EXPECT_FALSE(space.needs_reclaim);
+
+    space.free = 30 * kMiB;
+    EXPECT_EQ(CheckInstallSpace(&space), SpaceCheck::kOk);
+    EXPECT_FALSE(space.needs_reclaim);
+    EXPECT_EQ(space.headroom, 30 * kMiB);
+}
+
+TEST_F(InstallSpaceTest, ReclaimsOnlyWhenNeeded) {
+    InstallSpace space;
+    space.total = 100 * kMiB;
+    space.required = 10 * kMiB;
+    space.free = 35 * kMiB;
+    space.reclaimable = 20 * kMiB;
+
+    EXPECT_EQ(CheckInstallSpace(&space), SpaceCheck::kOk);
+    EXPECT_TRUE(space.needs_reclaim);
+    EXPECT_EQ(space.headroom, 45 * kMiB);
+
+    // Once the disabled images are gone, nothing more is needed.
+    space.free += space.reclaimable;
+    space.reclaimable = 0;
+    EXPECT_EQ(CheckInstallSpace(&space), SpaceCheck::kOk);
+    EXPECT_FALSE(space.needs_reclaim);
+    EXPECT_EQ(space.headroom, 45 * kMiB);
+
+    // Removing them is no use if it still does not fit.
+    space.free = 5 * kMiB;
+    space.reclaimable = 4 * kMiB;
+    EXPECT_EQ(CheckInstallSpace(&space), SpaceCheck::kNoSpace);
+    EXPECT_FALSE(space.needs_reclaim);
+}